@@ -9,6 +9,10 @@
 #include "string.h"
 #include "fuse.h"
 #include <stddef.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <linux/falloc.h>
 #include "ddriver.h"
 #include "errno.h"
 #include "types.h"
@@ -36,15 +40,24 @@ int   			   naivefs_write(const char *, const char *, size_t, off_t,
 					                  struct fuse_file_info *);
 int   			   naivefs_read(const char *, char *, size_t, off_t,
 					                 struct fuse_file_info *);
+int   			   naivefs_write_buf(const char *, struct fuse_bufvec *, off_t,
+					                      struct fuse_file_info *);
+int   			   naivefs_read_buf(const char *, struct fuse_bufvec **, size_t, off_t,
+					                     struct fuse_file_info *);
 int   			   naivefs_access(const char *, int);
 int   			   naivefs_unlink(const char *);
 int   			   naivefs_rmdir(const char *);
 int   			   naivefs_rename(const char *, const char *);
 int   			   naivefs_utimens(const char *, const struct timespec tv[2]);
 int   			   naivefs_truncate(const char *, off_t);
+int   			   naivefs_fallocate(const char *, int, off_t, off_t, struct fuse_file_info *);
+int   			   naivefs_fsync(const char *, int, struct fuse_file_info *);
+int   			   naivefs_flush(const char *, struct fuse_file_info *);
+int   			   naivefs_fsyncdir(const char *, int, struct fuse_file_info *);
 			
 int   			   naivefs_open(const char *, struct fuse_file_info *);
 int   			   naivefs_opendir(const char *, struct fuse_file_info *);
+int   			   naivefs_releasedir(const char *, struct fuse_file_info *);
 
 /******************************************************************************
 * SECTION: naivefs_funct.c
@@ -52,21 +65,216 @@ int   			   naivefs_opendir(const char *, struct fuse_file_info *);
 int                naivefs_mount(struct custom_options nfs_options);
 int                naivefs_umount();
 struct nfs_dentry* nfs_lookup(const char * path, int* is_find, int* is_root);
+struct nfs_dentry* nfs_lookup_rcu(const char * path, int* is_find, int* is_root);
 int                nfs_calc_lvl(const char * path);
 char* 			   nfs_get_name(const char* path);
 /******************************************************************************
+* SECTION: naivefs_dcache.c
+*******************************************************************************/
+int                nfs_dcache_init(int max_entries);
+struct nfs_dentry* nfs_dcache_get(const char* path, int* is_find, int* is_root);
+int                nfs_dcache_put(const char* path, struct nfs_dentry* dentry, int is_find,
+                                  int is_root, int miss_ofs);
+void               nfs_dcache_invalidate_create(struct nfs_dentry* parent, const char* name);
+void               nfs_dcache_invalidate_tree(struct nfs_dentry* dentry);
+void               nfs_dcache_invalidate_children(struct nfs_inode* inode);
+void               nfs_dcache_destroy();
+/******************************************************************************
 * SECTION: naivefs_driver.c
 *******************************************************************************/
+void 			   nfs_dev_lock();
+void 			   nfs_dev_unlock();
 int 			   nfs_driver_read(int offset, uint8_t* out_content, int size);
 int 			   nfs_driver_write(int offset, uint8_t* in_content, int size);
+int 			   nfs_driver_read_raw(int offset, uint8_t* out_content, int size);
+int 			   nfs_driver_write_raw(int offset, uint8_t* in_content, int size);
+int 			   nfs_driver_readv(struct nfs_iovec* iov, int cnt);
+int 			   nfs_driver_writev(struct nfs_iovec* iov, int cnt);
+int 			   nfs_driver_readv_raw(struct nfs_iovec* iov, int cnt);
+int 			   nfs_driver_writev_raw(struct nfs_iovec* iov, int cnt);
+uint8_t* 		   nfs_driver_map(int offset, int size);
+int 			   nfs_driver_sync();
+int 			   nfs_driver_splice_in(int offset, struct fuse_bufvec* src, int size);
+int 			   nfs_iovec_cmp(const void* a, const void* b);
+int 			   nfs_iolist_add(struct nfs_iolist* list, int offset, uint8_t* buf, int size);
+uint8_t* 		   nfs_iolist_alloc(struct nfs_iolist* list, int offset, int size);
+void 			   nfs_iolist_free(struct nfs_iolist* list);
+
+/******************************************************************************
+* SECTION: naivefs_backend.c
+*******************************************************************************/
+int 			   nfs_backend_open(const char* name, const char* path);
+int 			   nfs_img_open(const char* path);
+int 			   nfs_img_ioctl(int fd, unsigned long cmd, void* ret);
+void 			   nfs_img_account(int offset, int size, int is_write);
+int 			   nfs_img_pio(int fd, int offset, uint8_t* buf, int size, int is_write);
+int 			   nfs_img_sync(int fd);
+
+/******************************************************************************
+* SECTION: naivefs_uring.c
+*******************************************************************************/
+struct nfs_backend* nfs_uring_backend();
+
+/******************************************************************************
+* SECTION: naivefs_mmap.c
+*******************************************************************************/
+struct nfs_backend* nfs_mmap_backend();
+
+/******************************************************************************
+* SECTION: naivefs_cache.c
+*******************************************************************************/
+int 			   nfs_cache_init(int size);
+int 			   nfs_cache_enabled();
+int 			   nfs_cache_read(int offset, uint8_t* out_content, int size);
+int 			   nfs_cache_write(int offset, uint8_t* in_content, int size);
+int 			   nfs_cache_readv(struct nfs_iovec* iov, int cnt);
+int 			   nfs_cache_writev(struct nfs_iovec* iov, int cnt);
+int 			   nfs_cache_cached(int offset, int size);
+int 			   nfs_cache_flush();
+int 			   nfs_cache_destroy();
+
+/******************************************************************************
+* SECTION: naivefs_bitmap.c
+*******************************************************************************/
+int 			   nfs_bmap_sum_blks(int nchunks);
+int 			   nfs_bmap_init(struct nfs_bitmap* bm, uint8_t* map, int nbits, int chunk_bits,
+								 int offset, int stride, int sum_offset, int is_init);
+int 			   nfs_bmap_alloc(struct nfs_bitmap* bm, int goal);
+int 			   nfs_bmap_alloc_run(struct nfs_bitmap* bm, int n, int goal);
+int 			   nfs_bmap_alloc_at(struct nfs_bitmap* bm, int start, int n);
+void 			   nfs_bmap_free(struct nfs_bitmap* bm, int start, int n);
+int 			   nfs_bmap_collect(struct nfs_bitmap* bm, struct nfs_iolist* list);
+void 		   nfs_bmap_settle(struct nfs_bitmap* bm, int ok);
+int 			   nfs_bmap_avail(struct nfs_bitmap* bm);
+int 			   nfs_bmap_chunk_avail(struct nfs_bitmap* bm, int c);
+int 			   nfs_bmap_test(struct nfs_bitmap* bm, int bit);
+void 			   nfs_bmap_destroy(struct nfs_bitmap* bm);
+
+/******************************************************************************
+* SECTION: naivefs_extent.c
+*******************************************************************************/
+void 			   nfs_extent_init(struct nfs_inode* inode);
+void 			   nfs_extent_destroy(struct nfs_inode* inode);
+int 			   nfs_extent_map(struct nfs_inode* inode, int lblk);
+int 			   nfs_extent_grow(struct nfs_inode* inode, int n);
+int 			   nfs_extent_delay(struct nfs_inode* inode, int n);
+int 			   nfs_extent_delalloc(struct nfs_inode* inode, int extra);
+void 			   nfs_extent_truncate(struct nfs_inode* inode, int n);
+void 			   nfs_extent_release(struct nfs_inode* inode);
+int 			   nfs_extent_iolist(struct nfs_inode* inode, struct nfs_iolist* list, int lblk,
+									 int n, uint8_t* buf);
+int 			   nfs_extent_load(struct nfs_inode* inode, const struct nfs_inode_d* inode_d);
+int 			   nfs_extent_store(struct nfs_inode* inode, struct nfs_inode_d* inode_d,
+									 struct nfs_iolist* list);
+
+/******************************************************************************
+* SECTION: naivefs_page.c
+*******************************************************************************/
+int 			   nfs_page_init(int size);
+int 			   nfs_page_read(struct nfs_inode* inode, uint8_t* buf, int offset, int size);
+int 			   nfs_page_write(struct nfs_inode* inode, const uint8_t* buf, int offset,
+								  int size);
+int 			   nfs_page_zero(struct nfs_inode* inode, int begin, int end);
+int 			   nfs_page_cached(struct nfs_inode* inode, int lblk);
+void 			   nfs_page_discard(struct nfs_inode* inode, int begin, int end);
+void 			   nfs_page_truncate(struct nfs_inode* inode, int n);
+void 			   nfs_page_remap(struct nfs_inode* inode, int begin, int end);
+int 			   nfs_page_delay_room();
+int 			   nfs_page_collect(struct nfs_inode* inode, struct nfs_iolist* list);
+void 		   nfs_page_clean(struct nfs_inode* inode);
+void 			   nfs_page_destroy();
+
+/******************************************************************************
+* SECTION: naivefs_journal.c
+*******************************************************************************/
+int 			   nfs_journal_init(int is_init);
+int 			   nfs_journal_commit(struct nfs_iovec* iov, int cnt);
+int 			   nfs_journal_checkpoint();
+int 			   nfs_journal_revoke(struct nfs_iovec* iov, int cnt);
+void 			   nfs_journal_lock();
+void 			   nfs_journal_unlock();
+int 			   nfs_journal_pinned(int offset, int size);
+void 			   nfs_journal_overlay(int offset, uint8_t* buf, int size);
+void 			   nfs_journal_destroy();
+
+/******************************************************************************
+* SECTION: naivefs_sync.c
+*******************************************************************************/
+void 			   nfs_dirty_inode(struct nfs_inode* inode);
+void 			   nfs_dirty_dir_block(struct nfs_inode* inode, int blk);
+void 			   nfs_dirty_data(struct nfs_inode* inode, int n);
+void 			   nfs_dirty_clear(struct nfs_inode* inode);
+int 			   nfs_sync_inode(struct nfs_inode* inode);
+int 			   nfs_sync_expired(time_t before);
+int 			   nfs_sync_all();
+void 			   nfs_sync_balance();
+int 			   nfs_flush_start(int dirty_kb, int age);
+void 			   nfs_flush_stop();
+
+/******************************************************************************
+* SECTION: naivefs_lock.c
+*******************************************************************************/
+void 			   nfs_ns_lock(int mode);
+void 			   nfs_ns_unlock();
+void 			   nfs_inode_rdlock(struct nfs_inode* inode);
+void 			   nfs_inode_wrlock(struct nfs_inode* inode);
+void 			   nfs_inode_unlock(struct nfs_inode* inode);
+struct nfs_inode*  nfs_inode_get(struct nfs_dentry* dentry);
+struct nfs_inode*  nfs_inode_peek(struct nfs_dentry* dentry);
+
+/******************************************************************************
+* SECTION: naivefs_rcu.c
+*******************************************************************************/
+int 			   nfs_rcu_read_lock();
+void 			   nfs_rcu_read_unlock();
+void 			   nfs_rcu_retire(void* ptr, void (*fn)(void*));
+void 			   nfs_rcu_reclaim();
+void 			   nfs_rcu_synchronize();
+void 			   nfs_rcu_destroy();
+
+/******************************************************************************
+* SECTION: naivefs_slab.c
+*******************************************************************************/
+void 			   nfs_slab_init(struct nfs_slab* slab, const char* name, int obj_sz);
+void* 			   nfs_slab_alloc(struct nfs_slab* slab);
+void 			   nfs_slab_free(struct nfs_slab* slab, void* obj);
+long 			   nfs_slab_usage(struct nfs_slab* slab);
+void 			   nfs_slab_destroy(struct nfs_slab* slab);
+const char* 	   nfs_name_intern(struct nfs_inode* inode, const char* name, int len);
+long 			   nfs_name_usage();
+void 			   nfs_name_destroy(struct nfs_inode* inode);
+
+/******************************************************************************
+* SECTION: naivefs_icache.c
+*******************************************************************************/
+void 			   nfs_icache_init(int limit_kb);
+void 			   nfs_icache_add(struct nfs_inode* inode);
+void 			   nfs_icache_del(struct nfs_inode* inode);
+int 			   nfs_icache_shrink();
+void 			   nfs_icache_balance();
+void 			   nfs_icache_destroy();
 
 /******************************************************************************
 * SECTION: naivefs_struct.c
 *******************************************************************************/
+struct nfs_dentry* new_dentry(struct nfs_inode* dir, const char* name, FILE_TYPE ftype);
 struct nfs_inode*  nfs_alloc_inode(struct nfs_dentry * dentry);
+int 			   nfs_dir_link(struct nfs_inode* inode, struct nfs_dentry* dentry, int blk);
 int 			   nfs_alloc_dentry(struct nfs_inode* inode, struct nfs_dentry* dentry);
+int 			   nfs_drop_dentry(struct nfs_inode* inode, struct nfs_dentry* dentry);
+void 			   nfs_free_dentry(struct nfs_dentry* dentry);
+void 			   nfs_inode_release(struct nfs_inode* inode);
+int 			   nfs_release_dentry(struct nfs_dentry* dentry);
+void 		   nfs_dir_handle_put(struct nfs_dentry* dentry);
+long 			   nfs_evict_inode(struct nfs_inode* inode);
+int 			   nfs_inline_migrate(struct nfs_inode* inode);
+int 			   nfs_inode_resize(struct nfs_inode* inode, int size);
+int 			   nfs_inode_prealloc(struct nfs_inode* inode, int end, int keep_size);
+int 			   nfs_dir_blks_reserve(struct nfs_inode* inode, int n);
 struct nfs_inode*  nfs_read_inode(struct nfs_dentry * dentry, int ino);
-int 			   nfs_sync_inode(struct nfs_inode * inode);
 struct nfs_dentry* nfs_get_dentry(struct nfs_inode * inode, int dir);
+int                nfs_dir_index_insert(struct nfs_inode* inode, struct nfs_dentry* dentry);
+void               nfs_dir_index_remove(struct nfs_inode* inode, struct nfs_dentry* dentry);
+struct nfs_dentry* nfs_dir_lookup(struct nfs_inode* inode, const char* name, int len);
 
 #endif  /* _naivefs_H_ */
\ No newline at end of file
@@ -6,7 +6,12 @@
 *******************************************************************************/
 
 #define MAX_NAME_LEN            128     
-#define MAX_INODE_PTR           6         // 一个inode最多指向的数据块数
+#define NFS_INODE_EXTENTS       16        // inode中直接存放的区间数，更多的区间存放在区间树中
+#define NFS_INODE_SZ            256       // inode表中每条记录的长度，即sizeof(struct nfs_inode_d)
+#define NFS_INODE_INLINE        224       // inode记录中可内联的数据长度，即记录长度减去记录头
+#define NFS_INODE_F_INLINE      0x1       // 文件数据或目录项内联在inode记录中，不占数据块
+#define NFS_FORMAT_VERSION      6         // 磁盘格式版本，版本3起目录项为变长记录，版本4起支持内联数据，
+                                          // 版本5起位图有空闲计数摘要，版本6起按块组布局
 
 #define NFS_SUPER_OFS           0         // super block偏移
 #define NFS_ROOT_INO            0         // root ino号
@@ -14,12 +19,57 @@
 #define NFS_BLK_PER_FILE        6
 #define NFS_INO_PER_FILE        1
 
+#define NFS_GROUP_BMAP_BLKS     2         // 每个块组开头的位图块数：inode位图和数据位图各一块
+#define NFS_GROUP_MIN_CNT       4         // 小磁盘上至少划分的块组数
+
 #define NFS_ERROR_NONE          0  
 #define NFS_ERROR_IO            EIO
 #define NFS_ERROR_NOSPACE       ENOSPC
 #define NFS_ERROR_NOTFOUND      ENOENT
 #define NFS_ERROR_EXISTS        EEXIST
 #define NFS_ERROR_UNSUPPORTED   ENXIO
+#define NFS_ERROR_NOTEMPTY      ENOTEMPTY
+#define NFS_ERROR_INVAL         EINVAL
+#define NFS_ERROR_ISDIR         EISDIR
+#define NFS_ERROR_NOTDIR        ENOTDIR
+#define NFS_ERROR_FBIG          EFBIG
+#define NFS_ERROR_BUSY          EBUSY
+#define NFS_ERROR_OPNOTSUPP     EOPNOTSUPP
+
+#define NFS_CACHE_DEFAULT_KB    256       // 默认块缓存容量(KB)
+#define NFS_CACHE_HASH_LOAD     2         // 哈希桶数 = 缓存块数 * NFS_CACHE_HASH_LOAD
+
+#define NFS_PAGE_DEFAULT_KB     4096      // 默认文件页缓存容量(KB)
+#define NFS_PAGE_BATCH          64        // 文件读写每批最多载入的页数
+#define NFS_DELALLOC_MAX        256       // 每个文件最多推迟分配的数据块数，超过后立即分配
+
+#define NFS_DIRTY_DEFAULT_KB    1024      // 默认脏数据上限(KB)，超过后唤醒后台写回线程
+#define NFS_FLUSH_DEFAULT_AGE   5         // 默认脏数据最长停留时间(秒)
+#define NFS_FLUSH_TICK          1         // 后台写回线程检查间隔(秒)
+
+#define NFS_LOCK_SHARED         0         // 命名空间锁：不删除目录项的请求，可并发
+#define NFS_LOCK_EXCL           1         // 命名空间锁：删除目录项或写回，独占
+
+#define NFS_JOURNAL_BLKS        256       // 日志区块数上限，实际不超过磁盘块数的1/16
+#define NFS_JOURNAL_MAGIC       0x4a4e4c31  // 日志头块幻数
+#define NFS_JDESC_MAGIC         0x4a445343  // 日志描述块幻数
+#define NFS_JOURNAL_HASH_SZ     512       // 待检查点块哈希桶数，须为2的幂
+
+#define NFS_IMG_IO_SZ           512       // 磁盘镜像后端的IO单位
+#define NFS_URING_QD            32        // io_uring队列深度
+#define NFS_URING_CHUNK         (128 * 1024)  // io_uring单个请求的最大长度
+#define NFS_MMAP_PREFETCH       (32 * 1024)   // 内存映射后端一段连续读不小于该长度时预取
+
+#define NFS_ICACHE_DEFAULT_KB   65536     // 默认目录项和inode缓存的内存上限(KB)
+
+#define NFS_DIR_HASH_MIN        8         // 目录哈希索引的初始桶数
+#define NFS_DCACHE_MAX          4096      // 路径缓存最多缓存的路径数
+#define NFS_DCACHE_HASH_SZ      8192      // 路径缓存哈希桶数，须为2的幂
+#define NFS_DCACHE_HIT_BATCH    1024      // 线程内累积的命中次数达到该值时计入总数
+
+#define NFS_SLAB_CHUNK_SZ       (64 * 1024)   // 对象缓存每次向系统申请的内存大小
+#define NFS_NAME_CHUNK_MIN      64        // 目录名字区第一块的大小
+#define NFS_NAME_CHUNK_MAX      4096      // 目录名字区每块的最大长度
 
 #define UINT8_BITS              8
 
@@ -31,14 +81,28 @@
 #define NFS_DISK_SZ()                   (super.size_disk)
 #define NFS_BLK_NUM()                   (super.size_disk / (super.size_io * 2))
 #define NFS_DRIVER()                    (super.driver_fd)
+#define NFS_BACKEND()                   (super.backend)
 
 #define NFS_ROUND_DOWN(value, round)    (value % round == 0 ? value : (value / round) * round) 
 #define NFS_ROUND_UP(value, round)      (value % round == 0 ? value : (value / round + 1) * round)
 
 #define NFS_IS_DIR(pinode)              (pinode->dentry->ftype == NFS_DIR)
 
-#define NFS_INO_OFS(ino)                (super.inode_offset + ino * NFS_BLK_SZ())
-#define NFS_DATA_OFS(ino)               (super.data_offset + ino * NFS_BLK_SZ() * NFS_BLK_PER_FILE)    
+#define NFS_INO_PER_BLK()               (super.ino_per_blk)
+#define NFS_GROUP_OFS(grp)              (super.group_offset + (grp) * super.group_blks * NFS_BLK_SZ())
+#define NFS_INO_GROUP(ino)              ((ino) / super.ino_per_group)
+#define NFS_DATA_GROUP(blk)             ((blk) / super.data_per_group)
+#define NFS_INO_BLK_OFS(ino)            (NFS_GROUP_OFS(NFS_INO_GROUP(ino)) + (NFS_GROUP_BMAP_BLKS \
+                                         + (ino) % super.ino_per_group / NFS_INO_PER_BLK()) * NFS_BLK_SZ())
+#define NFS_INO_OFS(ino)                (NFS_INO_BLK_OFS(ino) + (ino) % NFS_INO_PER_BLK() * NFS_INODE_SZ)
+#define NFS_DATA_OFS(blk)               (NFS_GROUP_OFS(NFS_DATA_GROUP(blk)) + (NFS_GROUP_BMAP_BLKS \
+                                         + super.itable_blks + (blk) % super.data_per_group) * NFS_BLK_SZ())
+#define NFS_DENTRY_LEN(name_len)        ((int)(offsetof(struct nfs_dentry_d, name) + (name_len) + 3) & ~3)
+#define NFS_EXT_PER_BLK()               (NFS_BLK_SZ() / (int)sizeof(struct nfs_extent_d))
+#define NFS_EXT_IDX_PER_BLK()           (NFS_BLK_SZ() / (int)sizeof(int))
+#define NFS_JNL_OFS(blk)                (super.journal_offset + (blk) * NFS_BLK_SZ())
+#define NFS_JDESC_PER_BLK()             ((NFS_BLK_SZ() - (int)sizeof(struct nfs_jdesc_d)) / (int)sizeof(int))
+#define NFS_JNL_BATCH()                 ((super.journal_blks - 1) / 4 > 0 ? (super.journal_blks - 1) / 4 : 1)
 
 /******************************************************************************
 * SECTION: FS Specific Structure - In memory structure
@@ -46,6 +110,7 @@
 
 struct nfs_inode;
 struct nfs_dentry;
+struct nfs_dcache_entry;
 
 typedef enum file_type {
     NFS_FILE,           // 普通文件
@@ -54,26 +119,111 @@ typedef enum file_type {
 
 struct custom_options {
 	char*                  device;
+	char*                  backend;           // 设备后端: ddriver / pio / uring
+	int                    cache_kb;          // 块缓存容量(KB)，0表示不使用缓存
+	int                    page_kb;           // 文件页缓存容量(KB)
+	int                    dirty_kb;          // 脏数据上限(KB)，0表示不按数量写回
+	int                    flush_age;         // 脏数据最长停留时间(秒)，0表示不按时间写回
+	int                    icache_kb;         // 目录项和inode缓存的内存上限(KB)，0表示不回收
+};
+
+struct nfs_iovec;
+
+struct nfs_backend {
+    const char*        name;
+    int                (*open)(const char* path);                       // 返回设备handler
+    int                (*close)(int fd);
+    int                (*ioctl)(int fd, unsigned long cmd, void* ret);  // 同ddriver的IOC_协议
+    int                (*readv)(int fd, struct nfs_iovec* iov, int cnt);
+    int                (*writev)(int fd, struct nfs_iovec* iov, int cnt);
+    int                is_file;                                         // 设备是磁盘镜像文件，设备偏移即文件偏移
+    int                (*sync)(int fd);                                 // 已写入的内容落盘，可以为NULL
+    uint8_t*           (*map)(int fd, int offset, int size);            // 设备区间在内存中的地址，可以为NULL
+};
+
+struct nfs_extent {
+    int                lblk;              // 起始逻辑块号
+    int                start;             // 起始数据块号
+    int                len;               // 块数
+};
+
+struct nfs_slab {
+    const char*        name;              // 统计输出中的名字
+    int                obj_sz;            // 对象大小，按指针对齐
+    int                per_chunk;         // 每块内存切出的对象数
+    void*              free;              // 空闲对象链表，链表指针存放在对象开头
+    void*              chunks;            // 已申请的内存块链表，链表指针存放在块开头
+    int                chunk_cnt;         // 已申请的内存块数
+    int                in_use;            // 已分配的对象数
+    pthread_mutex_t    lock;              // 保护空闲链表
+};
+
+struct nfs_name_chunk {
+    struct nfs_name_chunk* next;          // 更早申请的块
+    int                size;              // buf长度
+    int                used;              // 已使用的字节数
+    char               buf[];
+};
+
+struct nfs_name_arena {
+    struct nfs_name_chunk* chunks;        // 名字块链表，第一块是正在追加的块
+    int                used;              // 已分配出的字节数
+    int                live;              // 仍在目录中的目录项名字占用的字节数
+};
+
+struct nfs_bitmap {
+    uint8_t*           map;               // 位图内存，每区一块，区在第一次使用时才读入
+    int                nbits;             // 可分配的位数
+    int                free;              // 空闲位数
+    int                nchunks;           // 区数，每个块组一区
+    int                chunk_bits;        // 每区的位数
+    int                chunk_words;       // 每区的64位字数
+    int*               chunk_free;        // 每个区的空闲位数，即磁盘上的空闲计数摘要
+    int*               chunk_hint;        // 每个区下一次分配开始查找的位置
+    uint8_t*           chunk_loaded;      // 每个区是否已读入
+    uint8_t*           chunk_dirty;       // 每个区是否需要写回: 0干净，1脏，2写回中
+    pthread_mutex_t*   chunk_lock;        // 每个区的锁，保护该区的分配与写回
+    uint8_t*           sum_dirty;         // 摘要的每个块是否需要写回，取值同chunk_dirty
+    int                sum_blks;          // 摘要占用的块数
+    int                offset;            // 第一区在磁盘上的偏移
+    int                stride;            // 相邻两区在磁盘上的距离
+    int                sum_offset;        // 摘要在磁盘上的偏移
+    int                loads;             // 从磁盘读入的区数
 };
 
 struct nfs_super {
     int                driver_fd;         // 控制的设备号
+    struct nfs_backend* backend;          // 设备后端
     int                size_disk;         // 磁盘大小
     int                size_io;           // 驱动读写大小
     int                size_usage;        // 磁盘已用大小
     int                max_ino;           // 最多支持的文件数
     int                max_data;          // 总数据块数
-    int                max_dentry;        // 每个数据块最多支持的目录项数
-    uint8_t*           map_inode;         // inode位图指针
-    int                map_inode_blks;    // inode位图占用的块数
-    int                map_inode_offset;  // inode位图在磁盘上的偏移
-    uint8_t*           map_data;          // data位图指针
-    int                map_data_blks;     // data位图占用的块数
-    int                map_data_offset;   // data位图在磁盘上的偏移
-    int                inode_offset;      // inode在磁盘上的偏移
-    int                data_offset;       // 数据块在磁盘上的偏移
+    uint8_t*           map_inode;         // inode位图指针，每个块组一块
+    uint8_t*           map_data;          // data位图指针，每个块组一块
+    int                group_offset;      // 第一个块组在磁盘上的偏移
+    int                group_cnt;         // 块组数，最后一组的数据块可能不满
+    int                group_blks;        // 每个块组的块数
+    int                ino_per_group;     // 每个块组的inode数
+    int                data_per_group;    // 每个块组的数据块数
+    int                itable_blks;       // 每个块组inode表的块数
+    int                sum_inode_offset;  // inode位图空闲计数摘要在磁盘上的偏移
+    int                sum_data_offset;   // data位图空闲计数摘要在磁盘上的偏移
+    struct nfs_bitmap  bmap_inode;        // inode位图分配器
+    struct nfs_bitmap  bmap_data;         // data位图分配器
+    int                data_delayed;      // 推迟分配的文件预留的数据块数
+    struct nfs_slab    dentry_slab;       // 目录项的对象缓存
+    struct nfs_slab    inode_slab;        // inode的对象缓存
+    int                ino_per_blk;       // inode表每块存放的inode数
+    int                journal_offset;    // 日志区在磁盘上的偏移
+    int                journal_blks;      // 日志区块数，0表示不使用日志
+    uint32_t           version;           // 磁盘格式版本
     int                is_mounted;        // 文件系统是否已被装载
     struct nfs_dentry* root_dentry;       // 根目录
+    struct nfs_inode*  dirty_head;        // 脏inode链表，按变脏的先后排列
+    struct nfs_inode*  dirty_tail;
+    int                dirty_blks;        // 待写回的inode、目录块和文件页总数
+    int                dirty_meta;        // 待经日志提交的inode和目录块数
 };
 
 struct nfs_inode {
@@ -82,31 +232,205 @@ struct nfs_inode {
     int                 dir_cnt;                 // 目录项数量
     struct nfs_dentry*  dentry;                  // 指向该inode的目录项
     struct nfs_dentry*  dentrys;                 // 该inode指向的第一个目录项
-    int                 blocks[MAX_INODE_PTR];   // 磁盘数据块指针
-    uint8_t*            data;                    // 文件内的数据        
+    struct nfs_dentry** dir_hash;                // 目录项哈希索引，按名字哈希分桶
+    int                 dir_hash_sz;             // 哈希索引桶数
+    int                 dir_gen;                 // 目录项被删除的次数，用于判断readdir游标是否失效
+    struct nfs_extent*  extents;                 // 数据块区间，按逻辑块号排列
+    int                 ext_cnt;                 // 区间数
+    int                 ext_cap;                 // extents数组容量
+    int                 blk_cnt;                 // 已分配的数据块数
+    int                 delay_cnt;               // 紧接已分配块之后、推迟到写回时分配的块数
+    int                 ext_root;                // 区间树索引块，-1表示区间全部在inode中
+    int*                ext_leaves;              // 区间树叶子块
+    int                 ext_leaf_cnt;            // 区间树叶子块数
+    struct nfs_page**   pages;                   // 逻辑块号 -> 已载入的文件页
+    int                 page_cap;                // pages数组容量
+    struct nfs_dentry** dir_blk_dentrys;         // 每个目录块中的目录项链表
+    int*                dir_blk_used;            // 每个目录块中目录项记录占用的字节数
+    uint8_t*            dir_dirty;               // 每个目录块是否需要写回
+    int                 dir_blk_cap;             // 以上三个数组的容量
+    int                 is_inline;               // 数据内联在inode记录中，内联目录的目录项视为在第0块
+    uint8_t*            inline_data;             // 内联的文件数据，长度与文件大小相同
+    struct nfs_name_arena names;                 // 目录项名字区
+    int                 dirty;                   // 磁盘inode是否需要写回
+    int                 on_dirty;                // 是否在脏inode链表中
+    int                 dirty_blks;              // 待写回的块数(inode、目录块、文件页)
+    time_t              dirty_since;             // 挂上脏inode链表的时间
+    struct nfs_inode*   dirty_prev;              // 脏inode链表
+    struct nfs_inode*   dirty_next;
+    int                 pin;                     // 打开着的目录句柄数，大于0时不回收
+    int                 removed;                 // 已删除但还有句柄打开，最后一个句柄关闭时释放
+    int                 lru_ref;                 // 访问位，回收时给被访问过的inode第二次机会
+    int                 on_lru;                  // 是否在已加载inode链表中
+    struct nfs_inode*   lru_prev;                // 已加载inode链表
+    struct nfs_inode*   lru_next;
+    pthread_rwlock_t    lock;                    // 增删目录项、修改文件数据取写锁，查找和读取取读锁
 };
 
 struct nfs_dentry {
-    char               name[MAX_NAME_LEN];   // 文件名
+    const char*        name;                 // 文件名，存放在父目录的名字区中
     FILE_TYPE          ftype;                // 文件类型
     struct nfs_dentry* parent;               // 上一级目录项
     struct nfs_dentry* brother;              // 同级目录的目录项  
     uint32_t           ino;                  // 对应inode的inode号        
     struct nfs_inode*  inode;                // 指向inode
     int                valid;                // 该目录项是否有效
+    uint32_t           hash;                 // 文件名哈希
+    struct nfs_dentry* hash_next;            // 父目录哈希索引中同一桶的下一个目录项
+    struct nfs_dcache_entry* dcache_refs;    // 引用该目录项的路径缓存表项
+    int                blk;                  // 所在的父目录数据块，-1表示不在目录中
+    struct nfs_dentry* blk_next;             // 同一目录块中的下一个目录项
 };
 
-static inline struct nfs_dentry* new_dentry(char* name, FILE_TYPE ftype) {
-    struct nfs_dentry* dentry = (struct nfs_dentry*)malloc(sizeof(struct nfs_dentry));
-    memset(dentry, 0, sizeof(struct nfs_dentry));
-    memcpy(dentry->name, name, strlen(name));
-    dentry->ftype = ftype;
-    dentry->ino = -1;
-    dentry->inode = NULL;
-    dentry->parent = NULL;
-    dentry->brother = NULL;
+/* FNV-1a */
+static inline uint32_t nfs_name_hash(const char* name, int len) {
+    uint32_t hash = 2166136261u;
+    int      i;
+    for (i = 0; i < len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
 }
 
+/* 目录句柄持有目录inode的pin：打开期间目录不会被回收，被rmdir或rename替换后
+   内存结构保留到最后一个句柄关闭。cursor只在gen与目录的dir_gen相同时使用 */
+struct nfs_dir_handle {
+    struct nfs_dentry* dentry;               // 打开的目录
+    struct nfs_dentry* cursor;               // 下一次readdir开始的目录项
+    off_t              offset;               // cursor对应的readdir偏移
+    int                gen;                  // 保存游标时目录的dir_gen
+};
+
+struct nfs_dcache_entry {
+    char*              path;                 // 完整路径
+    uint32_t           hash;                 // 路径哈希
+    struct nfs_dentry* dentry;               // nfs_lookup返回的dentry
+    int                is_find;              // 0表示负缓存
+    int                is_root;
+    int                miss_ofs;             // 负缓存中缺失的路径分量在path中的下标
+    int                ref;                  // 访问位，淘汰时给被访问过的表项第二次机会
+    struct nfs_dcache_entry* hash_next;      // 同一哈希桶的下一个表项
+    struct nfs_dcache_entry* ref_next;       // 引用同一dentry的下一个表项
+    struct nfs_dcache_entry* lru_prev;
+    struct nfs_dcache_entry* lru_next;
+};
+
+struct nfs_dcache {
+    struct nfs_dcache_entry** hash;          // 路径 -> 表项
+    int                hash_sz;              // 哈希桶数
+    int                cnt;                  // 当前表项数
+    int                max_entries;          // 最多表项数
+    struct nfs_dcache_entry* lru_head;       // 最近使用
+    struct nfs_dcache_entry* lru_tail;       // 最久未用
+    int                hit;                  // 命中次数
+    int                miss;                 // 未命中次数
+};
+
+struct nfs_icache {
+    pthread_mutex_t    lock;                 // 保护已加载inode链表
+    struct nfs_inode*  lru_head;             // 最近加载或被给予第二次机会的inode
+    struct nfs_inode*  lru_tail;             // 下一个回收候选
+    int                cnt;                  // 链表中的inode数
+    long               limit;                // 内存上限(字节)，0表示不回收
+    int                evicted;              // 回收的inode数
+};
+
+struct nfs_rcu_reader {
+    uint64_t           epoch;                // 进入读侧临界区时的全局纪元，0表示不在临界区
+    int                nest;                 // 临界区嵌套深度
+    int                in_use;               // 是否属于某个线程
+    struct nfs_rcu_reader* next;             // 读者链表，只增不减
+};
+
+struct nfs_rcu_node {
+    void*              ptr;                  // 待释放的对象
+    void             (*fn)(void*);           // 释放函数
+    uint64_t           epoch;                // 登记时的全局纪元
+    struct nfs_rcu_node* next;
+};
+
+struct nfs_iovec {
+    int                offset;               // 磁盘偏移
+    uint8_t*           buf;                  // 内存缓冲区
+    int                size;                 // 传输大小
+};
+
+struct nfs_iolist {
+    struct nfs_iovec*  iov;                  // 待传输的段
+    int                cnt;                  // 段数
+    int                cap;                  // iov数组容量
+    uint8_t**          owned;                // 由iolist申请、需要一并释放的缓冲区
+    int                owned_cnt;            // owned中的缓冲区数
+    int                owned_cap;            // owned数组容量
+};
+
+struct nfs_buf {
+    int                blk;                  // 缓存的设备块号，-1表示空闲
+    int                dirty;                // 是否被修改过，需要写回
+    int                ref;                  // CLOCK访问位
+    uint8_t*           data;                 // 块数据
+    struct nfs_buf*    hash_next;            // 哈希链表中的下一个缓冲块
+};
+
+struct nfs_page {
+    struct nfs_inode*  inode;                // 所属文件
+    int                lblk;                 // 逻辑块号
+    int                ofs;                  // 对应数据块在磁盘上的偏移，淘汰时不必查所属文件的区间；
+                                             // -1表示数据块推迟到写回时分配
+    int                dirty;                // 是否需要写回
+    uint8_t*           data;                 // 块数据
+    struct nfs_page*   lru_prev;
+    struct nfs_page*   lru_next;
+};
+
+struct nfs_pcache {
+    int                max_pages;            // 最多载入的页数
+    int                cnt;                  // 已载入的页数
+    int                delayed;              // 还没有数据块的页数，这些页不淘汰
+    struct nfs_page*   lru_head;             // 最近使用
+    struct nfs_page*   lru_tail;             // 最久未用
+    int                hit;                  // 命中次数
+    int                miss;                 // 未命中次数
+};
+
+struct nfs_jblock {
+    int                offset;               // 块的原位置(磁盘偏移)
+    uint8_t*           data;                 // 最近一次提交的块内容
+    struct nfs_jblock* next;                 // 同一哈希桶的下一块
+};
+
+struct nfs_journal {
+    int                head;                 // 下一个事务在日志区中的块号，0号块为日志头
+    uint32_t           seq;                  // 下一个事务的序号
+    struct nfs_jblock** hash;                // 已提交、尚未写回原位置的块
+    int                cnt;                  // 待检查点的块数
+    int                commits;              // 提交的事务数
+    int                checkpoints;          // 检查点次数
+};
+
+struct nfs_flusher {
+    pthread_t          thread;               // 后台写回线程
+    pthread_mutex_t    lock;                 // 保护脏inode链表和脏块计数，写回线程在其上等待
+    pthread_cond_t     wake;                 // 脏数据超过上限或卸载时唤醒写回线程
+    int                running;              // 写回线程是否已启动
+    int                stop;                 // 通知写回线程退出
+    int                dirty_limit;          // 脏块数上限，0表示不按数量写回
+    int                age;                  // 脏数据最长停留时间(秒)，0表示不按时间写回
+    int                rounds;               // 写回次数
+};
+
+struct nfs_cache {
+    int                capacity;             // 缓冲块总数
+    int                hand;                 // CLOCK指针
+    int                hash_sz;              // 哈希桶数
+    struct nfs_buf*    bufs;                 // 缓冲块数组
+    struct nfs_buf**   hash;                 // 块号 -> 缓冲块
+    uint8_t*           pool;                 // 所有缓冲块的数据区
+    int                hit;                  // 命中次数
+    int                miss;                 // 未命中次数
+};
+
 /******************************************************************************
 * SECTION: FS Specific Structure - Disk structure
 *******************************************************************************/
@@ -116,28 +440,67 @@ struct nfs_super_d
     int      size_usage;         // 磁盘已用空间
     int      max_ino;            // 文件系统最多支持的文件数
     int      max_data;           // 总数据块数
-    int      map_inode_blks;     // inode位图占用的块数
-    int      map_inode_offset;   // inode位图在磁盘上的偏移    
-    int      map_data_blks;      // 数据位图占用的块数
-    int      map_data_offset;    // 数据位图在磁盘上的偏移   
-    int      inode_offset;       // inode在磁盘上的偏移
-    int      data_offset;        // 数据块在磁盘上的偏移
+    int      group_offset;       // 第一个块组在磁盘上的偏移
+    int      group_cnt;          // 块组数
+    int      group_blks;         // 每个块组的块数
+    int      ino_per_group;      // 每个块组的inode数
+    int      data_per_group;     // 每个块组的数据块数
+    int      itable_blks;        // 每个块组inode表的块数
+    int      sum_inode_offset;   // inode位图空闲计数摘要在磁盘上的偏移
+    int      sum_data_offset;    // 数据位图空闲计数摘要在磁盘上的偏移
+    int      journal_offset;     // 日志区在磁盘上的偏移
+    int      journal_blks;       // 日志区块数
+    uint32_t version;            // 磁盘格式版本
+};
+
+struct nfs_journal_d
+{
+    uint32_t magic;              // 幻数
+    uint32_t seq;                // head处事务的序号
+    int      head;               // 第一个尚未检查点的事务所在块号
+};
+
+struct nfs_jdesc_d
+{
+    uint32_t magic;              // 幻数
+    uint32_t seq;                // 所属事务序号
+    int      cnt;                // 其后跟随的块数
+    int      last;               // 是否为事务的最后一个描述块(提交标记)
+    uint32_t csum;               // 块号表与其后各块内容的校验和
+    int      offsets[];          // 其后各块的原位置
+};
+
+struct nfs_extent_d
+{
+    int        start;                  // 起始数据块号
+    int        len;                    // 块数
 };
 
 struct nfs_inode_d
 {
     int        ino;                    // inode号
-    int        size;                   // 文件大小
+    int        size;                   // 文件大小(字节)
     int        dir_cnt;                // 目录项数量
     FILE_TYPE  ftype;                  // 文件类型
-    int        blocks[MAX_INODE_PTR];  // 磁盘数据块指针
+    int        blk_cnt;                // 已分配的数据块数
+    int        ext_cnt;                // 区间数
+    int        ext_root;               // 区间树索引块，其中依次存放各叶子块号
+    int        flags;                  // NFS_INODE_F_*
+    union {
+        struct nfs_extent_d extents[NFS_INODE_EXTENTS];  // 前NFS_INODE_EXTENTS个区间
+        uint8_t             data[NFS_INODE_INLINE];      // 内联的文件数据或目录项记录
+    };
 };  
 
+/* 目录块中依次存放变长的目录项记录，每条占NFS_DENTRY_LEN(name_len)字节，
+ * name_len为0或剩余空间放不下记录头处即为块中目录项的结尾 */
 struct nfs_dentry_d
 {
-    char               name[MAX_NAME_LEN];          // 文件名
-    FILE_TYPE          ftype;                       // 文件类型
     int                ino;                         // 指向的ino号 
+    uint32_t           hash;                        // 文件名哈希
+    uint8_t            ftype;                       // 文件类型
+    uint8_t            name_len;                    // 文件名长度
+    char               name[];                      // 文件名，不以'\0'结尾
 };  
 
 
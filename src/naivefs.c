@@ -4,37 +4,321 @@
 * SECTION: 宏定义
 *******************************************************************************/
 #define OPTION(t, p)        { t, offsetof(struct custom_options, p), 1 }
+/* 生成以mode持有命名空间锁调用handler的入口，删除目录项和写回的请求独占。
+   请求结束后检查已加载inode占用的内存，超过上限时回收 */
+#define LOCKED_OP(name, mode, params, args)			\
+	static int name##_locked params {				\
+		int ret;									\
+		nfs_ns_lock(mode);							\
+		ret = name args;							\
+		nfs_ns_unlock();							\
+		nfs_sync_balance();							\
+		nfs_icache_balance();						\
+		return ret;									\
+	}
 
 /******************************************************************************
 * SECTION: 全局变量
 *******************************************************************************/
 static const struct fuse_opt option_spec[] = {		/* 用于FUSE文件系统解析参数 */
 	OPTION("--device=%s", device),
+	OPTION("--cache=%d", cache_kb),
+	OPTION("--backend=%s", backend),
+	OPTION("--page_cache=%d", page_kb),
+	OPTION("--dirty_kb=%d", dirty_kb),
+	OPTION("--flush_age=%d", flush_age),
+	OPTION("--icache_kb=%d", icache_kb),
 	FUSE_OPT_END
 };
 
+/******************************************************************************
+* SECTION: 加锁的FUSE入口
+*******************************************************************************/
+LOCKED_OP(naivefs_mkdir, NFS_LOCK_SHARED, (const char* path, mode_t mode), (path, mode))
+LOCKED_OP(naivefs_getattr, NFS_LOCK_SHARED, (const char* path, struct stat* st), (path, st))
+LOCKED_OP(naivefs_readdir, NFS_LOCK_SHARED, (const char* path, void* buf,
+		  fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi),
+		  (path, buf, filler, offset, fi))
+LOCKED_OP(naivefs_mknod, NFS_LOCK_SHARED, (const char* path, mode_t mode, dev_t dev),
+		  (path, mode, dev))
+LOCKED_OP(naivefs_write, NFS_LOCK_SHARED, (const char* path, const char* buf, size_t size,
+		  off_t offset, struct fuse_file_info* fi), (path, buf, size, offset, fi))
+LOCKED_OP(naivefs_read, NFS_LOCK_SHARED, (const char* path, char* buf, size_t size,
+		  off_t offset, struct fuse_file_info* fi), (path, buf, size, offset, fi))
+LOCKED_OP(naivefs_write_buf, NFS_LOCK_SHARED, (const char* path, struct fuse_bufvec* buf,
+		  off_t offset, struct fuse_file_info* fi), (path, buf, offset, fi))
+LOCKED_OP(naivefs_read_buf, NFS_LOCK_SHARED, (const char* path, struct fuse_bufvec** bufp,
+		  size_t size, off_t offset, struct fuse_file_info* fi), (path, bufp, size, offset, fi))
+LOCKED_OP(naivefs_truncate, NFS_LOCK_SHARED, (const char* path, off_t offset), (path, offset))
+LOCKED_OP(naivefs_fallocate, NFS_LOCK_SHARED, (const char* path, int mode, off_t offset,
+		  off_t length, struct fuse_file_info* fi), (path, mode, offset, length, fi))
+LOCKED_OP(naivefs_unlink, NFS_LOCK_EXCL, (const char* path), (path))
+LOCKED_OP(naivefs_rmdir, NFS_LOCK_EXCL, (const char* path), (path))
+LOCKED_OP(naivefs_rename, NFS_LOCK_EXCL, (const char* from, const char* to), (from, to))
+LOCKED_OP(naivefs_fsync, NFS_LOCK_EXCL, (const char* path, int datasync,
+		  struct fuse_file_info* fi), (path, datasync, fi))
+LOCKED_OP(naivefs_fsyncdir, NFS_LOCK_EXCL, (const char* path, int datasync,
+		  struct fuse_file_info* fi), (path, datasync, fi))
+LOCKED_OP(naivefs_opendir, NFS_LOCK_SHARED, (const char* path, struct fuse_file_info* fi),
+		  (path, fi))
+LOCKED_OP(naivefs_releasedir, NFS_LOCK_SHARED, (const char* path, struct fuse_file_info* fi),
+		  (path, fi))
+
+static void nfs_fill_stat(struct nfs_dentry* dentry, int is_root, struct stat* naivefs_stat);
+
+/**
+ * @brief getattr的无锁入口：路径上的inode都已加载且文件存在时，不取命名空间锁
+ *        和目录锁，在读侧临界区内查找并填充属性，否则退回加锁的入口
+ * 
+ * @param path 相对于挂载点的路径
+ * @param st 返回状态
+ * @return int 
+ */
+static int naivefs_getattr_rcu(const char* path, struct stat* st) {
+	int is_find = 0, is_root = 0;
+	struct nfs_dentry* dentry;
+
+	if (nfs_rcu_read_lock() != NFS_ERROR_NONE) {
+		return naivefs_getattr_locked(path, st);
+	}
+	dentry = nfs_lookup_rcu(path, &is_find, &is_root);
+	if (dentry && is_find) {
+		nfs_fill_stat(dentry, is_root, st);
+		nfs_rcu_read_unlock();
+		return NFS_ERROR_NONE;
+	}
+	nfs_rcu_read_unlock();
+	return naivefs_getattr_locked(path, st);
+}
+
 /******************************************************************************
 * SECTION: FUSE操作定义
 *******************************************************************************/
 static struct fuse_operations operations = {
 	.init = naivefs_init,						 /* mount文件系统 */		
 	.destroy = naivefs_destroy,				 /* umount文件系统 */
-	.mkdir = naivefs_mkdir,					 /* 建目录，mkdir */
-	.getattr = naivefs_getattr,				 /* 获取文件属性，类似stat，必须完成 */
-	.readdir = naivefs_readdir,				 /* 填充dentrys */
-	.mknod = naivefs_mknod,					 /* 创建文件，touch相关 */
-	.write = NULL,								  	 /* 写入文件 */
-	.read = NULL,								  	 /* 读文件 */
+	.mkdir = naivefs_mkdir_locked,			 /* 建目录，mkdir */
+	.getattr = naivefs_getattr_rcu,			 /* 获取文件属性，类似stat，必须完成 */
+	.readdir = naivefs_readdir_locked,		 /* 填充dentrys */
+	.mknod = naivefs_mknod_locked,			 /* 创建文件，touch相关 */
+	.write = naivefs_write_locked,			 /* 写入文件 */
+	.read = naivefs_read_locked,			 /* 读文件 */
+	.write_buf = naivefs_write_buf_locked,	 /* 写入文件，数据可直接splice进磁盘镜像 */
+	.read_buf = naivefs_read_buf_locked,	 /* 读文件，数据可直接从磁盘镜像splice出去 */
 	.utimens = naivefs_utimens,				 /* 修改时间，忽略，避免touch报错 */
-	.truncate = NULL,						  		 /* 改变文件大小 */
-	.unlink = NULL,							  		 /* 删除文件 */
-	.rmdir	= NULL,							  		 /* 删除目录， rm -r */
-	.rename = NULL,							  		 /* 重命名，mv */
+	.truncate = naivefs_truncate_locked,	 /* 改变文件大小 */
+	.fallocate = naivefs_fallocate_locked,	 /* 预分配数据块 */
+	.unlink = naivefs_unlink_locked,		 /* 删除文件 */
+	.rmdir	= naivefs_rmdir_locked,			 /* 删除目录， rm -r */
+	.rename = naivefs_rename_locked,		 /* 重命名，mv */
+	.fsync = naivefs_fsync_locked,			 /* 写回文件，fsync */
+	.flush = naivefs_flush,					 /* 关闭文件，不写回 */
+	.fsyncdir = naivefs_fsyncdir_locked,	 /* 写回目录 */
 
 	.open = NULL,							
-	.opendir = NULL,
+	.opendir = naivefs_opendir_locked,
+	.releasedir = naivefs_releasedir_locked,
 	.access = NULL
 };
+/******************************************************************************
+* SECTION: 辅助函数
+*******************************************************************************/
+/**
+ * @brief 根据目录项填充文件属性，inode未加载时只填充类型等无需读盘的字段。
+ *        已加载的inode在读锁下读取
+ * 
+ * @param dentry 
+ * @param is_root 
+ * @param naivefs_stat 
+ */
+static void nfs_fill_stat(struct nfs_dentry* dentry, int is_root, struct stat* naivefs_stat) {
+	struct nfs_inode* inode = nfs_inode_peek(dentry);
+
+	memset(naivefs_stat, 0, sizeof(struct stat));
+	if (inode) {
+		nfs_inode_rdlock(inode);
+	}
+	if (dentry->ftype == NFS_DIR) {
+		naivefs_stat->st_mode = S_IFDIR | NAIVEFS_DEFAULT_PERM;
+		if (inode) {
+			naivefs_stat->st_size = inode->is_inline ? NFS_INODE_INLINE 
+													 : inode->blk_cnt * NFS_BLK_SZ();
+		}
+	} else {
+		naivefs_stat->st_mode = S_IFREG | NAIVEFS_DEFAULT_PERM;
+		if (inode) {
+			naivefs_stat->st_size   = inode->size;
+			naivefs_stat->st_blocks = (inode->blk_cnt + inode->delay_cnt) * (NFS_BLK_SZ() / 512);
+		}
+	}
+	if (inode) {
+		nfs_inode_unlock(inode);
+	}
+	
+	naivefs_stat->st_ino     = dentry->ino;
+	naivefs_stat->st_nlink   = 1;
+	naivefs_stat->st_uid     = getuid();
+	naivefs_stat->st_gid     = getgid();
+	naivefs_stat->st_atime   = time(NULL);
+	naivefs_stat->st_mtime   = time(NULL);
+	naivefs_stat->st_blksize = NFS_BLK_SZ();  // 块大小
+
+	if (is_root) {
+		naivefs_stat->st_size   = super.size_usage;
+		naivefs_stat->st_blocks = NFS_BLK_NUM();
+		naivefs_stat->st_nlink  = 2;          // 根目录link为2
+	}
+}
+
+/**
+ * @brief 为读取[offset, offset + size)生成fuse_bufvec，数据在持有inode读锁时
+ *        全部读入一个内存段。不在页缓存中的块一次向量读直接从设备读出，物理上
+ *        相邻的块合并为一段，不占用页缓存；其余部分经页缓存读入。不把镜像文件
+ *        的描述符交给FUSE：FUSE在放开锁之后才传输，届时块可能已被释放并分给
+ *        其他文件。内存段由FUSE在回复后释放
+ * 
+ * @param inode 持有读锁的文件inode
+ * @param offset 
+ * @param size 调用者保证不超过文件末尾
+ * @param bufp 
+ * @return int 
+ */
+static int nfs_read_bufvec(struct nfs_inode* inode, off_t offset, size_t size,
+						   struct fuse_bufvec** bufp) {
+	struct fuse_bufvec* bufv;
+	struct nfs_iolist   list;
+	struct nfs_iovec*   last;
+	uint8_t* mem;
+	int    lblk, bias, len, blk, pos, ret = NFS_ERROR_NONE;
+	size_t done = 0;
+
+	bufv = (struct fuse_bufvec*)calloc(1, sizeof(struct fuse_bufvec));
+	mem  = (uint8_t*)malloc(size ? size : 1);
+	if (bufv == NULL || mem == NULL) {
+		free(bufv);
+		free(mem);
+		return -NFS_ERROR_NOSPACE;
+	}
+	memset(&list, 0, sizeof(struct nfs_iolist));
+	while (done < size && ret == NFS_ERROR_NONE) {
+		lblk = (offset + done) / NFS_BLK_SZ();
+		bias = (offset + done) % NFS_BLK_SZ();
+		len  = NFS_BLK_SZ() - bias < size - done ? NFS_BLK_SZ() - bias : size - done;
+		// 内联的数据、推迟分配的块和有页在内存中的块都从内存读
+		blk  = inode->is_inline ? -1 : nfs_extent_map(inode, lblk);
+		pos  = blk < 0 || nfs_page_cached(inode, lblk) ? -1 : NFS_DATA_OFS(blk) + bias;
+		last = list.cnt ? &list.iov[list.cnt - 1] : NULL;
+		if (pos < 0) {
+			ret = nfs_page_read(inode, mem + done, offset + done, len);
+		} else if (last && last->offset + last->size == pos
+				   && last->buf + last->size == mem + done) {
+			last->size += len;
+		} else {
+			ret = nfs_iolist_add(&list, pos, mem + done, len);
+		}
+		done += len;
+	}
+	if (ret == NFS_ERROR_NONE && list.cnt > 0) {
+		ret = nfs_driver_readv(list.iov, list.cnt);
+	}
+	nfs_iolist_free(&list);
+	if (ret != NFS_ERROR_NONE) {
+		free(mem);
+		free(bufv);
+		return ret == -NFS_ERROR_NOSPACE ? ret : -NFS_ERROR_IO;
+	}
+	bufv->count       = 1;
+	bufv->buf[0].mem  = mem;
+	bufv->buf[0].size = size;
+	*bufp = bufv;
+	return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 把src中接下来的size字节经页缓存写入文件。数据已在内存中时直接使用，
+ *        在管道中时先拷贝出来
+ * 
+ * @param inode 持有写锁的文件inode
+ * @param src 
+ * @param offset 
+ * @param size 
+ * @return int 
+ */
+static int nfs_write_bufvec_page(struct nfs_inode* inode, struct fuse_bufvec* src,
+								 off_t offset, size_t size) {
+	struct fuse_buf*   buf = &src->buf[src->idx];
+	struct fuse_bufvec tmp = FUSE_BUFVEC_INIT(size);
+	int ret;
+
+	if (!(buf->flags & FUSE_BUF_IS_FD) && buf->size - src->off >= size) {
+		ret = nfs_page_write(inode, (const uint8_t*)buf->mem + src->off, offset, size);
+		src->off += size;
+		if (src->off == buf->size) {
+			src->idx++;
+			src->off = 0;
+		}
+		return ret;
+	}
+	tmp.buf[0].mem = malloc(size);
+	if (tmp.buf[0].mem == NULL) {
+		return -NFS_ERROR_NOSPACE;
+	}
+	if (fuse_buf_copy(&tmp, src, (enum fuse_buf_copy_flags)0) != (ssize_t)size) {
+		free(tmp.buf[0].mem);
+		return -NFS_ERROR_IO;
+	}
+	ret = nfs_page_write(inode, (const uint8_t*)tmp.buf[0].mem, offset, size);
+	free(tmp.buf[0].mem);
+	return ret;
+}
+
+/**
+ * @brief 把src写入文件的[offset, offset + size)。整块覆盖的块丢弃其页后直接
+ *        写入磁盘镜像，物理上相邻的块一次写入；不足一块的头尾和不能直接写
+ *        的块经页缓存写入
+ * 
+ * @param inode 持有写锁的文件inode，[offset, offset + size)已分配或推迟分配数据块
+ * @param src 
+ * @param offset 
+ * @param size 
+ * @return int 
+ */
+static int nfs_write_bufvec(struct nfs_inode* inode, struct fuse_bufvec* src,
+							off_t offset, size_t size) {
+	int    lblk, n, ret;
+	size_t len;
+
+	while (size > 0) {
+		lblk = offset / NFS_BLK_SZ();
+		len  = NFS_BLK_SZ() - offset % NFS_BLK_SZ();
+		len  = len < size ? len : size;
+		if (NFS_BACKEND()->is_file && offset % NFS_BLK_SZ() == 0 && size >= NFS_BLK_SZ()
+			&& nfs_extent_map(inode, lblk) >= 0) {
+			for (n = 1; (size_t)(n + 1) * NFS_BLK_SZ() <= size
+						&& nfs_extent_map(inode, lblk + n)
+						   == nfs_extent_map(inode, lblk) + n; n++) {
+			}
+			len = n * NFS_BLK_SZ();
+			nfs_page_discard(inode, lblk, lblk + n);
+			ret = nfs_driver_splice_in(NFS_DATA_OFS(nfs_extent_map(inode, lblk)), src, len);
+			if (ret == NFS_ERROR_NONE) {
+				offset += len;
+				size   -= len;
+				continue;
+			}
+			if (ret != -NFS_ERROR_UNSUPPORTED) {
+				return ret;
+			}
+		}
+		if (nfs_write_bufvec_page(inode, src, offset, len) != NFS_ERROR_NONE) {
+			return -NFS_ERROR_IO;
+		}
+		offset += len;
+		size   -= len;
+	}
+	return NFS_ERROR_NONE;
+}
+
 /******************************************************************************
 * SECTION: 必做函数实现
 *******************************************************************************/
@@ -51,6 +335,11 @@ void* naivefs_init(struct fuse_conn_info * conn_info) {
 		return NULL;
 	}
 
+	// 磁盘镜像后端的文件数据可以在请求通道与镜像文件之间splice
+	if (conn_info && NFS_BACKEND()->is_file) {
+		conn_info->want |= FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE;
+	}
+
 	/* 下面是一个控制设备的示例 */
 	// super.fd = ddriver_open(naivefs_options.device);
 	
@@ -89,7 +378,11 @@ int naivefs_mkdir(const char* path, mode_t mode) {
 	struct nfs_dentry* last_dentry = nfs_lookup(path, &is_find, &is_root);
 	struct nfs_dentry* dentry;
 	struct nfs_inode* inode;
+	struct nfs_inode* parent;
 
+	if (last_dentry == NULL) {
+		return -NFS_ERROR_IO;
+	}
 	if (is_find) {
 		return -NFS_ERROR_EXISTS;
 	}
@@ -99,10 +392,32 @@ int naivefs_mkdir(const char* path, mode_t mode) {
 	}
 
 	name = nfs_get_name(path);
-	dentry = new_dentry(name, NFS_DIR);
+	parent = last_dentry->inode;
+	nfs_inode_wrlock(parent);
+	// 查找之后其他请求可能已经创建了同名目录项
+	if (nfs_dir_lookup(parent, name, strlen(name))) {
+		nfs_inode_unlock(parent);
+		return -NFS_ERROR_EXISTS;
+	}
+	dentry = new_dentry(parent, name, NFS_DIR);
+	if (dentry == NULL) {
+		nfs_inode_unlock(parent);
+		return -NFS_ERROR_NOSPACE;
+	}
 	dentry->parent = last_dentry;
 	inode = nfs_alloc_inode(dentry);
-	nfs_alloc_dentry(last_dentry->inode, dentry);
+	if (inode == NULL) {
+		nfs_inode_unlock(parent);
+		nfs_free_dentry(dentry);
+		return -NFS_ERROR_NOSPACE;
+	}
+	if (nfs_alloc_dentry(parent, dentry) < 0) {
+		nfs_inode_unlock(parent);
+		nfs_release_dentry(dentry);
+		return -NFS_ERROR_NOSPACE;
+	}
+	nfs_dcache_invalidate_create(last_dentry, name);
+	nfs_inode_unlock(parent);
 
 	return NFS_ERROR_NONE;
 }
@@ -117,32 +432,14 @@ int naivefs_mkdir(const char* path, mode_t mode) {
 int naivefs_getattr(const char* path, struct stat * naivefs_stat) {
 	int is_find, is_root;
 	struct nfs_dentry* dentry = nfs_lookup(path, &is_find, &is_root);
+	if (dentry == NULL) {
+		return -NFS_ERROR_IO;
+	}
 	if (is_find == 0) {
 		return -NFS_ERROR_NOTFOUND;
 	}
 
-	if (NFS_IS_DIR(dentry->inode)) {
-		naivefs_stat->st_mode = S_IFDIR | NAIVEFS_DEFAULT_PERM;
-		naivefs_stat->st_size = dentry->inode->dir_cnt * sizeof(struct nfs_dentry_d);
-	} else {
-		naivefs_stat->st_mode = S_IFREG | NAIVEFS_DEFAULT_PERM;
-		// inode->size中记录块数
-		naivefs_stat->st_size = dentry->inode->size * NFS_BLK_SZ(); 
-	}
-	
-	naivefs_stat->st_nlink   = 1;
-	naivefs_stat->st_uid     = getuid();
-	naivefs_stat->st_gid     = getgid();
-	naivefs_stat->st_atime   = time(NULL);
-	naivefs_stat->st_mtime   = time(NULL);
-	naivefs_stat->st_blksize = NFS_BLK_SZ();  // 块大小
-
-	if (is_root) {
-		naivefs_stat->st_size   = super.size_usage;
-		naivefs_stat->st_blocks = NFS_BLK_NUM();
-		naivefs_stat->st_nlink  = 2;          // 根目录link为2
-	}
-
+	nfs_fill_stat(dentry, is_root, naivefs_stat);
 	return NFS_ERROR_NONE;
 }
 
@@ -167,20 +464,49 @@ int naivefs_getattr(const char* path, struct stat * naivefs_stat) {
 int naivefs_readdir(const char * path, void * buf, fuse_fill_dir_t filler, off_t offset,
 			    		 struct fuse_file_info * fi) {
     int is_find,is_root;
-	int cur_dir = offset;
-
-	struct nfs_dentry* dentry = nfs_lookup(path, &is_find, &is_root);
+	struct nfs_dir_handle* dh = (struct nfs_dir_handle*)(uintptr_t)fi->fh;
+	struct nfs_dir_handle  tmp;
+	struct nfs_dentry* dentry;
 	struct nfs_dentry* sub_dentry;
 	struct nfs_inode* inode;
-	if (is_find) {
-		inode = dentry->inode;
-		sub_dentry = nfs_get_dentry(inode, cur_dir);
-		if (sub_dentry) {
-			filler(buf, sub_dentry->name, NULL, ++offset);
+	struct stat st;
+
+	// 没有经过opendir时，临时解析路径
+	if (dh == NULL) {
+		dentry = nfs_lookup(path, &is_find, &is_root);
+		if (dentry == NULL) {
+			return -NFS_ERROR_IO;
 		}
-		return NFS_ERROR_NONE;
+		if (!is_find) {
+			return -NFS_ERROR_NOTFOUND;
+		}
+		memset(&tmp, 0, sizeof(struct nfs_dir_handle));
+		tmp.dentry = dentry;
+		tmp.offset = -1;
+		dh = &tmp;
 	}
-    return -NFS_ERROR_NOTFOUND;
+	inode = dh->dentry->inode;
+	nfs_inode_rdlock(inode);
+	// 游标与偏移吻合且目录项没有被删除过时，直接从游标继续，否则从头数到offset
+	if (dh->offset == offset && dh->gen == inode->dir_gen) {
+		sub_dentry = dh->cursor;
+	} else {
+		sub_dentry = nfs_get_dentry(inode, offset);
+	}
+	// 一次填满FUSE缓冲区，filler返回1表示缓冲区已满
+	while (sub_dentry) {
+		nfs_fill_stat(sub_dentry, 0, &st);
+		if (filler(buf, sub_dentry->name, &st, offset + 1)) {
+			break;
+		}
+		offset++;
+		sub_dentry = sub_dentry->brother;
+	}
+	dh->cursor = sub_dentry;
+	dh->offset = offset;
+	dh->gen    = inode->dir_gen;
+	nfs_inode_unlock(inode);
+	return NFS_ERROR_NONE;
 }
 
 /**
@@ -195,24 +521,60 @@ int naivefs_mknod(const char* path, mode_t mode, dev_t dev) {
 	int is_find, is_root;
 
 	struct nfs_dentry* last_dentry = nfs_lookup(path, &is_find, &is_root);
-	struct nfs_dentry* dentry;
+	struct nfs_dentry* dentry = NULL;
 	struct nfs_inode* inode;
+	struct nfs_inode* parent;
+	FILE_TYPE ftype;
 	char* name;
 
+	if (last_dentry == NULL) {
+		return -NFS_ERROR_IO;
+	}
 	if (is_find == 1) {
 		return -NFS_ERROR_EXISTS;
 	}
 
-	name = nfs_get_name(path);
+	if (!NFS_IS_DIR(last_dentry->inode)) {
+		return -NFS_ERROR_NOTDIR;
+	}
 
+	// 只支持普通文件和目录，设备、管道和套接字无处存放
 	if (S_ISREG(mode)) {
-		dentry = new_dentry(name, NFS_FILE); 
+		ftype = NFS_FILE;
 	} else if (S_ISDIR(mode)) {
-		dentry = new_dentry(name, NFS_FILE);
+		ftype = NFS_DIR;
+	} else {
+		return -NFS_ERROR_OPNOTSUPP;
+	}
+
+	name = nfs_get_name(path);
+	parent = last_dentry->inode;
+	nfs_inode_wrlock(parent);
+	// 查找之后其他请求可能已经创建了同名目录项
+	if (nfs_dir_lookup(parent, name, strlen(name))) {
+		nfs_inode_unlock(parent);
+		return -NFS_ERROR_EXISTS;
+	}
+
+	dentry = new_dentry(parent, name, ftype);
+	if (dentry == NULL) {
+		nfs_inode_unlock(parent);
+		return -NFS_ERROR_NOSPACE;
 	}
 	dentry->parent = last_dentry;
 	inode = nfs_alloc_inode(dentry);
-	nfs_alloc_dentry(last_dentry->inode, dentry);
+	if (inode == NULL) {
+		nfs_inode_unlock(parent);
+		nfs_free_dentry(dentry);
+		return -NFS_ERROR_NOSPACE;
+	}
+	if (nfs_alloc_dentry(parent, dentry) < 0) {
+		nfs_inode_unlock(parent);
+		nfs_release_dentry(dentry);
+		return -NFS_ERROR_NOSPACE;
+	}
+	nfs_dcache_invalidate_create(last_dentry, name);
+	nfs_inode_unlock(parent);
 
 	return NFS_ERROR_NONE;
 }
@@ -243,7 +605,35 @@ int naivefs_utimens(const char* path, const struct timespec tv[2]) {
  */
 int naivefs_write(const char* path, const char* buf, size_t size, off_t offset,
 		        struct fuse_file_info* fi) {
-	/* 选做 */
+	int is_find, is_root;
+	struct nfs_dentry* dentry = nfs_lookup(path, &is_find, &is_root);
+	struct nfs_inode*  inode;
+
+	if (dentry == NULL) {
+		return -NFS_ERROR_IO;
+	}
+	if (!is_find) {
+		return -NFS_ERROR_NOTFOUND;
+	}
+	inode = dentry->inode;
+	if (NFS_IS_DIR(inode)) {
+		return -NFS_ERROR_ISDIR;
+	}
+	if (offset < 0 || offset + size > INT_MAX) {
+		return -NFS_ERROR_FBIG;
+	}
+	nfs_inode_wrlock(inode);
+	// 写到文件末尾之后时先扩展文件，中间的空洞填0
+	if (offset + size > inode->size
+		&& nfs_inode_resize(inode, offset + size) != NFS_ERROR_NONE) {
+		nfs_inode_unlock(inode);
+		return -NFS_ERROR_NOSPACE;
+	}
+	if (nfs_page_write(inode, (const uint8_t*)buf, offset, size) != NFS_ERROR_NONE) {
+		nfs_inode_unlock(inode);
+		return -NFS_ERROR_IO;
+	}
+	nfs_inode_unlock(inode);
 	return size;
 }
 
@@ -259,10 +649,118 @@ int naivefs_write(const char* path, const char* buf, size_t size, off_t offset,
  */
 int naivefs_read(const char* path, char* buf, size_t size, off_t offset,
 		       struct fuse_file_info* fi) {
-	/* 选做 */
+	int is_find, is_root;
+	struct nfs_dentry* dentry = nfs_lookup(path, &is_find, &is_root);
+	struct nfs_inode*  inode;
+
+	if (dentry == NULL) {
+		return -NFS_ERROR_IO;
+	}
+	if (!is_find) {
+		return -NFS_ERROR_NOTFOUND;
+	}
+	inode = dentry->inode;
+	if (NFS_IS_DIR(inode)) {
+		return -NFS_ERROR_ISDIR;
+	}
+	nfs_inode_rdlock(inode);
+	if (offset >= inode->size) {
+		nfs_inode_unlock(inode);
+		return 0;
+	}
+	if (size > inode->size - offset) {
+		size = inode->size - offset;
+	}
+	if (nfs_page_read(inode, (uint8_t*)buf, offset, size) != NFS_ERROR_NONE) {
+		nfs_inode_unlock(inode);
+		return -NFS_ERROR_IO;
+	}
+	nfs_inode_unlock(inode);
 	return size;			   
 }
 
+/**
+ * @brief 写入文件，数据以fuse_bufvec给出。请求数据在管道中时，整块覆盖的
+ *        部分由splice直接写入磁盘镜像
+ * 
+ * @param path 相对于挂载点的路径
+ * @param buf 写入的数据
+ * @param offset 相对文件的偏移
+ * @param fi 可忽略
+ * @return int 写入大小
+ */
+int naivefs_write_buf(const char* path, struct fuse_bufvec* buf, off_t offset,
+		              struct fuse_file_info* fi) {
+	int is_find, is_root;
+	struct nfs_dentry* dentry = nfs_lookup(path, &is_find, &is_root);
+	struct nfs_inode*  inode;
+	size_t size = fuse_buf_size(buf);
+
+	if (dentry == NULL) {
+		return -NFS_ERROR_IO;
+	}
+	if (!is_find) {
+		return -NFS_ERROR_NOTFOUND;
+	}
+	inode = dentry->inode;
+	if (NFS_IS_DIR(inode)) {
+		return -NFS_ERROR_ISDIR;
+	}
+	if (offset < 0 || offset + size > INT_MAX) {
+		return -NFS_ERROR_FBIG;
+	}
+	nfs_inode_wrlock(inode);
+	if (offset + size > inode->size
+		&& nfs_inode_resize(inode, offset + size) != NFS_ERROR_NONE) {
+		nfs_inode_unlock(inode);
+		return -NFS_ERROR_NOSPACE;
+	}
+	if (nfs_write_bufvec(inode, buf, offset, size) != NFS_ERROR_NONE) {
+		nfs_inode_unlock(inode);
+		return -NFS_ERROR_IO;
+	}
+	nfs_inode_unlock(inode);
+	return size;
+}
+
+/**
+ * @brief 读取文件，结果以fuse_bufvec交给FUSE。不在页缓存中的块直接从设备
+ *        读入回复的缓冲区，大块顺序读不会挤掉页缓存中的页
+ * 
+ * @param path 相对于挂载点的路径
+ * @param bufp 返回的数据，由FUSE释放
+ * @param size 读取的字节数
+ * @param offset 相对文件的偏移
+ * @param fi 可忽略
+ * @return int 0成功，否则失败
+ */
+int naivefs_read_buf(const char* path, struct fuse_bufvec** bufp, size_t size, off_t offset,
+		             struct fuse_file_info* fi) {
+	int is_find, is_root, ret;
+	struct nfs_dentry* dentry = nfs_lookup(path, &is_find, &is_root);
+	struct nfs_inode*  inode;
+
+	if (dentry == NULL) {
+		return -NFS_ERROR_IO;
+	}
+	if (!is_find) {
+		return -NFS_ERROR_NOTFOUND;
+	}
+	inode = dentry->inode;
+	if (NFS_IS_DIR(inode)) {
+		return -NFS_ERROR_ISDIR;
+	}
+	nfs_inode_rdlock(inode);
+	if (offset >= inode->size) {
+		size = 0;
+	} else if (size > inode->size - offset) {
+		size = inode->size - offset;
+	}
+	ret = nfs_read_bufvec(inode, offset, size, bufp);
+	nfs_inode_unlock(inode);
+	return ret;
+}
+
 /**
  * @brief 删除文件
  * 
@@ -270,8 +768,21 @@ int naivefs_read(const char* path, char* buf, size_t size, off_t offset,
  * @return int 0成功，否则失败
  */
 int naivefs_unlink(const char* path) {
-	/* 选做 */
-	return 0;
+	int is_find, is_root;
+	struct nfs_dentry* dentry = nfs_lookup(path, &is_find, &is_root);
+
+	if (dentry == NULL) {
+		return -NFS_ERROR_IO;
+	}
+	if (!is_find) {
+		return -NFS_ERROR_NOTFOUND;
+	}
+	if (NFS_IS_DIR(dentry->inode)) {
+		return -NFS_ERROR_ISDIR;
+	}
+	nfs_dcache_invalidate_tree(dentry);
+	nfs_drop_dentry(dentry->parent->inode, dentry);
+	return nfs_release_dentry(dentry);
 }
 
 /**
@@ -287,8 +798,27 @@ int naivefs_unlink(const char* path) {
  * @return int 0成功，否则失败
  */
 int naivefs_rmdir(const char* path) {
-	/* 选做 */
-	return 0;
+	int is_find, is_root;
+	struct nfs_dentry* dentry = nfs_lookup(path, &is_find, &is_root);
+
+	if (dentry == NULL) {
+		return -NFS_ERROR_IO;
+	}
+	if (!is_find) {
+		return -NFS_ERROR_NOTFOUND;
+	}
+	if (is_root) {
+		return -NFS_ERROR_INVAL;
+	}
+	if (!NFS_IS_DIR(dentry->inode)) {
+		return -NFS_ERROR_NOTDIR;
+	}
+	if (dentry->inode->dir_cnt != 0) {
+		return -NFS_ERROR_NOTEMPTY;
+	}
+	nfs_dcache_invalidate_tree(dentry);
+	nfs_drop_dentry(dentry->parent->inode, dentry);
+	return nfs_release_dentry(dentry);
 }
 
 /**
@@ -299,8 +829,104 @@ int naivefs_rmdir(const char* path) {
  * @return int 0成功，否则失败
  */
 int naivefs_rename(const char* from, const char* to) {
-	/* 选做 */
-	return 0;
+	int is_find, is_root;
+	struct nfs_dentry* src = nfs_lookup(from, &is_find, &is_root);
+	struct nfs_dentry* dst;
+	struct nfs_dentry* new_parent;
+	struct nfs_dentry* old_parent;
+	struct nfs_dentry* cur;
+	const char* old_name;
+	const char* new_name;
+	char* name = nfs_get_name(to);
+	int lvl;
+
+	if (src == NULL) {
+		return -NFS_ERROR_IO;
+	}
+	if (!is_find) {
+		return -NFS_ERROR_NOTFOUND;
+	}
+	if (is_root || strlen(name) >= MAX_NAME_LEN) {
+		return -NFS_ERROR_INVAL;
+	}
+	dst = nfs_lookup(to, &is_find, &is_root);
+	if (dst == NULL) {
+		return -NFS_ERROR_IO;
+	}
+	if (is_find) {
+		// 目标已存在，按POSIX语义替换
+		if (dst == src) {
+			return NFS_ERROR_NONE;
+		}
+		if (NFS_IS_DIR(dst->inode)) {
+			if (!NFS_IS_DIR(src->inode)) {
+				return -NFS_ERROR_ISDIR;
+			}
+			if (dst->inode->dir_cnt != 0) {
+				return -NFS_ERROR_NOTEMPTY;
+			}
+		} else if (NFS_IS_DIR(src->inode)) {
+			return -NFS_ERROR_NOTDIR;
+		}
+		new_parent = dst->parent;
+	} else {
+		// 目标不存在时，解析必须恰好停在目标的父目录
+		new_parent = dst;
+		lvl = 0;
+		for (cur = new_parent; cur->parent; cur = cur->parent) {
+			lvl++;
+		}
+		if (lvl != nfs_calc_lvl(to) - 1) {
+			return -NFS_ERROR_NOTFOUND;
+		}
+		if (!NFS_IS_DIR(new_parent->inode)) {
+			return -NFS_ERROR_NOTDIR;
+		}
+	}
+	// 不能把目录移动到它自己的子树下
+	for (cur = new_parent; cur; cur = cur->parent) {
+		if (cur == src) {
+			return -NFS_ERROR_INVAL;
+		}
+	}
+	// 新名字先存入新目录的名字区，整理名字区时src和dst都还在原处，会被一同搬移。
+	// 之后原目录的名字区不再变动，src原来的名字一直有效
+	new_name = nfs_name_intern(new_parent->inode, name, strlen(name));
+	if (new_name == NULL) {
+		return -NFS_ERROR_NOSPACE;
+	}
+	old_parent = src->parent;
+	old_name   = src->name;
+	if (is_find) {
+		// 先只摘下dst，src放入新目录后才释放，失败时可以原样放回。
+		// 同名的目录项记录一样长，src正好放进dst空出的位置
+		nfs_dcache_invalidate_tree(dst);
+		nfs_drop_dentry(new_parent->inode, dst);
+	}
+	nfs_dcache_invalidate_tree(src);
+	nfs_drop_dentry(old_parent->inode, src);
+	// 无锁的查找可能还在读src的名字和哈希，等它们结束后再改名
+	nfs_rcu_synchronize();
+	src->name   = new_name;
+	src->hash   = nfs_name_hash(src->name, strlen(src->name));
+	src->parent = new_parent;
+	if (nfs_alloc_dentry(new_parent->inode, src) < 0) {
+		// 放回原目录，被替换的dst也放回
+		src->name   = old_name;
+		src->hash   = nfs_name_hash(src->name, strlen(src->name));
+		src->parent = old_parent;
+		nfs_alloc_dentry(old_parent->inode, src);
+		if (is_find) {
+			dst->parent = new_parent;
+			nfs_alloc_dentry(new_parent->inode, dst);
+		}
+		return -NFS_ERROR_NOSPACE;
+	}
+	if (is_find) {
+		nfs_release_dentry(dst);
+	}
+	nfs_dcache_invalidate_create(new_parent, name);
+	return NFS_ERROR_NONE;
 }
 
 /**
@@ -324,8 +950,52 @@ int naivefs_open(const char* path, struct fuse_file_info* fi) {
  * @return int 0成功，否则失败
  */
 int naivefs_opendir(const char* path, struct fuse_file_info* fi) {
-	/* 选做 */
-	return 0;
+	int is_find, is_root;
+	struct nfs_dentry* dentry = nfs_lookup(path, &is_find, &is_root);
+	struct nfs_dir_handle* dh;
+
+	if (dentry == NULL) {
+		return -NFS_ERROR_IO;
+	}
+	if (!is_find) {
+		return -NFS_ERROR_NOTFOUND;
+	}
+	if (!NFS_IS_DIR(dentry->inode)) {
+		return -NFS_ERROR_NOTDIR;
+	}
+	dh = (struct nfs_dir_handle*)malloc(sizeof(struct nfs_dir_handle));
+	if (dh == NULL) {
+		return -NFS_ERROR_NOSPACE;
+	}
+	// 打开着的目录不会被回收，被删除后也保留到句柄关闭，句柄中的dentry一直有效；
+	// 游标所指的目录项被删除时dir_gen改变，readdir不再使用游标
+	nfs_inode_rdlock(dentry->inode);
+	__atomic_add_fetch(&dentry->inode->pin, 1, __ATOMIC_RELEASE);
+	dh->dentry = dentry;
+	dh->cursor = dentry->inode->dentrys;
+	dh->offset = 0;
+	dh->gen    = dentry->inode->dir_gen;
+	nfs_inode_unlock(dentry->inode);
+	fi->fh     = (uint64_t)(uintptr_t)dh;
+	return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 关闭目录文件，释放opendir中申请的目录句柄
+ * 
+ * @param path 相对于挂载点的路径
+ * @param fi 文件信息
+ * @return int 0成功，否则失败
+ */
+int naivefs_releasedir(const char* path, struct fuse_file_info* fi) {
+	struct nfs_dir_handle* dh = (struct nfs_dir_handle*)(uintptr_t)fi->fh;
+	(void)path;
+	if (dh) {
+		nfs_dir_handle_put(dh->dentry);
+	}
+	free(dh);
+	fi->fh = 0;
+	return NFS_ERROR_NONE;
 }
 
 /**
@@ -336,8 +1006,135 @@ int naivefs_opendir(const char* path, struct fuse_file_info* fi) {
  * @return int 0成功，否则失败
  */
 int naivefs_truncate(const char* path, off_t offset) {
-	/* 选做 */
-	return 0;
+	int is_find, is_root, ret;
+	struct nfs_dentry* dentry = nfs_lookup(path, &is_find, &is_root);
+
+	if (dentry == NULL) {
+		return -NFS_ERROR_IO;
+	}
+	if (!is_find) {
+		return -NFS_ERROR_NOTFOUND;
+	}
+	if (NFS_IS_DIR(dentry->inode)) {
+		return -NFS_ERROR_ISDIR;
+	}
+	if (offset < 0 || offset > INT_MAX) {
+		return -NFS_ERROR_FBIG;
+	}
+	nfs_inode_wrlock(dentry->inode);
+	ret = nfs_inode_resize(dentry->inode, offset);
+	nfs_inode_unlock(dentry->inode);
+	return ret;
+}
+
+/**
+ * @brief 为文件预分配数据块，使之后的追加写落在连续的区间中。扩大文件时
+ *        新的部分与truncate一样填0
+ * 
+ * @param path 相对于挂载点的路径
+ * @param mode 0或FALLOC_FL_KEEP_SIZE，后者不改变文件大小
+ * @param offset 预分配范围的起点
+ * @param length 预分配范围的长度
+ * @param fi 可忽略
+ * @return int 0成功，否则失败
+ */
+int naivefs_fallocate(const char* path, int mode, off_t offset, off_t length,
+					  struct fuse_file_info* fi) {
+	int is_find, is_root, ret;
+	struct nfs_dentry* dentry = nfs_lookup(path, &is_find, &is_root);
+	(void)fi;
+
+	if (dentry == NULL) {
+		return -NFS_ERROR_IO;
+	}
+	if (!is_find) {
+		return -NFS_ERROR_NOTFOUND;
+	}
+	if (NFS_IS_DIR(dentry->inode)) {
+		return -NFS_ERROR_ISDIR;
+	}
+	if (mode & ~FALLOC_FL_KEEP_SIZE) {
+		return -NFS_ERROR_OPNOTSUPP;
+	}
+	if (offset < 0 || length <= 0) {
+		return -NFS_ERROR_INVAL;
+	}
+	if (offset + length > INT_MAX) {
+		return -NFS_ERROR_FBIG;
+	}
+	nfs_inode_wrlock(dentry->inode);
+	ret = nfs_inode_prealloc(dentry->inode, offset + length, mode & FALLOC_FL_KEEP_SIZE);
+	nfs_inode_unlock(dentry->inode);
+	return ret;
+}
+
+/**
+ * @brief 将文件的改动写回磁盘，并刷出块缓存
+ * 
+ * @param path 相对于挂载点的路径
+ * @param datasync 非0时只要求写回数据，这里与0相同处理
+ * @param fi 文件信息
+ * @return int 0成功，否则失败
+ */
+int naivefs_fsync(const char* path, int datasync, struct fuse_file_info* fi) {
+	int is_find, is_root;
+	struct nfs_dentry* dentry = nfs_lookup(path, &is_find, &is_root);
+	(void)datasync;
+	(void)fi;
+
+	if (dentry == NULL) {
+		return -NFS_ERROR_IO;
+	}
+	if (!is_find) {
+		return -NFS_ERROR_NOTFOUND;
+	}
+	if (nfs_sync_inode(dentry->inode) != NFS_ERROR_NONE) {
+		return -NFS_ERROR_IO;
+	}
+	return nfs_cache_flush();
+}
+
+/**
+ * @brief 关闭文件时调用。每次close都会调用，不取锁也不写回：改动由fsync、
+ *        脏数据上限和后台写回线程写回，卸载时全部写回
+ * 
+ * @param path 相对于挂载点的路径
+ * @param fi 文件信息
+ * @return int 0成功
+ */
+int naivefs_flush(const char* path, struct fuse_file_info* fi) {
+	(void)path;
+	(void)fi;
+	return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 将目录的改动（目录项块、inode）写回磁盘，并刷出块缓存
+ * 
+ * @param path 相对于挂载点的路径
+ * @param datasync 非0时只要求写回数据，这里与0相同处理
+ * @param fi 文件信息
+ * @return int 0成功，否则失败
+ */
+int naivefs_fsyncdir(const char* path, int datasync, struct fuse_file_info* fi) {
+	int is_find, is_root;
+	struct nfs_dentry* dentry = nfs_lookup(path, &is_find, &is_root);
+	(void)datasync;
+	(void)fi;
+
+	if (dentry == NULL) {
+		return -NFS_ERROR_IO;
+	}
+	if (!is_find) {
+		return -NFS_ERROR_NOTFOUND;
+	}
+	if (!NFS_IS_DIR(dentry->inode)) {
+		return -NFS_ERROR_NOTDIR;
+	}
+	if (nfs_sync_inode(dentry->inode) != NFS_ERROR_NONE) {
+		return -NFS_ERROR_IO;
+	}
+	return nfs_cache_flush();
 }
 
 
@@ -366,6 +1163,12 @@ int main(int argc, char **argv)
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
 	nfs_options.device = strdup("/home/guests/190110611/ddriver");
+	nfs_options.cache_kb = NFS_CACHE_DEFAULT_KB;
+	nfs_options.backend = strdup("ddriver");
+	nfs_options.page_kb = NFS_PAGE_DEFAULT_KB;
+	nfs_options.dirty_kb = NFS_DIRTY_DEFAULT_KB;
+	nfs_options.flush_age = NFS_FLUSH_DEFAULT_AGE;
+	nfs_options.icache_kb = NFS_ICACHE_DEFAULT_KB;
 
 	if (fuse_opt_parse(&args, &nfs_options, option_spec, NULL) == -1)
 		return -1;
@@ -0,0 +1,265 @@
+#include "../include/naivefs.h"
+#include <sys/stat.h>
+
+/******************************************************************************
+* SECTION: 设备后端
+*
+* nfs_driver_*只通过后端访问设备，后端传输的每一段均已按IO单位对齐，
+* 且同一批次内各段互不重叠，后端可以按任意顺序或并发完成它们
+*******************************************************************************/
+
+/******************************************************************************
+* SECTION: ddriver后端
+*******************************************************************************/
+static int nfs_ddriver_pos = -1;          // 磁盘头当前位置，-1表示未知
+
+static int nfs_ddriver_open(const char* path) {
+    nfs_ddriver_pos = -1;
+    return ddriver_open((char*)path);
+}
+
+static int nfs_ddriver_close(int fd) {
+    return ddriver_close(fd);
+}
+
+static int nfs_ddriver_ioctl(int fd, unsigned long cmd, void* ret) {
+    return ddriver_ioctl(fd, cmd, ret);
+}
+
+/**
+ * @brief 按顺序传输各段，磁盘头已在段起始处时不再移动
+ *
+ * @param fd
+ * @param iov
+ * @param cnt
+ * @param is_write
+ * @return int
+ */
+static int nfs_ddriver_rw(int fd, struct nfs_iovec* iov, int cnt, int is_write) {
+    int      i, left;
+    uint8_t* cur;
+    for (i = 0; i < cnt; i++) {
+        if (iov[i].offset != nfs_ddriver_pos) {
+            ddriver_seek(fd, iov[i].offset, SEEK_SET);
+        }
+        cur = iov[i].buf;
+        // 每次传输一个IO单位
+        for (left = iov[i].size; left != 0; left -= NFS_IO_SZ()) {
+            if (is_write) {
+                ddriver_write(fd, (char*)cur, NFS_IO_SZ());
+            } else {
+                ddriver_read(fd, (char*)cur, NFS_IO_SZ());
+            }
+            cur += NFS_IO_SZ();
+        }
+        nfs_ddriver_pos = iov[i].offset + iov[i].size;
+    }
+    return NFS_ERROR_NONE;
+}
+
+static int nfs_ddriver_readv(int fd, struct nfs_iovec* iov, int cnt) {
+    return nfs_ddriver_rw(fd, iov, cnt, 0);
+}
+
+static int nfs_ddriver_writev(int fd, struct nfs_iovec* iov, int cnt) {
+    return nfs_ddriver_rw(fd, iov, cnt, 1);
+}
+
+static struct nfs_backend nfs_ddriver_backend = {
+    .name   = "ddriver",
+    .open   = nfs_ddriver_open,
+    .close  = nfs_ddriver_close,
+    .ioctl  = nfs_ddriver_ioctl,
+    .readv  = nfs_ddriver_readv,
+    .writev = nfs_ddriver_writev,
+};
+
+/******************************************************************************
+* SECTION: 磁盘镜像文件公共部分
+*******************************************************************************/
+static struct ddriver_state nfs_img_state;  // 镜像后端的IO统计，与ddriver含义一致
+static int                 nfs_img_pos;     // 上一次传输结束的位置，用于统计seek
+
+int nfs_img_open(const char* path) {
+    int fd = open(path, O_RDWR);
+    memset(&nfs_img_state, 0, sizeof(struct ddriver_state));
+    nfs_img_pos = -1;
+    if (fd < 0) {
+        NFS_DBG("[%s] open %s failed\n", __func__, path);
+        return -NFS_ERROR_IO;
+    }
+    return fd;
+}
+
+int nfs_img_ioctl(int fd, unsigned long cmd, void* ret) {
+    struct stat st;
+    switch (cmd) {
+    case IOC_REQ_DEVICE_SIZE:
+        if (fstat(fd, &st) != 0) {
+            return -NFS_ERROR_IO;
+        }
+        *(int*)ret = NFS_ROUND_DOWN(st.st_size, NFS_IMG_IO_SZ);
+        return NFS_ERROR_NONE;
+    case IOC_REQ_DEVICE_IO_SZ:
+        *(int*)ret = NFS_IMG_IO_SZ;
+        return NFS_ERROR_NONE;
+    case IOC_REQ_DEVICE_STATE:
+        memcpy(ret, &nfs_img_state, sizeof(struct ddriver_state));
+        return NFS_ERROR_NONE;
+    case IOC_REQ_DEVICE_RESET:
+        memset(&nfs_img_state, 0, sizeof(struct ddriver_state));
+        return NFS_ERROR_NONE;
+    default:
+        return -NFS_ERROR_UNSUPPORTED;
+    }
+}
+
+/**
+ * @brief 记录一次镜像传输，读写次数按IO单位计，不连续时计一次seek
+ *
+ * @param offset
+ * @param size
+ * @param is_write
+ */
+void nfs_img_account(int offset, int size, int is_write) {
+    if (offset != nfs_img_pos) {
+        nfs_img_state.seek_cnt++;
+    }
+    if (is_write) {
+        nfs_img_state.write_cnt += size / NFS_IMG_IO_SZ;
+    } else {
+        nfs_img_state.read_cnt  += size / NFS_IMG_IO_SZ;
+    }
+    nfs_img_pos = offset + size;
+}
+
+/**
+ * @brief 用pread/pwrite同步完成一段传输，处理短读写和EINTR
+ *
+ * @param fd
+ * @param offset
+ * @param buf
+ * @param size
+ * @param is_write
+ * @return int
+ */
+int nfs_img_pio(int fd, int offset, uint8_t* buf, int size, int is_write) {
+    ssize_t n;
+    while (size > 0) {
+        if (is_write) {
+            n = pwrite(fd, buf, size, offset);
+        } else {
+            n = pread(fd, buf, size, offset);
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            NFS_DBG("[%s] io error at %d\n", __func__, offset);
+            return -NFS_ERROR_IO;
+        }
+        buf    += n;
+        offset += n;
+        size   -= n;
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 已写入镜像文件的内容落盘，块缓存刷出时调用
+ *
+ * @param fd
+ * @return int
+ */
+int nfs_img_sync(int fd) {
+    while (fdatasync(fd) != 0) {
+        if (errno != EINTR) {
+            NFS_DBG("[%s] fdatasync failed\n", __func__);
+            return -NFS_ERROR_IO;
+        }
+    }
+    return NFS_ERROR_NONE;
+}
+
+/******************************************************************************
+* SECTION: pread/pwrite后端
+*******************************************************************************/
+static int nfs_pio_close(int fd) {
+    fsync(fd);
+    return close(fd);
+}
+
+static int nfs_pio_rw(int fd, struct nfs_iovec* iov, int cnt, int is_write) {
+    int i;
+    for (i = 0; i < cnt; i++) {
+        nfs_img_account(iov[i].offset, iov[i].size, is_write);
+        if (nfs_img_pio(fd, iov[i].offset, iov[i].buf, iov[i].size,
+                        is_write) != NFS_ERROR_NONE) {
+            return -NFS_ERROR_IO;
+        }
+    }
+    return NFS_ERROR_NONE;
+}
+
+static int nfs_pio_readv(int fd, struct nfs_iovec* iov, int cnt) {
+    return nfs_pio_rw(fd, iov, cnt, 0);
+}
+
+static int nfs_pio_writev(int fd, struct nfs_iovec* iov, int cnt) {
+    return nfs_pio_rw(fd, iov, cnt, 1);
+}
+
+static struct nfs_backend nfs_pio_backend = {
+    .name   = "pio",
+    .open   = nfs_img_open,
+    .close  = nfs_pio_close,
+    .ioctl  = nfs_img_ioctl,
+    .readv  = nfs_pio_readv,
+    .writev = nfs_pio_writev,
+    .sync   = nfs_img_sync,
+    .is_file = 1,
+};
+
+/******************************************************************************
+* SECTION: 后端选择
+*******************************************************************************/
+/**
+ * @brief 按名字选择后端并打开设备
+ *
+ * ddriver: ddriver设备（默认）
+ * pio:     磁盘镜像文件，pread/pwrite同步访问，同步点fdatasync
+ * uring:   磁盘镜像文件，io_uring批量异步访问，同步点fdatasync，不可用时退化为pio
+ * mmap:    磁盘镜像文件，整体映射到内存，读写为内存拷贝，同步点msync，失败时退化为pio
+ *
+ * @param name 后端名
+ * @param path 设备路径
+ * @return int 设备handler，小于0表示失败
+ */
+int nfs_backend_open(const char* name, const char* path) {
+    int fd;
+    if (name == NULL || strcmp(name, nfs_ddriver_backend.name) == 0) {
+        super.backend = &nfs_ddriver_backend;
+    } else if (strcmp(name, nfs_pio_backend.name) == 0) {
+        super.backend = &nfs_pio_backend;
+    } else if (strcmp(name, "mmap") == 0) {
+        super.backend = nfs_mmap_backend();
+    } else if (strcmp(name, "uring") == 0) {
+        super.backend = nfs_uring_backend();
+        if (super.backend == NULL) {
+            NFS_DBG("[%s] io_uring unavailable, fall back to pio\n", __func__);
+            super.backend = &nfs_pio_backend;
+        }
+    } else {
+        NFS_DBG("[%s] unknown backend %s\n", __func__, name);
+        return -NFS_ERROR_UNSUPPORTED;
+    }
+    fd = NFS_BACKEND()->open(path);
+    // io_uring和映射在打开时才真正建立，失败同样退化为pio
+    if (fd < 0 && NFS_BACKEND() != &nfs_ddriver_backend
+        && NFS_BACKEND() != &nfs_pio_backend) {
+        NFS_DBG("[%s] %s open failed, fall back to pio\n", __func__, NFS_BACKEND()->name);
+        super.backend = &nfs_pio_backend;
+        fd = NFS_BACKEND()->open(path);
+    }
+    return fd;
+}
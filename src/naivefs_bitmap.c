@@ -0,0 +1,584 @@
+#include "../include/naivefs.h"
+
+/******************************************************************************
+* SECTION: 位图分配器
+*
+* inode位图和data位图共用的分配器。位图按块组分区，每个块组的位图占一块，
+* 在磁盘上分散在各个块组的开头；内存中每区也占一块，区内按64位字扫描，
+* 用ctz定位空闲位。位i属于第i/chunk_bits区，在区内的偏移为i%chunk_bits，
+* 区内第j位对应区内第j/8字节的第j%8位(小端)。
+* 分配从调用者给出的目标位所在的区开始，该区没有空闲时依次尝试后面的区；
+* 每个区记住上一次分配的位置，区内从该处继续查找(next-fit)。
+* 连续区间不跨区：相邻块组的数据区之间隔着下一个块组的位图和inode表。
+* 每个区有自己的互斥锁，不同块组中的分配互不阻塞
+*
+* 各区的空闲位数作为摘要存放在超级块之后，与位图块在同一事务中写回。
+* 挂载时只读摘要，区在分配器第一次访问时才读入；全空或全满的区按摘要直接
+* 构造，不必读盘。写回时只写被修改过的区和摘要块
+*******************************************************************************/
+#define NFS_BMAP_WORD_BITS      64
+
+/**
+ * @brief 第c个区中可分配的位数，最后一区可能不满
+ *
+ * @param bm
+ * @param c
+ * @return int
+ */
+static int nfs_bmap_chunk_bits(struct nfs_bitmap* bm, int c) {
+    int rest = bm->nbits - c * bm->chunk_bits;
+    return rest < bm->chunk_bits ? rest : bm->chunk_bits;
+}
+
+/**
+ * @brief 第c个区区内第w个字的地址
+ *
+ * @param bm
+ * @param c
+ * @param w
+ * @return uint64_t*
+ */
+static uint64_t* nfs_bmap_word(struct nfs_bitmap* bm, int c, int w) {
+    return (uint64_t*)(bm->map + c * NFS_BLK_SZ()) + w;
+}
+
+/**
+ * @brief 取第c个区区内第w个字的空闲位，超出本区可分配位数的位视为已占用。
+ *        调用者持有该区的锁且该区已读入
+ *
+ * @param bm
+ * @param c
+ * @param w
+ * @return uint64_t 空闲位为1
+ */
+static uint64_t nfs_bmap_word_free(struct nfs_bitmap* bm, int c, int w) {
+    uint64_t free_bits = ~*nfs_bmap_word(bm, c, w);
+    int      tail      = nfs_bmap_chunk_bits(bm, c) - w * NFS_BMAP_WORD_BITS;
+    if (tail < NFS_BMAP_WORD_BITS) {
+        free_bits &= tail <= 0 ? 0 : ((uint64_t)1 << tail) - 1;
+    }
+    return free_bits;
+}
+
+/**
+ * @brief 第c个区的空闲位数，可以不持锁读取
+ *
+ * @param bm
+ * @param c
+ * @return int
+ */
+int nfs_bmap_chunk_avail(struct nfs_bitmap* bm, int c) {
+    return __atomic_load_n(&bm->chunk_free[c], __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 修改第c个区的空闲位数，摘要所在的块随之变脏。调用者持有该区的锁
+ *
+ * @param bm
+ * @param c
+ * @param delta
+ */
+static void nfs_bmap_chunk_add(struct nfs_bitmap* bm, int c, int delta) {
+    __atomic_add_fetch(&bm->chunk_free[c], delta, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bm->free, delta, __ATOMIC_RELAXED);
+    __atomic_store_n(&bm->sum_dirty[c * (int)sizeof(int) / NFS_BLK_SZ()], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 读入第c个区。摘要显示全空或全满时直接构造，否则从磁盘读入并按
+ *        实际内容校正摘要(未使用日志时崩溃可能留下过期的摘要)。调用者持有该区的锁
+ *
+ * @param bm
+ * @param c
+ * @return int
+ */
+static int nfs_bmap_load(struct nfs_bitmap* bm, int c) {
+    uint8_t* chunk = bm->map + c * NFS_BLK_SZ();
+    int      w, cnt = 0;
+    if (bm->chunk_loaded[c]) {
+        return NFS_ERROR_NONE;
+    }
+    if (bm->chunk_free[c] == nfs_bmap_chunk_bits(bm, c)) {
+        memset(chunk, 0, NFS_BLK_SZ());
+    } else if (bm->chunk_free[c] == 0) {
+        memset(chunk, 0xFF, NFS_BLK_SZ());
+    } else {
+        if (nfs_driver_read(bm->offset + c * bm->stride, chunk, NFS_BLK_SZ())
+            != NFS_ERROR_NONE) {
+            NFS_DBG("[%s] io error at chunk %d\n", __func__, c);
+            return -NFS_ERROR_IO;
+        }
+        for (w = 0; w < bm->chunk_words; w++) {
+            cnt += __builtin_popcountll(nfs_bmap_word_free(bm, c, w));
+        }
+        if (cnt != bm->chunk_free[c]) {
+            NFS_DBG("[%s] chunk %d summary %d, actual %d\n", __func__, c,
+                    bm->chunk_free[c], cnt);
+            nfs_bmap_chunk_add(bm, c, cnt - bm->chunk_free[c]);
+        }
+        __atomic_add_fetch(&bm->loads, 1, __ATOMIC_RELAXED);
+    }
+    bm->chunk_loaded[c] = 1;
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 位图的空闲计数摘要占用的块数
+ *
+ * @param nchunks 区数
+ * @return int
+ */
+int nfs_bmap_sum_blks(int nchunks) {
+    return (nchunks * (int)sizeof(int) + NFS_BLK_SZ() - 1) / NFS_BLK_SZ();
+}
+
+/**
+ * @brief 初始化位图分配器。格式化时所有区都是空闲的，摘要整体写回；
+ *        否则读入摘要，区留到第一次使用时再读
+ *
+ * @param bm
+ * @param map 位图内存，每区一块
+ * @param nbits 可分配的位数
+ * @param chunk_bits 每区的位数，不超过一块的位数
+ * @param offset 第一区在磁盘上的偏移
+ * @param stride 相邻两区在磁盘上的距离
+ * @param sum_offset 摘要在磁盘上的偏移
+ * @param is_init 是否为格式化
+ * @return int
+ */
+int nfs_bmap_init(struct nfs_bitmap* bm, uint8_t* map, int nbits, int chunk_bits,
+                  int offset, int stride, int sum_offset, int is_init) {
+    int c;
+    memset(bm, 0, sizeof(struct nfs_bitmap));
+    bm->map          = map;
+    bm->nbits        = nbits;
+    bm->offset       = offset;
+    bm->stride       = stride;
+    bm->sum_offset   = sum_offset;
+    bm->chunk_bits   = chunk_bits;
+    bm->chunk_words  = (chunk_bits + NFS_BMAP_WORD_BITS - 1) / NFS_BMAP_WORD_BITS;
+    bm->nchunks      = (nbits + chunk_bits - 1) / chunk_bits;
+    bm->sum_blks     = nfs_bmap_sum_blks(bm->nchunks);
+    // 摘要按块申请，可以直接作为写回的缓冲区
+    bm->chunk_free   = (int*)calloc(bm->sum_blks > 0 ? bm->sum_blks : 1, NFS_BLK_SZ());
+    bm->chunk_hint   = (int*)calloc(bm->nchunks > 0 ? bm->nchunks : 1, sizeof(int));
+    bm->chunk_loaded = (uint8_t*)calloc(bm->nchunks > 0 ? bm->nchunks : 1, sizeof(uint8_t));
+    bm->chunk_dirty  = (uint8_t*)calloc(bm->nchunks > 0 ? bm->nchunks : 1, sizeof(uint8_t));
+    bm->sum_dirty    = (uint8_t*)calloc(bm->sum_blks > 0 ? bm->sum_blks : 1, sizeof(uint8_t));
+    bm->chunk_lock   = (pthread_mutex_t*)calloc(bm->nchunks > 0 ? bm->nchunks : 1,
+                                                sizeof(pthread_mutex_t));
+    if (bm->chunk_free == NULL || bm->chunk_hint == NULL || bm->chunk_loaded == NULL
+        || bm->chunk_dirty == NULL || bm->sum_dirty == NULL || bm->chunk_lock == NULL) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    for (c = 0; c < bm->nchunks; c++) {
+        pthread_mutex_init(&bm->chunk_lock[c], NULL);
+    }
+    if (is_init) {
+        for (c = 0; c < bm->nchunks; c++) {
+            bm->chunk_free[c] = nfs_bmap_chunk_bits(bm, c);
+        }
+        memset(bm->sum_dirty, 1, bm->sum_blks);
+    } else if (nfs_driver_read(sum_offset, (uint8_t*)bm->chunk_free,
+                               bm->sum_blks * NFS_BLK_SZ()) != NFS_ERROR_NONE) {
+        NFS_DBG("[%s] io error\n", __func__);
+        return -NFS_ERROR_IO;
+    }
+    for (c = 0; c < bm->nchunks; c++) {
+        // 损坏的摘要不可信，立即读入该区重新统计
+        if (bm->chunk_free[c] < 0 || bm->chunk_free[c] > nfs_bmap_chunk_bits(bm, c)) {
+            bm->chunk_free[c] = -1;
+            if (nfs_bmap_load(bm, c) != NFS_ERROR_NONE) {
+                return -NFS_ERROR_IO;
+            }
+        }
+    }
+    bm->free = 0;
+    for (c = 0; c < bm->nchunks; c++) {
+        bm->free += bm->chunk_free[c];
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 将第c个区中[off, off + n)置为占用或空闲，并更新空闲计数。
+ *        调用者持有该区的锁
+ *
+ * @param bm
+ * @param c
+ * @param off 区内偏移
+ * @param n
+ * @param used 1置为占用，0置为空闲
+ */
+static void nfs_bmap_set_range(struct nfs_bitmap* bm, int c, int off, int n, int used) {
+    int end = off + n;
+    // 分配的位都已在扫描时读入，只有释放可能落在未读入的区
+    if (nfs_bmap_load(bm, c) != NFS_ERROR_NONE) {
+        return;
+    }
+    bm->chunk_dirty[c] = 1;
+    while (off < end) {
+        uint64_t* word = nfs_bmap_word(bm, c, off / NFS_BMAP_WORD_BITS);
+        int       bias = off % NFS_BMAP_WORD_BITS;
+        int       len  = NFS_BMAP_WORD_BITS - bias < end - off ?
+                         NFS_BMAP_WORD_BITS - bias : end - off;
+        uint64_t  mask = (len == NFS_BMAP_WORD_BITS ? ~(uint64_t)0
+                                                    : (((uint64_t)1 << len) - 1)) << bias;
+        // 只统计真正改变了状态的位
+        int       cnt  = __builtin_popcountll(used ? (mask & ~*word) : (mask & *word));
+        if (used) {
+            *word |= mask;
+            nfs_bmap_chunk_add(bm, c, -cnt);
+        } else {
+            *word &= ~mask;
+            nfs_bmap_chunk_add(bm, c, cnt);
+        }
+        off += len;
+    }
+}
+
+/**
+ * @brief 取第c个区区内的某一位，调用者持有该区的锁且该区已读入
+ *
+ * @param bm
+ * @param c
+ * @param off
+ * @return int
+ */
+static int nfs_bmap_bit(struct nfs_bitmap* bm, int c, int off) {
+    return (*nfs_bmap_word(bm, c, off / NFS_BMAP_WORD_BITS) >> (off % NFS_BMAP_WORD_BITS)) & 0x1;
+}
+
+/**
+ * @brief 在第c个区的字区间[wbegin, wend)中找第一个空闲位
+ *
+ * @param bm
+ * @param c
+ * @param wbegin
+ * @param wend
+ * @return int 区内偏移，没有返回-1
+ */
+static int nfs_bmap_scan(struct nfs_bitmap* bm, int c, int wbegin, int wend) {
+    int w;
+    for (w = wbegin; w < wend; w++) {
+        uint64_t free_bits = nfs_bmap_word_free(bm, c, w);
+        if (free_bits) {
+            return w * NFS_BMAP_WORD_BITS + __builtin_ctzll(free_bits);
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief 在第c个区区内[from, to)中查找n个连续的空闲位，整字空闲或整字占用时
+ *        一次跳过64位
+ *
+ * @param bm
+ * @param c
+ * @param from
+ * @param to
+ * @param n
+ * @return int 区内起始偏移，没有返回-1
+ */
+static int nfs_bmap_find_run(struct nfs_bitmap* bm, int c, int from, int to, int n) {
+    int cur = from, run_start = from, run_len = 0;
+    while (cur < to) {
+        if (cur % NFS_BMAP_WORD_BITS == 0 && cur + NFS_BMAP_WORD_BITS <= to) {
+            uint64_t free_bits = nfs_bmap_word_free(bm, c, cur / NFS_BMAP_WORD_BITS);
+            if (free_bits == ~(uint64_t)0) {
+                if (run_len == 0) {
+                    run_start = cur;
+                }
+                run_len += NFS_BMAP_WORD_BITS;
+                cur     += NFS_BMAP_WORD_BITS;
+                if (run_len >= n) {
+                    return run_start;
+                }
+                continue;
+            }
+            if (free_bits == 0) {
+                cur      += NFS_BMAP_WORD_BITS;
+                run_start = cur;
+                run_len   = 0;
+                continue;
+            }
+        }
+        if (nfs_bmap_bit(bm, c, cur)) {
+            run_len = 0;
+        } else {
+            if (run_len == 0) {
+                run_start = cur;
+            }
+            if (++run_len >= n) {
+                return run_start;
+            }
+        }
+        cur++;
+    }
+    return -1;
+}
+
+/**
+ * @brief 在第c个区中分配n个连续的位，从该区上一次分配的位置向后查找，
+ *        找不到时再从区头查找。调用者持有该区的锁
+ *
+ * @param bm
+ * @param c
+ * @param n
+ * @return int 位号，没有返回-1
+ */
+static int nfs_bmap_chunk_get(struct nfs_bitmap* bm, int c, int n) {
+    int bits = nfs_bmap_chunk_bits(bm, c);
+    int hint = bm->chunk_hint[c] < bits ? bm->chunk_hint[c] : 0;
+    int off;
+    if (bm->chunk_free[c] < n || nfs_bmap_load(bm, c) != NFS_ERROR_NONE) {
+        return -1;
+    }
+    if (n == 1) {
+        off = nfs_bmap_scan(bm, c, hint / NFS_BMAP_WORD_BITS, bm->chunk_words);
+        if (off < 0) {
+            off = nfs_bmap_scan(bm, c, 0, hint / NFS_BMAP_WORD_BITS + 1);
+        }
+    } else {
+        off = nfs_bmap_find_run(bm, c, hint, bits, n);
+        if (off < 0) {
+            // 跨过hint的区间也要考虑
+            off = nfs_bmap_find_run(bm, c, 0, hint + n - 1 < bits ? hint + n - 1 : bits, n);
+        }
+    }
+    if (off < 0) {
+        return -1;
+    }
+    nfs_bmap_set_range(bm, c, off, n, 1);
+    bm->chunk_hint[c] = off + n;
+    return c * bm->chunk_bits + off;
+}
+
+/**
+ * @brief 分配n个连续的位，先在目标位所在的区中查找，再依次尝试后面的区
+ *
+ * @param bm
+ * @param n 不超过一区的位数
+ * @param goal 目标位号，小于0时从第0区开始
+ * @return int 起始位号，没有足够长的空闲区间返回-NFS_ERROR_NOSPACE
+ */
+int nfs_bmap_alloc_run(struct nfs_bitmap* bm, int n, int goal) {
+    int first = goal >= 0 && goal < bm->nbits ? goal / bm->chunk_bits : 0;
+    int i, c, start;
+    if (n <= 0 || n > bm->chunk_bits || nfs_bmap_avail(bm) < n) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    for (i = 0; i < bm->nchunks; i++) {
+        c = (first + i) % bm->nchunks;
+        // 摘要显示空闲不足的区不加锁
+        if (nfs_bmap_chunk_avail(bm, c) < n) {
+            continue;
+        }
+        pthread_mutex_lock(&bm->chunk_lock[c]);
+        start = nfs_bmap_chunk_get(bm, c, n);
+        pthread_mutex_unlock(&bm->chunk_lock[c]);
+        if (start >= 0) {
+            return start;
+        }
+    }
+    return -NFS_ERROR_NOSPACE;
+}
+
+/**
+ * @brief 分配一位
+ *
+ * @param bm
+ * @param goal 目标位号，小于0时从第0区开始
+ * @return int 位号，位图已满返回-NFS_ERROR_NOSPACE
+ */
+int nfs_bmap_alloc(struct nfs_bitmap* bm, int goal) {
+    return nfs_bmap_alloc_run(bm, 1, goal);
+}
+
+/**
+ * @brief 从指定位置起尽量占用连续的空闲位，用于在已有区间之后原地扩展，
+ *        不越过所在的区
+ *
+ * @param bm
+ * @param start
+ * @param n 最多占用的位数
+ * @return int 实际占用的位数，start处已被占用时为0
+ */
+int nfs_bmap_alloc_at(struct nfs_bitmap* bm, int start, int n) {
+    int c, off, bits, len = 0;
+    if (start < 0 || start >= bm->nbits) {
+        return 0;
+    }
+    c    = start / bm->chunk_bits;
+    off  = start % bm->chunk_bits;
+    bits = nfs_bmap_chunk_bits(bm, c);
+    if (nfs_bmap_chunk_avail(bm, c) == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&bm->chunk_lock[c]);
+    if (nfs_bmap_load(bm, c) != NFS_ERROR_NONE) {
+        pthread_mutex_unlock(&bm->chunk_lock[c]);
+        return 0;
+    }
+    while (len < n && off + len < bits) {
+        int      cur  = off + len;
+        int      bias = cur % NFS_BMAP_WORD_BITS;
+        // 移入的高位为0，视为占用，因此used_bits不会超出本字
+        uint64_t used_bits = ~(nfs_bmap_word_free(bm, c, cur / NFS_BMAP_WORD_BITS) >> bias);
+        int      avail     = used_bits ? __builtin_ctzll(used_bits) : NFS_BMAP_WORD_BITS;
+        len += avail < n - len ? avail : n - len;
+        // 本字内遇到已占用的位，不再连续
+        if (avail < NFS_BMAP_WORD_BITS - bias) {
+            break;
+        }
+    }
+    if (len > 0) {
+        nfs_bmap_set_range(bm, c, off, len, 1);
+        bm->chunk_hint[c] = off + len;
+    }
+    pthread_mutex_unlock(&bm->chunk_lock[c]);
+    return len;
+}
+
+/**
+ * @brief 释放[start, start + n)
+ *
+ * @param bm
+ * @param start
+ * @param n
+ */
+void nfs_bmap_free(struct nfs_bitmap* bm, int start, int n) {
+    int c, off, len;
+    if (start < 0 || n <= 0 || start + n > bm->nbits) {
+        NFS_DBG("[%s] bad range %d+%d\n", __func__, start, n);
+        return;
+    }
+    while (n > 0) {
+        c   = start / bm->chunk_bits;
+        off = start % bm->chunk_bits;
+        len = bm->chunk_bits - off < n ? bm->chunk_bits - off : n;
+        pthread_mutex_lock(&bm->chunk_lock[c]);
+        nfs_bmap_set_range(bm, c, off, len, 0);
+        pthread_mutex_unlock(&bm->chunk_lock[c]);
+        start += len;
+        n     -= len;
+    }
+}
+
+/**
+ * @brief 某一位是否已被占用，所在的区读入失败时视为已占用
+ *
+ * @param bm
+ * @param bit
+ * @return int
+ */
+int nfs_bmap_test(struct nfs_bitmap* bm, int bit) {
+    int c = bit / bm->chunk_bits;
+    int used = 1;
+    pthread_mutex_lock(&bm->chunk_lock[c]);
+    if (nfs_bmap_load(bm, c) == NFS_ERROR_NONE) {
+        used = nfs_bmap_bit(bm, c, bit % bm->chunk_bits);
+    }
+    pthread_mutex_unlock(&bm->chunk_lock[c]);
+    return used;
+}
+
+/**
+ * @brief 空闲位数
+ *
+ * @param bm
+ * @return int
+ */
+int nfs_bmap_avail(struct nfs_bitmap* bm) {
+    return __atomic_load_n(&bm->free, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 收集位图中被修改过的区和摘要块加入写回段，二者在同一事务中提交。
+ *        收集到的区标记为写回中(2)，写回结果由nfs_bmap_settle确认，
+ *        期间再次被修改的区重新置为脏(1)
+ *
+ * @param bm
+ * @param list
+ * @return int
+ */
+int nfs_bmap_collect(struct nfs_bitmap* bm, struct nfs_iolist* list) {
+    int c, blk, ret = NFS_ERROR_NONE;
+    for (c = 0; c < bm->nchunks && ret == NFS_ERROR_NONE; c++) {
+        pthread_mutex_lock(&bm->chunk_lock[c]);
+        if (bm->chunk_dirty[c] == 1) {
+            if (nfs_iolist_add(list, bm->offset + c * bm->stride, bm->map + c * NFS_BLK_SZ(),
+                               NFS_BLK_SZ()) != NFS_ERROR_NONE) {
+                ret = -NFS_ERROR_NOSPACE;
+            } else {
+                bm->chunk_dirty[c] = 2;
+            }
+        }
+        pthread_mutex_unlock(&bm->chunk_lock[c]);
+    }
+    for (blk = 0; blk < bm->sum_blks && ret == NFS_ERROR_NONE; blk++) {
+        uint8_t dirty = 1;
+        if (!__atomic_compare_exchange_n(&bm->sum_dirty[blk], &dirty, 2, 0,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        if (nfs_iolist_add(list, bm->sum_offset + blk * NFS_BLK_SZ(),
+                           (uint8_t*)bm->chunk_free + blk * NFS_BLK_SZ(),
+                           NFS_BLK_SZ()) != NFS_ERROR_NONE) {
+            __atomic_store_n(&bm->sum_dirty[blk], 1, __ATOMIC_RELAXED);
+            ret = -NFS_ERROR_NOSPACE;
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief 确认nfs_bmap_collect收集的区的写回结果。成功则置为干净，
+ *        失败则重新置为脏，留待下次写回
+ *
+ * @param bm
+ * @param ok 事务是否已提交
+ */
+void nfs_bmap_settle(struct nfs_bitmap* bm, int ok) {
+    int c, blk;
+    uint8_t state = ok ? 0 : 1;
+    for (c = 0; c < bm->nchunks; c++) {
+        pthread_mutex_lock(&bm->chunk_lock[c]);
+        if (bm->chunk_dirty[c] == 2) {
+            bm->chunk_dirty[c] = state;
+        }
+        pthread_mutex_unlock(&bm->chunk_lock[c]);
+    }
+    for (blk = 0; blk < bm->sum_blks; blk++) {
+        uint8_t flight = 2;
+        __atomic_compare_exchange_n(&bm->sum_dirty[blk], &flight, state, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief 释放分配器自身的结构，位图内存由调用者管理
+ *
+ * @param bm
+ */
+void nfs_bmap_destroy(struct nfs_bitmap* bm) {
+    int c;
+    NFS_DBG("[%s] %d chunks, %d read\n", __func__, bm->nchunks, bm->loads);
+    if (bm->chunk_lock) {
+        for (c = 0; c < bm->nchunks; c++) {
+            pthread_mutex_destroy(&bm->chunk_lock[c]);
+        }
+    }
+    free(bm->chunk_free);
+    free(bm->chunk_hint);
+    free(bm->chunk_loaded);
+    free(bm->chunk_dirty);
+    free(bm->sum_dirty);
+    free(bm->chunk_lock);
+    bm->chunk_free   = NULL;
+    bm->chunk_hint   = NULL;
+    bm->chunk_loaded = NULL;
+    bm->chunk_dirty  = NULL;
+    bm->sum_dirty    = NULL;
+    bm->chunk_lock   = NULL;
+}
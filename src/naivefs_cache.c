@@ -0,0 +1,349 @@
+#include "../include/naivefs.h"
+
+/******************************************************************************
+* SECTION: 块缓存
+*
+* 位于元数据操作与ddriver之间，以NFS_IO_SZ()为单位缓存设备块，
+* 采用CLOCK算法淘汰，脏块在被淘汰或卸载时写回磁盘。除nfs_cache_flush外
+* 的接口只经由驱动层调用，由驱动层持有设备锁
+*******************************************************************************/
+static struct nfs_cache nfs_cache;
+
+#define NFS_CACHE_HASH(blk)     ((unsigned int)(blk) % nfs_cache.hash_sz)
+
+/**
+ * @brief 初始化块缓存
+ *
+ * @param size 缓存容量(字节)，不足一个块时不启用缓存
+ * @return int
+ */
+int nfs_cache_init(int size) {
+    int i;
+    memset(&nfs_cache, 0, sizeof(struct nfs_cache));
+    nfs_cache.capacity = size / NFS_IO_SZ();
+    if (nfs_cache.capacity <= 0) {
+        nfs_cache.capacity = 0;
+        return NFS_ERROR_NONE;
+    }
+    nfs_cache.hash_sz = nfs_cache.capacity * NFS_CACHE_HASH_LOAD;
+    nfs_cache.bufs    = (struct nfs_buf*)calloc(nfs_cache.capacity, sizeof(struct nfs_buf));
+    nfs_cache.hash    = (struct nfs_buf**)calloc(nfs_cache.hash_sz, sizeof(struct nfs_buf*));
+    nfs_cache.pool    = (uint8_t*)malloc(nfs_cache.capacity * NFS_IO_SZ());
+    if (!nfs_cache.bufs || !nfs_cache.hash || !nfs_cache.pool) {
+        free(nfs_cache.bufs);
+        free(nfs_cache.hash);
+        free(nfs_cache.pool);
+        nfs_cache.capacity = 0;
+        return -NFS_ERROR_NOSPACE;
+    }
+    for (i = 0; i < nfs_cache.capacity; i++) {
+        nfs_cache.bufs[i].blk  = -1;
+        nfs_cache.bufs[i].data = nfs_cache.pool + i * NFS_IO_SZ();
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 是否启用了块缓存
+ *
+ * @return int
+ */
+int nfs_cache_enabled() {
+    return nfs_cache.capacity > 0;
+}
+
+/**
+ * @brief 在哈希表中查找块
+ *
+ * @param blk 设备块号
+ * @return struct nfs_buf* 未命中返回NULL
+ */
+static struct nfs_buf* nfs_cache_find(int blk) {
+    struct nfs_buf* buf = nfs_cache.hash[NFS_CACHE_HASH(blk)];
+    while (buf) {
+        if (buf->blk == blk) {
+            return buf;
+        }
+        buf = buf->hash_next;
+    }
+    return NULL;
+}
+
+/**
+ * @brief 将缓冲块从哈希表中摘除
+ *
+ * @param buf
+ */
+static void nfs_cache_unhash(struct nfs_buf* buf) {
+    struct nfs_buf** cur = &nfs_cache.hash[NFS_CACHE_HASH(buf->blk)];
+    while (*cur) {
+        if (*cur == buf) {
+            *cur = buf->hash_next;
+            break;
+        }
+        cur = &(*cur)->hash_next;
+    }
+    buf->hash_next = NULL;
+    buf->blk       = -1;
+}
+
+/**
+ * @brief 将脏块写回磁盘
+ *
+ * @param buf
+ * @return int
+ */
+static int nfs_cache_writeback(struct nfs_buf* buf) {
+    if (buf->blk < 0 || !buf->dirty) {
+        return NFS_ERROR_NONE;
+    }
+    if (nfs_driver_write_raw(buf->blk * NFS_IO_SZ(), buf->data,
+                             NFS_IO_SZ()) != NFS_ERROR_NONE) {
+        NFS_DBG("[%s] io error\n", __func__);
+        return -NFS_ERROR_IO;
+    }
+    buf->dirty = 0;
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief CLOCK算法选出一个可用的缓冲块，必要时写回脏块
+ *
+ * @return struct nfs_buf*
+ */
+static struct nfs_buf* nfs_cache_evict() {
+    struct nfs_buf* buf;
+    while (1) {
+        buf = &nfs_cache.bufs[nfs_cache.hand];
+        nfs_cache.hand = (nfs_cache.hand + 1) % nfs_cache.capacity;
+        if (buf->blk < 0) {
+            return buf;
+        }
+        // 最近被访问过，给第二次机会
+        if (buf->ref) {
+            buf->ref = 0;
+            continue;
+        }
+        if (nfs_cache_writeback(buf) != NFS_ERROR_NONE) {
+            return NULL;
+        }
+        nfs_cache_unhash(buf);
+        return buf;
+    }
+}
+
+/**
+ * @brief 获取块对应的缓冲块
+ *
+ * @param blk 设备块号
+ * @param fill 未命中时是否需要从磁盘读入（整块覆盖写时不需要）
+ * @return struct nfs_buf*
+ */
+static struct nfs_buf* nfs_cache_get(int blk, int fill) {
+    struct nfs_buf* buf = nfs_cache_find(blk);
+    unsigned int    bucket;
+    if (buf) {
+        nfs_cache.hit++;
+        buf->ref = 1;
+        return buf;
+    }
+    nfs_cache.miss++;
+    buf = nfs_cache_evict();
+    if (buf == NULL) {
+        return NULL;
+    }
+    if (fill && nfs_driver_read_raw(blk * NFS_IO_SZ(), buf->data,
+                                    NFS_IO_SZ()) != NFS_ERROR_NONE) {
+        NFS_DBG("[%s] io error\n", __func__);
+        return NULL;
+    }
+    bucket                 = NFS_CACHE_HASH(blk);
+    buf->blk               = blk;
+    buf->dirty             = 0;
+    buf->ref               = 1;
+    buf->hash_next         = nfs_cache.hash[bucket];
+    nfs_cache.hash[bucket] = buf;
+    return buf;
+}
+
+/**
+ * @brief 经由缓存读
+ *
+ * @param offset 磁盘偏移
+ * @param out_content
+ * @param size
+ * @return int
+ */
+int nfs_cache_read(int offset, uint8_t* out_content, int size) {
+    struct nfs_buf* buf;
+    int blk, bias, len;
+    while (size > 0) {
+        blk  = offset / NFS_IO_SZ();
+        bias = offset % NFS_IO_SZ();
+        len  = NFS_IO_SZ() - bias < size ? NFS_IO_SZ() - bias : size;
+        buf  = nfs_cache_get(blk, 1);
+        if (buf == NULL) {
+            return -NFS_ERROR_IO;
+        }
+        memcpy(out_content, buf->data + bias, len);
+        out_content += len;
+        offset      += len;
+        size        -= len;
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 经由缓存写，只修改缓冲块并标脏
+ *
+ * @param offset 磁盘偏移
+ * @param in_content
+ * @param size
+ * @return int
+ */
+int nfs_cache_write(int offset, uint8_t* in_content, int size) {
+    struct nfs_buf* buf;
+    int blk, bias, len;
+    while (size > 0) {
+        blk  = offset / NFS_IO_SZ();
+        bias = offset % NFS_IO_SZ();
+        len  = NFS_IO_SZ() - bias < size ? NFS_IO_SZ() - bias : size;
+        // 整块覆盖时无需先读
+        buf  = nfs_cache_get(blk, len != NFS_IO_SZ());
+        if (buf == NULL) {
+            return -NFS_ERROR_IO;
+        }
+        memcpy(buf->data + bias, in_content, len);
+        buf->dirty   = 1;
+        in_content  += len;
+        offset      += len;
+        size        -= len;
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 经由缓存向量读，完全未被缓存的段合并后直接从设备读取
+ *
+ * @param iov
+ * @param cnt
+ * @return int
+ */
+int nfs_cache_readv(struct nfs_iovec* iov, int cnt) {
+    struct nfs_iovec* direct = (struct nfs_iovec*)malloc(cnt * sizeof(struct nfs_iovec));
+    int direct_cnt = 0, i, ret = NFS_ERROR_NONE;
+    if (direct == NULL) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    for (i = 0; i < cnt; i++) {
+        // 缓存中有任意部分时，缓存中可能是较新的数据，必须经由缓存读
+        if (nfs_cache_cached(iov[i].offset, iov[i].size)) {
+            ret = nfs_cache_read(iov[i].offset, iov[i].buf, iov[i].size);
+            if (ret != NFS_ERROR_NONE) {
+                break;
+            }
+        } else {
+            direct[direct_cnt++] = iov[i];
+        }
+    }
+    if (ret == NFS_ERROR_NONE && direct_cnt > 0) {
+        ret = nfs_driver_readv_raw(direct, direct_cnt);
+    }
+    free(direct);
+    return ret;
+}
+
+/**
+ * @brief 经由缓存向量写
+ *
+ * @param iov
+ * @param cnt
+ * @return int
+ */
+int nfs_cache_writev(struct nfs_iovec* iov, int cnt) {
+    int i;
+    for (i = 0; i < cnt; i++) {
+        if (nfs_cache_write(iov[i].offset, iov[i].buf, iov[i].size) != NFS_ERROR_NONE) {
+            return -NFS_ERROR_IO;
+        }
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 区间内是否有任意IO单位在缓存中
+ *
+ * @param offset
+ * @param size
+ * @return int
+ */
+int nfs_cache_cached(int offset, int size) {
+    int blk;
+    if (size <= 0) {
+        return 0;
+    }
+    for (blk = offset / NFS_IO_SZ(); blk <= (offset + size - 1) / NFS_IO_SZ(); blk++) {
+        if (nfs_cache_find(blk)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief 按块号顺序写回所有脏块，相邻脏块合并成一次连续写，再让后端落盘
+ *
+ * @return int
+ */
+int nfs_cache_flush() {
+    struct nfs_iovec* iov;
+    int i, cnt = 0, ret;
+    nfs_dev_lock();
+    if (nfs_cache.capacity == 0) {
+        nfs_dev_unlock();
+        return nfs_driver_sync();
+    }
+    iov = (struct nfs_iovec*)malloc(nfs_cache.capacity * sizeof(struct nfs_iovec));
+    if (iov == NULL) {
+        nfs_dev_unlock();
+        return -NFS_ERROR_NOSPACE;
+    }
+    for (i = 0; i < nfs_cache.capacity; i++) {
+        if (nfs_cache.bufs[i].blk >= 0 && nfs_cache.bufs[i].dirty) {
+            iov[cnt].offset = nfs_cache.bufs[i].blk * NFS_IO_SZ();
+            iov[cnt].buf    = nfs_cache.bufs[i].data;
+            iov[cnt].size   = NFS_IO_SZ();
+            cnt++;
+        }
+    }
+    ret = nfs_driver_writev_raw(iov, cnt);
+    if (ret == NFS_ERROR_NONE) {
+        for (i = 0; i < nfs_cache.capacity; i++) {
+            nfs_cache.bufs[i].dirty = 0;
+        }
+    }
+    nfs_dev_unlock();
+    free(iov);
+    // 刷出块缓存是同步点，后端需要时在此落盘
+    if (ret == NFS_ERROR_NONE) {
+        ret = nfs_driver_sync();
+    }
+    return ret;
+}
+
+/**
+ * @brief 写回脏块并释放缓存
+ *
+ * @return int
+ */
+int nfs_cache_destroy() {
+    int ret = nfs_cache_flush();
+    if (nfs_cache.capacity > 0) {
+        NFS_DBG("[%s] hit %d, miss %d\n", __func__, nfs_cache.hit, nfs_cache.miss);
+    }
+    free(nfs_cache.bufs);
+    free(nfs_cache.hash);
+    free(nfs_cache.pool);
+    memset(&nfs_cache, 0, sizeof(struct nfs_cache));
+    return ret;
+}
@@ -0,0 +1,284 @@
+#include "../include/naivefs.h"
+
+/******************************************************************************
+* SECTION: 路径缓存
+*
+* 缓存完整路径到nfs_lookup结果的映射，包括未找到的结果（负缓存）。
+* 每个表项挂在它引用的dentry上：正缓存挂在找到的dentry上，负缓存挂在
+* 查找停下的dentry上，这样创建、删除、重命名时只需检查相关dentry上的表项。
+* 负缓存在持有停下处目录的读锁时记录，创建者持有同一目录的写锁使其失效，
+* 因此不会留下过时的负缓存。
+* 查找不取锁，须在读侧临界区内调用：增删表项在锁内进行并原子地更新哈希链，
+* 删除的表项延迟释放；命中只设置访问位，淘汰按CLOCK给访问过的表项第二次机会
+*******************************************************************************/
+static struct nfs_dcache nfs_dcache;
+static pthread_mutex_t   nfs_dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int      nfs_dcache_hit_local;
+
+/**
+ * @brief 初始化路径缓存
+ *
+ * @param max_entries 最多缓存的路径数
+ * @return int
+ */
+int nfs_dcache_init(int max_entries) {
+    memset(&nfs_dcache, 0, sizeof(struct nfs_dcache));
+    nfs_dcache.max_entries = max_entries;
+    nfs_dcache.hash_sz     = NFS_DCACHE_HASH_SZ;
+    nfs_dcache.hash        = (struct nfs_dcache_entry**)calloc(nfs_dcache.hash_sz,
+                                                   sizeof(struct nfs_dcache_entry*));
+    if (nfs_dcache.hash == NULL) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 将表项从LRU链表中摘除
+ *
+ * @param entry
+ */
+static void nfs_dcache_lru_unlink(struct nfs_dcache_entry* entry) {
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        nfs_dcache.lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        nfs_dcache.lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+/**
+ * @brief 将表项放到LRU链表头
+ *
+ * @param entry
+ */
+static void nfs_dcache_lru_push(struct nfs_dcache_entry* entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = nfs_dcache.lru_head;
+    if (nfs_dcache.lru_head) {
+        nfs_dcache.lru_head->lru_prev = entry;
+    } else {
+        nfs_dcache.lru_tail = entry;
+    }
+    nfs_dcache.lru_head = entry;
+}
+
+/**
+ * @brief 释放表项占用的内存
+ *
+ * @param arg 表项
+ */
+static void nfs_dcache_free(void* arg) {
+    struct nfs_dcache_entry* entry = (struct nfs_dcache_entry*)arg;
+    free(entry->path);
+    free(entry);
+}
+
+/**
+ * @brief 删除一个表项，无锁的查找可能仍在访问它，延迟释放
+ *
+ * @param entry
+ */
+static void nfs_dcache_drop(struct nfs_dcache_entry* entry) {
+    struct nfs_dcache_entry** cur = &nfs_dcache.hash[entry->hash & (nfs_dcache.hash_sz - 1)];
+    while (*cur) {
+        if (*cur == entry) {
+            __atomic_store_n(cur, entry->hash_next, __ATOMIC_RELEASE);
+            break;
+        }
+        cur = &(*cur)->hash_next;
+    }
+    cur = &entry->dentry->dcache_refs;
+    while (*cur) {
+        if (*cur == entry) {
+            *cur = entry->ref_next;
+            break;
+        }
+        cur = &(*cur)->ref_next;
+    }
+    nfs_dcache_lru_unlink(entry);
+    nfs_dcache.cnt--;
+    nfs_rcu_retire(entry, nfs_dcache_free);
+}
+
+/**
+ * @brief 查找路径缓存，须在读侧临界区内调用
+ *
+ * @param path
+ * @param is_find 命中时返回查找结果
+ * @param is_root 命中时返回查找结果
+ * @return struct nfs_dentry* 未命中返回NULL
+ */
+struct nfs_dentry* nfs_dcache_get(const char* path, int* is_find, int* is_root) {
+    uint32_t                 hash;
+    struct nfs_dcache_entry* entry;
+    struct nfs_dentry*       dentry = NULL;
+    if (nfs_dcache.hash == NULL) {
+        return NULL;
+    }
+    hash  = nfs_name_hash(path, strlen(path));
+    entry = __atomic_load_n(&nfs_dcache.hash[hash & (nfs_dcache.hash_sz - 1)], __ATOMIC_ACQUIRE);
+    while (entry) {
+        if (entry->hash == hash && strcmp(entry->path, path) == 0) {
+            // 已设置时不再写，热点表项的缓存行不会在各核之间来回传递
+            if (!__atomic_load_n(&entry->ref, __ATOMIC_RELAXED)) {
+                __atomic_store_n(&entry->ref, 1, __ATOMIC_RELAXED);
+            }
+            *is_find = entry->is_find;
+            *is_root = entry->is_root;
+            dentry   = entry->dentry;
+            break;
+        }
+        entry = __atomic_load_n(&entry->hash_next, __ATOMIC_ACQUIRE);
+    }
+    if (dentry) {
+        // 命中计数先在线程内累积，避免每次查找都写同一个共享计数器
+        if (++nfs_dcache_hit_local == NFS_DCACHE_HIT_BATCH) {
+            __atomic_fetch_add(&nfs_dcache.hit, nfs_dcache_hit_local, __ATOMIC_RELAXED);
+            nfs_dcache_hit_local = 0;
+        }
+    } else {
+        __atomic_fetch_add(&nfs_dcache.miss, 1, __ATOMIC_RELAXED);
+    }
+    return dentry;
+}
+
+/**
+ * @brief 记录一次nfs_lookup的结果
+ *
+ * @param path
+ * @param dentry 查找返回的dentry
+ * @param is_find
+ * @param is_root
+ * @param miss_ofs 未找到时，缺失的路径分量在path中的起始下标
+ * @return int
+ */
+int nfs_dcache_put(const char* path, struct nfs_dentry* dentry, int is_find,
+                   int is_root, int miss_ofs) {
+    struct nfs_dcache_entry* entry;
+    struct nfs_dcache_entry* victim;
+    uint32_t bucket;
+    if (nfs_dcache.hash == NULL || nfs_dcache.max_entries <= 0 || dentry == NULL) {
+        return NFS_ERROR_NONE;
+    }
+    entry = (struct nfs_dcache_entry*)calloc(1, sizeof(struct nfs_dcache_entry));
+    if (entry == NULL) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    entry->path     = strdup(path);
+    entry->hash     = nfs_name_hash(path, strlen(path));
+    entry->dentry   = dentry;
+    entry->is_find  = is_find;
+    entry->is_root  = is_root;
+    entry->miss_ofs = miss_ofs;
+    bucket          = entry->hash & (nfs_dcache.hash_sz - 1);
+    pthread_mutex_lock(&nfs_dcache_lock);
+    // 超出容量，淘汰最久未用的表项，访问过的表项清除访问位后放回链表头
+    while (nfs_dcache.cnt >= nfs_dcache.max_entries && nfs_dcache.lru_tail) {
+        victim = nfs_dcache.lru_tail;
+        if (__atomic_exchange_n(&victim->ref, 0, __ATOMIC_RELAXED)) {
+            nfs_dcache_lru_unlink(victim);
+            nfs_dcache_lru_push(victim);
+            continue;
+        }
+        nfs_dcache_drop(victim);
+    }
+    entry->hash_next      = nfs_dcache.hash[bucket];
+    __atomic_store_n(&nfs_dcache.hash[bucket], entry, __ATOMIC_RELEASE);
+    entry->ref_next       = dentry->dcache_refs;
+    dentry->dcache_refs   = entry;
+    nfs_dcache_lru_push(entry);
+    nfs_dcache.cnt++;
+    pthread_mutex_unlock(&nfs_dcache_lock);
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 在目录parent下创建name后调用，删除因此失效的负缓存
+ *
+ * 只有停在parent、且缺失分量恰好是name的负缓存会失效
+ *
+ * @param parent 父目录的dentry
+ * @param name 新建的名字
+ */
+void nfs_dcache_invalidate_create(struct nfs_dentry* parent, const char* name) {
+    struct nfs_dcache_entry* entry;
+    struct nfs_dcache_entry* next;
+    int    len = strlen(name);
+    pthread_mutex_lock(&nfs_dcache_lock);
+    entry = parent->dcache_refs;
+    while (entry) {
+        next = entry->ref_next;
+        if (!entry->is_find
+            && strncmp(entry->path + entry->miss_ofs, name, len) == 0
+            && (entry->path[entry->miss_ofs + len] == '/'
+                || entry->path[entry->miss_ofs + len] == '\0')) {
+            nfs_dcache_drop(entry);
+        }
+        entry = next;
+    }
+    pthread_mutex_unlock(&nfs_dcache_lock);
+}
+
+/**
+ * @brief 删除引用dentry及其已加载子树的全部表项
+ *
+ * @param dentry
+ */
+static void nfs_dcache_drop_tree(struct nfs_dentry* dentry) {
+    struct nfs_dentry* child;
+    while (dentry->dcache_refs) {
+        nfs_dcache_drop(dentry->dcache_refs);
+    }
+    if (dentry->inode && NFS_IS_DIR(dentry->inode)) {
+        for (child = dentry->inode->dentrys; child; child = child->brother) {
+            nfs_dcache_drop_tree(child);
+        }
+    }
+}
+
+/**
+ * @brief dentry被删除或移动前调用，删除引用它及其已加载子树的全部表项
+ *
+ * @param dentry
+ */
+void nfs_dcache_invalidate_tree(struct nfs_dentry* dentry) {
+    pthread_mutex_lock(&nfs_dcache_lock);
+    nfs_dcache_drop_tree(dentry);
+    pthread_mutex_unlock(&nfs_dcache_lock);
+}
+
+/**
+ * @brief 目录的inode被回收前调用，删除引用其子目录项的全部表项
+ *
+ * @param inode 目录inode，子目录项均未加载inode
+ */
+void nfs_dcache_invalidate_children(struct nfs_inode* inode) {
+    struct nfs_dentry* child;
+    pthread_mutex_lock(&nfs_dcache_lock);
+    for (child = inode->dentrys; child; child = child->brother) {
+        while (child->dcache_refs) {
+            nfs_dcache_drop(child->dcache_refs);
+        }
+    }
+    pthread_mutex_unlock(&nfs_dcache_lock);
+}
+
+/**
+ * @brief 释放路径缓存
+ */
+void nfs_dcache_destroy() {
+    if (nfs_dcache.hash) {
+        NFS_DBG("[%s] hit %d, miss %d\n", __func__, nfs_dcache.hit, nfs_dcache.miss);
+    }
+    while (nfs_dcache.lru_head) {
+        nfs_dcache_drop(nfs_dcache.lru_head);
+    }
+    free(nfs_dcache.hash);
+    memset(&nfs_dcache, 0, sizeof(struct nfs_dcache));
+}
@@ -2,10 +2,38 @@
 
 /******************************************************************************
 * SECTION: 磁盘操作封装
+*
+* 块缓存和设备后端都不是线程安全的，经由设备锁串行化。设备锁可重入：
+* 缓存缺失时在持锁状态下直接读写设备
 *******************************************************************************/
+static pthread_mutex_t nfs_dev_mutex;
+static pthread_once_t  nfs_dev_once = PTHREAD_ONCE_INIT;
+
+static void nfs_dev_lock_init() {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&nfs_dev_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+/**
+ * @brief 获取设备锁
+ */
+void nfs_dev_lock() {
+    pthread_once(&nfs_dev_once, nfs_dev_lock_init);
+    pthread_mutex_lock(&nfs_dev_mutex);
+}
+
+/**
+ * @brief 释放设备锁
+ */
+void nfs_dev_unlock() {
+    pthread_mutex_unlock(&nfs_dev_mutex);
+}
 
 /**
- * @brief 驱动读
+ * @brief 驱动读，启用块缓存时经由缓存
  * 
  * @param offset 
  * @param out_content 
@@ -13,56 +41,509 @@
  * @return int 
  */
 int nfs_driver_read(int offset, uint8_t* out_content, int size) {
+    int ret;
+    nfs_journal_lock();
+    nfs_dev_lock();
+    if (nfs_cache_enabled()) {
+        ret = nfs_cache_read(offset, out_content, size);
+    } else {
+        ret = nfs_driver_read_raw(offset, out_content, size);
+    }
+    nfs_dev_unlock();
+    // 已提交到日志、尚未写回原位置的元数据以日志中的内容为准
+    if (ret == NFS_ERROR_NONE) {
+        nfs_journal_overlay(offset, out_content, size);
+    }
+    nfs_journal_unlock();
+    return ret;
+}
+
+/**
+ * @brief 驱动写，启用块缓存时只写入缓存，由缓存负责写回
+ * 
+ * @param offset 
+ * @param in_content 
+ * @param size 
+ * @return int 
+ */
+int nfs_driver_write(int offset, uint8_t* in_content, int size) {
+    int ret;
+    nfs_dev_lock();
+    if (nfs_cache_enabled()) {
+        ret = nfs_cache_write(offset, in_content, size);
+    } else {
+        ret = nfs_driver_write_raw(offset, in_content, size);
+    }
+    nfs_dev_unlock();
+    return ret;
+}
+
+/**
+ * @brief 直接读设备
+ * 
+ * @param offset 
+ * @param out_content 
+ * @param size 
+ * @return int 
+ */
+int nfs_driver_read_raw(int offset, uint8_t* out_content, int size) {
     // 偏移向下取整，读取大小向上取整
     int      offset_aligned = NFS_ROUND_DOWN(offset, NFS_IO_SZ());
     int      bias           = offset - offset_aligned;
     int      size_aligned   = NFS_ROUND_UP((size+bias), NFS_IO_SZ());
-    uint8_t* temp_content   = (uint8_t*)malloc(size_aligned);
-    // 指向即将读取处
-    uint8_t* cur            = temp_content;
-
-    // 移动磁盘头,移到偏移处
-    ddriver_seek(NFS_DRIVER(), offset_aligned, SEEK_SET);
-    // 每次读取一个IO单位
-    while(size_aligned != 0) {
-      ddriver_read(NFS_DRIVER(), cur, NFS_IO_SZ());
-      cur          += NFS_IO_SZ();
-      size_aligned -= NFS_IO_SZ();
-    }
-    // 由于之前向下取整，因此复制时要加上bias
-    memcpy(out_content, temp_content + bias, size);
-    free(temp_content);
-    return NFS_ERROR_NONE;
+    uint8_t* temp_content   = NULL;
+    struct nfs_iovec iov;
+    int      ret;
+
+    iov.offset = offset_aligned;
+    iov.size   = size_aligned;
+    iov.buf    = out_content;
+    // 未对齐时经由临时缓冲区读取
+    if (bias != 0 || size != size_aligned) {
+      temp_content = (uint8_t*)malloc(size_aligned);
+      iov.buf      = temp_content;
+    }
+    nfs_dev_lock();
+    ret = NFS_BACKEND()->readv(NFS_DRIVER(), &iov, 1);
+    nfs_dev_unlock();
+    if (temp_content) {
+      // 由于之前向下取整，因此复制时要加上bias
+      memcpy(out_content, temp_content + bias, size);
+      free(temp_content);
+    }
+    return ret;
 }
 
 /**
- * @brief 驱动写
+ * @brief 直接写设备
  * 
  * @param offset 
  * @param in_content 
  * @param size 
  * @return int 
  */
- int nfs_driver_write(int offset, uint8_t *in_content, int size) {
+ int nfs_driver_write_raw(int offset, uint8_t *in_content, int size) {
     // 偏移向下取整，写入大小向上取整
     int      offset_aligned = NFS_ROUND_DOWN(offset, NFS_IO_SZ());
     int      bias           = offset - offset_aligned;
     int      size_aligned   = NFS_ROUND_UP((size+bias), NFS_IO_SZ());
-    uint8_t* temp_content   = (uint8_t*)malloc(size_aligned);
+    uint8_t* temp_content   = NULL;
     // 指向即将写入处
-    uint8_t* cur            = temp_content;  
-    nfs_driver_read(offset_aligned, temp_content, size_aligned);
-    memcpy(temp_content + bias, in_content, size);
+    uint8_t* cur            = in_content;
+    struct nfs_iovec iov;
+    int      ret;
 
-    // 移动磁盘头,移到偏移处
-    ddriver_seek(NFS_DRIVER(), offset_aligned, SEEK_SET);
-    // 每次写入一个IO单位
-    while(size_aligned != 0) {
-      ddriver_write(NFS_DRIVER(), cur, NFS_IO_SZ());
-      cur          += NFS_IO_SZ();
-      size_aligned -= NFS_IO_SZ();
+    // 偏移和大小均未对齐IO单位时，只需读出首尾两个IO单位。读-改-写整体持锁
+    nfs_dev_lock();
+    if (bias != 0 || size != size_aligned) {
+      temp_content = (uint8_t*)malloc(size_aligned);
+      if (bias != 0) {
+        nfs_driver_read_raw(offset_aligned, temp_content, NFS_IO_SZ());
+      }
+      if ((size + bias) % NFS_IO_SZ() != 0 
+          && (bias == 0 || size_aligned > NFS_IO_SZ())) {
+        nfs_driver_read_raw(offset_aligned + size_aligned - NFS_IO_SZ(),
+                            temp_content + size_aligned - NFS_IO_SZ(), NFS_IO_SZ());
+      }
+      memcpy(temp_content + bias, in_content, size);
+      cur = temp_content;
     }
 
+    iov.offset = offset_aligned;
+    iov.buf    = cur;
+    iov.size   = size_aligned;
+    ret = NFS_BACKEND()->writev(NFS_DRIVER(), &iov, 1);
+    nfs_dev_unlock();
+
     free(temp_content);
+    return ret;
+ }
+
+/******************************************************************************
+* SECTION: 向量化读写
+*******************************************************************************/
+
+/**
+ * @brief 按设备偏移比较两段，用于qsort
+ * 
+ * @param a 
+ * @param b 
+ * @return int 
+ */
+int nfs_iovec_cmp(const void* a, const void* b) {
+    return ((struct nfs_iovec*)a)->offset - ((struct nfs_iovec*)b)->offset;
+}
+
+/**
+ * @brief 从iov[start]开始，找出IO单位上相邻或重叠的一段连续区间
+ * 
+ * @param iov 已按偏移排序
+ * @param cnt 
+ * @param start 
+ * @param run_begin 返回区间起始偏移(IO单位对齐)
+ * @param run_end 返回区间结束偏移(IO单位对齐)
+ * @param tiled 返回区间内各段是否对齐且首尾相接，此时可直接在段缓冲区上传输
+ * @return int 区间结束处的段下标(不含)
+ */
+static int nfs_driver_run(struct nfs_iovec* iov, int cnt, int start,
+                          int* run_begin, int* run_end, int* tiled) {
+    int end = iov[start].offset + iov[start].size;
+    int i;
+    *run_begin = NFS_ROUND_DOWN(iov[start].offset, NFS_IO_SZ());
+    *run_end   = NFS_ROUND_UP(end, NFS_IO_SZ());
+    *tiled     = (*run_begin == iov[start].offset && *run_end == end);
+    for (i = start + 1; i < cnt; i++) {
+        int seg_begin = NFS_ROUND_DOWN(iov[i].offset, NFS_IO_SZ());
+        if (seg_begin > *run_end) {
+            break;
+        }
+        end = iov[i].offset + iov[i].size;
+        *tiled = *tiled && iov[i].offset == *run_end && end % NFS_IO_SZ() == 0;
+        end = NFS_ROUND_UP(end, NFS_IO_SZ());
+        if (end > *run_end) {
+            *run_end = end;
+        }
+    }
+    return i;
+}
+
+/**
+ * @brief 直接从设备向量读，相邻段合并成连续区间后交给后端一次批量完成
+ * 
+ * @param iov 会被按偏移重排
+ * @param cnt 
+ * @return int 
+ */
+int nfs_driver_readv_raw(struct nfs_iovec* iov, int cnt) {
+    struct nfs_iolist xfer;
+    int      start = 0, end, i, k = 0, run_begin, run_end, tiled;
+    int      ret = NFS_ERROR_NONE;
+
+    memset(&xfer, 0, sizeof(struct nfs_iolist));
+    qsort(iov, cnt, sizeof(struct nfs_iovec), nfs_iovec_cmp);
+    // 对齐且首尾相接的区间直接读入各段缓冲区，否则读入区间临时缓冲区
+    while (start < cnt && ret == NFS_ERROR_NONE) {
+        end = nfs_driver_run(iov, cnt, start, &run_begin, &run_end, &tiled);
+        if (tiled) {
+            for (i = start; i < end && ret == NFS_ERROR_NONE; i++) {
+                ret = nfs_iolist_add(&xfer, iov[i].offset, iov[i].buf, iov[i].size);
+            }
+        } else if (nfs_iolist_alloc(&xfer, run_begin, run_end - run_begin) == NULL) {
+            ret = -NFS_ERROR_NOSPACE;
+        }
+        start = end;
+    }
+    if (ret == NFS_ERROR_NONE) {
+        nfs_dev_lock();
+        ret = NFS_BACKEND()->readv(NFS_DRIVER(), xfer.iov, xfer.cnt);
+        nfs_dev_unlock();
+    }
+    // 从临时缓冲区复制到各段，临时缓冲区按区间顺序保存在owned中
+    start = 0;
+    while (ret == NFS_ERROR_NONE && start < cnt) {
+        end = nfs_driver_run(iov, cnt, start, &run_begin, &run_end, &tiled);
+        if (!tiled) {
+            for (i = start; i < end; i++) {
+                memcpy(iov[i].buf, xfer.owned[k] + iov[i].offset - run_begin, iov[i].size);
+            }
+            k++;
+        }
+        start = end;
+    }
+    nfs_iolist_free(&xfer);
+    return ret;
+}
+
+/**
+ * @brief 直接向设备向量写，相邻段合并成连续区间后交给后端一次批量完成
+ * 
+ * @param iov 会被按偏移重排，各段之间不应重叠
+ * @param cnt 
+ * @return int 
+ */
+int nfs_driver_writev_raw(struct nfs_iovec* iov, int cnt) {
+    struct nfs_iolist xfer, pre;
+    int      start = 0, end, i, u, k = 0, run_begin, run_end, tiled, units;
+    int      ret = NFS_ERROR_NONE;
+    int*     covered;
+    uint8_t* temp_content;
+
+    memset(&xfer, 0, sizeof(struct nfs_iolist));
+    memset(&pre, 0, sizeof(struct nfs_iolist));
+    qsort(iov, cnt, sizeof(struct nfs_iovec), nfs_iovec_cmp);
+    while (start < cnt && ret == NFS_ERROR_NONE) {
+        end = nfs_driver_run(iov, cnt, start, &run_begin, &run_end, &tiled);
+        if (tiled) {
+            // 直接从各段缓冲区写出
+            for (i = start; i < end && ret == NFS_ERROR_NONE; i++) {
+                ret = nfs_iolist_add(&xfer, iov[i].offset, iov[i].buf, iov[i].size);
+            }
+            start = end;
+            continue;
+        }
+        temp_content = nfs_iolist_alloc(&xfer, run_begin, run_end - run_begin);
+        if (temp_content == NULL) {
+            ret = -NFS_ERROR_NOSPACE;
+            break;
+        }
+        // 统计每个IO单位被覆盖的字节数，只有未被完全覆盖的单位需要先读
+        units   = (run_end - run_begin) / NFS_IO_SZ();
+        covered = (int*)calloc(units, sizeof(int));
+        if (covered == NULL) {
+            ret = -NFS_ERROR_NOSPACE;
+            break;
+        }
+        for (i = start; i < end; i++) {
+            int seg_cur = iov[i].offset;
+            int seg_end = iov[i].offset + iov[i].size;
+            while (seg_cur < seg_end) {
+                int unit_end = NFS_ROUND_DOWN(seg_cur, NFS_IO_SZ()) + NFS_IO_SZ();
+                int len      = (unit_end < seg_end ? unit_end : seg_end) - seg_cur;
+                covered[(seg_cur - run_begin) / NFS_IO_SZ()] += len;
+                seg_cur += len;
+            }
+        }
+        // 补读登记失败时不能继续写，否则未读的单位会以零覆盖相邻数据
+        for (u = 0; u < units && ret == NFS_ERROR_NONE; u++) {
+            if (covered[u] < NFS_IO_SZ()) {
+                ret = nfs_iolist_add(&pre, run_begin + u * NFS_IO_SZ(),
+                                     temp_content + u * NFS_IO_SZ(), NFS_IO_SZ());
+            }
+        }
+        free(covered);
+        start = end;
+    }
+    // 先批量读出需要补齐的IO单位，再把各段复制进区间临时缓冲区，读-改-写整体持锁
+    nfs_dev_lock();
+    if (ret == NFS_ERROR_NONE && pre.cnt > 0) {
+        ret = NFS_BACKEND()->readv(NFS_DRIVER(), pre.iov, pre.cnt);
+    }
+    start = 0;
+    while (ret == NFS_ERROR_NONE && start < cnt) {
+        end = nfs_driver_run(iov, cnt, start, &run_begin, &run_end, &tiled);
+        if (!tiled) {
+            for (i = start; i < end; i++) {
+                memcpy(xfer.owned[k] + iov[i].offset - run_begin, iov[i].buf, iov[i].size);
+            }
+            k++;
+        }
+        start = end;
+    }
+    if (ret == NFS_ERROR_NONE) {
+        ret = NFS_BACKEND()->writev(NFS_DRIVER(), xfer.iov, xfer.cnt);
+    }
+    nfs_dev_unlock();
+    nfs_iolist_free(&pre);
+    nfs_iolist_free(&xfer);
+    return ret;
+}
+
+/**
+ * @brief 向量读，启用块缓存时经由缓存
+ * 
+ * @param iov 
+ * @param cnt 
+ * @return int 
+ */
+int nfs_driver_readv(struct nfs_iovec* iov, int cnt) {
+    int i, ret;
+    nfs_journal_lock();
+    nfs_dev_lock();
+    if (nfs_cache_enabled()) {
+        ret = nfs_cache_readv(iov, cnt);
+    } else {
+        ret = nfs_driver_readv_raw(iov, cnt);
+    }
+    nfs_dev_unlock();
+    for (i = 0; ret == NFS_ERROR_NONE && i < cnt; i++) {
+        nfs_journal_overlay(iov[i].offset, iov[i].buf, iov[i].size);
+    }
+    nfs_journal_unlock();
+    return ret;
+}
+
+/**
+ * @brief 向量写，启用块缓存时只写入缓存
+ * 
+ * @param iov 
+ * @param cnt 
+ * @return int 
+ */
+int nfs_driver_writev(struct nfs_iovec* iov, int cnt) {
+    int ret;
+    nfs_dev_lock();
+    if (nfs_cache_enabled()) {
+        ret = nfs_cache_writev(iov, cnt);
+    } else {
+        ret = nfs_driver_writev_raw(iov, cnt);
+    }
+    nfs_dev_unlock();
+    return ret;
+}
+
+/**
+ * @brief 设备上[offset, offset + size)的内容是否就是最新内容：不在块缓存中，
+ *        也没有尚未检查点的日志块。调用者持有日志锁和设备锁
+ * 
+ * @param offset 
+ * @param size 
+ * @return int 
+ */
+static int nfs_driver_current(int offset, int size) {
+    return !(nfs_cache_enabled() && nfs_cache_cached(offset, size))
+           && !nfs_journal_pinned(offset, size);
+}
+
+/**
+ * @brief 后端把设备映射在内存中、且[offset, offset + size)是最新内容时，
+ *        返回其在映射中的地址，调用者可以原地解析磁盘结构而不拷贝。
+ *        地址在卸载前有效，其内容只在调用者能保证无人写入该区间时才稳定
+ * 
+ * @param offset 
+ * @param size 
+ * @return uint8_t* 不能原地访问时返回NULL，调用者改为读出
+ */
+uint8_t* nfs_driver_map(int offset, int size) {
+    uint8_t* addr = NULL;
+    if (NFS_BACKEND()->map == NULL) {
+        return NULL;
+    }
+    nfs_journal_lock();
+    nfs_dev_lock();
+    if (nfs_driver_current(offset, size)) {
+        addr = NFS_BACKEND()->map(NFS_DRIVER(), offset, size);
+    }
+    nfs_dev_unlock();
+    nfs_journal_unlock();
+    return addr;
+}
+
+/**
+ * @brief 让已写入设备的内容落盘，后端不需要时什么也不做
+ * 
+ * @return int 
+ */
+int nfs_driver_sync() {
+    int ret = NFS_ERROR_NONE;
+    nfs_dev_lock();
+    if (NFS_BACKEND()->sync) {
+        ret = NFS_BACKEND()->sync(NFS_DRIVER());
+    }
+    nfs_dev_unlock();
+    return ret;
+}
+
+/**
+ * @brief 把src中接下来的size字节直接写入磁盘镜像文件的offset处，数据来自
+ *        请求通道的管道时由fuse_buf_copy以splice完成，不经过用户态缓冲区
+ * 
+ * 区间须按块对齐且不在页缓存中。区间在块缓存中时不直接写，由调用者改走页缓存
+ * 
+ * @param offset 
+ * @param src 
+ * @param size 
+ * @return int 不能直接写时返回-NFS_ERROR_UNSUPPORTED，此时src未被消耗
+ */
+int nfs_driver_splice_in(int offset, struct fuse_bufvec* src, int size) {
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    struct nfs_iovec   iov;
+    ssize_t            n;
+    if (!NFS_BACKEND()->is_file) {
+        return -NFS_ERROR_UNSUPPORTED;
+    }
+    // 数据块上次被用作元数据时可能还有待检查点的旧内容，先让它落盘
+    iov.offset = offset;
+    iov.buf    = NULL;
+    iov.size   = size;
+    if (nfs_journal_revoke(&iov, 1) != NFS_ERROR_NONE) {
+        return -NFS_ERROR_IO;
+    }
+    nfs_dev_lock();
+    if (nfs_cache_enabled() && nfs_cache_cached(offset, size)) {
+        nfs_dev_unlock();
+        return -NFS_ERROR_UNSUPPORTED;
+    }
+    dst.buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+    dst.buf[0].fd    = NFS_DRIVER();
+    dst.buf[0].pos   = offset;
+    n = fuse_buf_copy(&dst, src, (enum fuse_buf_copy_flags)0);
+    nfs_img_account(offset, size, 1);
+    nfs_dev_unlock();
+    if (n != size) {
+        NFS_DBG("[%s] io error\n", __func__);
+        return -NFS_ERROR_IO;
+    }
     return NFS_ERROR_NONE;
- }
\ No newline at end of file
+}
+
+/**
+ * @brief 向iolist追加一段
+ * 
+ * @param list 
+ * @param offset 
+ * @param buf 
+ * @param size 
+ * @return int 
+ */
+int nfs_iolist_add(struct nfs_iolist* list, int offset, uint8_t* buf, int size) {
+    if (list->cnt == list->cap) {
+        int cap = list->cap ? list->cap * 2 : 16;
+        struct nfs_iovec* iov = (struct nfs_iovec*)realloc(list->iov, 
+                                                           cap * sizeof(struct nfs_iovec));
+        if (iov == NULL) {
+            return -NFS_ERROR_NOSPACE;
+        }
+        list->iov = iov;
+        list->cap = cap;
+    }
+    list->iov[list->cnt].offset = offset;
+    list->iov[list->cnt].buf    = buf;
+    list->iov[list->cnt].size   = size;
+    list->cnt++;
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 申请一块清零的缓冲区并作为一段追加到iolist，缓冲区随iolist释放
+ * 
+ * @param list 
+ * @param offset 
+ * @param size 
+ * @return uint8_t* 
+ */
+uint8_t* nfs_iolist_alloc(struct nfs_iolist* list, int offset, int size) {
+    uint8_t* buf;
+    if (list->owned_cnt == list->owned_cap) {
+        int cap = list->owned_cap ? list->owned_cap * 2 : 16;
+        uint8_t** owned = (uint8_t**)realloc(list->owned, cap * sizeof(uint8_t*));
+        if (owned == NULL) {
+            return NULL;
+        }
+        list->owned     = owned;
+        list->owned_cap = cap;
+    }
+    buf = (uint8_t*)calloc(1, size);
+    if (buf == NULL) {
+        return NULL;
+    }
+    list->owned[list->owned_cnt++] = buf;
+    if (nfs_iolist_add(list, offset, buf, size) != NFS_ERROR_NONE) {
+        return NULL;
+    }
+    return buf;
+}
+
+/**
+ * @brief 释放iolist
+ * 
+ * @param list 
+ */
+void nfs_iolist_free(struct nfs_iolist* list) {
+    int i;
+    for (i = 0; i < list->owned_cnt; i++) {
+        free(list->owned[i]);
+    }
+    free(list->owned);
+    free(list->iov);
+    memset(list, 0, sizeof(struct nfs_iolist));
+}
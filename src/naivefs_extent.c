@@ -0,0 +1,441 @@
+#include "../include/naivefs.h"
+
+/******************************************************************************
+* SECTION: 区间映射
+*
+* 文件和目录的数据块按区间(起始块号, 块数)记录，逻辑上连续、物理上也连续的
+* 块合并为一个区间。前NFS_INODE_EXTENTS个区间直接存放在inode中，其余区间
+* 存放在两层的区间树中：索引块依次记录叶子块号，叶子块依次存放区间。
+* 内存中所有区间展开为一个数组，区间树的块在区间数变化时随之分配和释放。
+* 文件末尾还可以有推迟分配的块：它们只在super.data_delayed中预留空间，内容
+* 在页缓存中，写回时才连同之后追加的块一起分配
+*******************************************************************************/
+
+/**
+ * @brief 初始化inode的区间映射
+ *
+ * @param inode
+ */
+void nfs_extent_init(struct nfs_inode* inode) {
+    inode->extents      = NULL;
+    inode->ext_cnt      = 0;
+    inode->ext_cap      = 0;
+    inode->blk_cnt      = 0;
+    inode->delay_cnt    = 0;
+    inode->ext_root     = -1;
+    inode->ext_leaves   = NULL;
+    inode->ext_leaf_cnt = 0;
+}
+
+/**
+ * @brief 释放区间映射的内存结构，不释放磁盘块
+ *
+ * @param inode
+ */
+void nfs_extent_destroy(struct nfs_inode* inode) {
+    free(inode->extents);
+    free(inode->ext_leaves);
+    nfs_extent_init(inode);
+}
+
+/**
+ * @brief 查找逻辑块所在的区间
+ *
+ * @param inode
+ * @param lblk 逻辑块号
+ * @return int 区间下标，超出已分配范围返回-1
+ */
+static int nfs_extent_find(struct nfs_inode* inode, int lblk) {
+    int lo = 0, hi = inode->ext_cnt - 1, mid;
+    if (lblk < 0 || lblk >= inode->blk_cnt) {
+        return -1;
+    }
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (inode->extents[mid].lblk <= lblk) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+/**
+ * @brief 逻辑块号映射为数据块号
+ *
+ * @param inode
+ * @param lblk
+ * @return int 数据块号，未分配返回-1
+ */
+int nfs_extent_map(struct nfs_inode* inode, int lblk) {
+    int idx = nfs_extent_find(inode, lblk);
+    if (idx < 0) {
+        return -1;
+    }
+    return inode->extents[idx].start + lblk - inode->extents[idx].lblk;
+}
+
+/**
+ * @brief 分配数据块的目标位置：紧接最后一个区间，没有区间时为inode所在块组的
+ *        数据区
+ *
+ * @param inode
+ * @return int 目标数据块号
+ */
+static int nfs_extent_goal(struct nfs_inode* inode) {
+    struct nfs_extent* last;
+    if (inode->ext_cnt > 0) {
+        last = &inode->extents[inode->ext_cnt - 1];
+        return last->start + last->len - 1;
+    }
+    return NFS_INO_GROUP(inode->ino) * super.data_per_group;
+}
+
+/**
+ * @brief 使区间树的块数与区间数相符，多出的块释放，不足的块分配
+ *
+ * @param inode
+ * @return int
+ */
+static int nfs_extent_tree_fit(struct nfs_inode* inode) {
+    int need = 0, blk;
+    int* leaves;
+    if (inode->ext_cnt > NFS_INODE_EXTENTS) {
+        need = inode->ext_cnt - NFS_INODE_EXTENTS;
+        need = (need + NFS_EXT_PER_BLK() - 1) / NFS_EXT_PER_BLK();
+    }
+    if (need > NFS_EXT_IDX_PER_BLK()) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    while (inode->ext_leaf_cnt > need) {
+        nfs_bmap_free(&super.bmap_data, inode->ext_leaves[--inode->ext_leaf_cnt], 1);
+    }
+    if (need == 0 && inode->ext_root != -1) {
+        nfs_bmap_free(&super.bmap_data, inode->ext_root, 1);
+        inode->ext_root = -1;
+    }
+    if (need > 0 && inode->ext_root == -1) {
+        inode->ext_root = nfs_bmap_alloc(&super.bmap_data, nfs_extent_goal(inode));
+        if (inode->ext_root < 0) {
+            inode->ext_root = -1;
+            return -NFS_ERROR_NOSPACE;
+        }
+    }
+    if (need > inode->ext_leaf_cnt) {
+        leaves = (int*)realloc(inode->ext_leaves, need * sizeof(int));
+        if (leaves == NULL) {
+            return -NFS_ERROR_NOSPACE;
+        }
+        inode->ext_leaves = leaves;
+        while (inode->ext_leaf_cnt < need) {
+            blk = nfs_bmap_alloc(&super.bmap_data, nfs_extent_goal(inode));
+            if (blk < 0) {
+                return -NFS_ERROR_NOSPACE;
+            }
+            inode->ext_leaves[inode->ext_leaf_cnt++] = blk;
+        }
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 在末尾追加一个区间
+ *
+ * @param inode
+ * @param start
+ * @param len
+ * @return int
+ */
+static int nfs_extent_append(struct nfs_inode* inode, int start, int len) {
+    struct nfs_extent* extents;
+    int cap;
+    if (inode->ext_cnt == inode->ext_cap) {
+        cap     = inode->ext_cap ? inode->ext_cap * 2 : 4;
+        extents = (struct nfs_extent*)realloc(inode->extents, cap * sizeof(struct nfs_extent));
+        if (extents == NULL) {
+            return -NFS_ERROR_NOSPACE;
+        }
+        inode->extents = extents;
+        inode->ext_cap = cap;
+    }
+    inode->extents[inode->ext_cnt].lblk  = inode->blk_cnt;
+    inode->extents[inode->ext_cnt].start = start;
+    inode->extents[inode->ext_cnt].len   = len;
+    inode->ext_cnt++;
+    inode->blk_cnt += len;
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 在末尾再分配n个数据块。优先紧接最后一个区间扩展，否则在最后一个区间或
+ *        inode所在的块组中申请尽量长的连续区间
+ *
+ * @param inode
+ * @param n
+ * @return int 空间不足时不分配任何块并返回-NFS_ERROR_NOSPACE
+ */
+int nfs_extent_grow(struct nfs_inode* inode, int n) {
+    struct nfs_extent* last;
+    int old_cnt = inode->blk_cnt;
+    int got, len, start;
+    // 推迟分配的文件预留的块不能占用。并发分配时仍可能中途失败，由末尾统一回滚
+    if (nfs_bmap_avail(&super.bmap_data)
+        - __atomic_load_n(&super.data_delayed, __ATOMIC_RELAXED) < n) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    while (n > 0) {
+        if (inode->ext_cnt > 0) {
+            last = &inode->extents[inode->ext_cnt - 1];
+            got  = nfs_bmap_alloc_at(&super.bmap_data, last->start + last->len, n);
+            last->len      += got;
+            inode->blk_cnt += got;
+            n              -= got;
+            if (n == 0) {
+                break;
+            }
+        }
+        // 连续区间不跨块组，找不到足够长的连续区间时减半再试
+        len = n < super.data_per_group ? n : super.data_per_group;
+        while ((start = nfs_bmap_alloc_run(&super.bmap_data, len, nfs_extent_goal(inode))) < 0
+               && len > 1) {
+            len /= 2;
+        }
+        if (start < 0) {
+            break;
+        }
+        if (nfs_extent_append(inode, start, len) != NFS_ERROR_NONE) {
+            nfs_bmap_free(&super.bmap_data, start, len);
+            break;
+        }
+        n -= len;
+    }
+    if (n > 0 || nfs_extent_tree_fit(inode) != NFS_ERROR_NONE) {
+        nfs_extent_truncate(inode, old_cnt);
+        return -NFS_ERROR_NOSPACE;
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 在末尾再预留n个数据块，只计入预留数，不分配具体的块
+ *
+ * @param inode
+ * @param n
+ * @return int 空间不足时不预留并返回-NFS_ERROR_NOSPACE
+ */
+int nfs_extent_delay(struct nfs_inode* inode, int n) {
+    int reserved = __atomic_add_fetch(&super.data_delayed, n, __ATOMIC_RELAXED);
+    if (nfs_bmap_avail(&super.bmap_data) < reserved) {
+        __atomic_sub_fetch(&super.data_delayed, n, __ATOMIC_RELAXED);
+        return -NFS_ERROR_NOSPACE;
+    }
+    inode->delay_cnt += n;
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 为推迟分配的块连同末尾再追加的extra个块一次分配数据块。攒下的块
+ *        一起交给分配器，才能紧接最后一个区间得到尽量长的连续区间
+ *
+ * @param inode
+ * @param extra
+ * @return int 空间不足时保持原状并返回-NFS_ERROR_NOSPACE
+ */
+int nfs_extent_delalloc(struct nfs_inode* inode, int extra) {
+    int old_cnt = inode->blk_cnt;
+    int delay   = inode->delay_cnt;
+    if (delay + extra == 0) {
+        return NFS_ERROR_NONE;
+    }
+    __atomic_sub_fetch(&super.data_delayed, delay, __ATOMIC_RELAXED);
+    inode->delay_cnt = 0;
+    if (nfs_extent_grow(inode, delay + extra) != NFS_ERROR_NONE) {
+        __atomic_add_fetch(&super.data_delayed, delay, __ATOMIC_RELAXED);
+        inode->delay_cnt = delay;
+        return -NFS_ERROR_NOSPACE;
+    }
+    if (delay > 0) {
+        nfs_page_remap(inode, old_cnt, old_cnt + delay);
+    }
+    nfs_dirty_inode(inode);
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 只保留前n个数据块，释放其余的块。推迟分配的块在最后，先从中去掉
+ *
+ * @param inode
+ * @param n
+ */
+void nfs_extent_truncate(struct nfs_inode* inode, int n) {
+    struct nfs_extent* last;
+    int drop = inode->blk_cnt + inode->delay_cnt - n;
+    if (drop > 0 && inode->delay_cnt > 0) {
+        drop = drop < inode->delay_cnt ? drop : inode->delay_cnt;
+        __atomic_sub_fetch(&super.data_delayed, drop, __ATOMIC_RELAXED);
+        inode->delay_cnt -= drop;
+    }
+    while (inode->blk_cnt > n) {
+        last = &inode->extents[inode->ext_cnt - 1];
+        drop = inode->blk_cnt - n < last->len ? inode->blk_cnt - n : last->len;
+        nfs_bmap_free(&super.bmap_data, last->start + last->len - drop, drop);
+        last->len      -= drop;
+        inode->blk_cnt -= drop;
+        if (last->len == 0) {
+            inode->ext_cnt--;
+        }
+    }
+    nfs_extent_tree_fit(inode);
+}
+
+/**
+ * @brief 释放inode占用的全部数据块和区间树的块
+ *
+ * @param inode
+ */
+void nfs_extent_release(struct nfs_inode* inode) {
+    nfs_extent_truncate(inode, 0);
+    nfs_extent_destroy(inode);
+}
+
+/**
+ * @brief 为逻辑块[lblk, lblk + n)生成传输段，每个区间一段
+ *
+ * @param inode
+ * @param list
+ * @param lblk
+ * @param n
+ * @param buf 与这些块对应的内存
+ * @return int
+ */
+int nfs_extent_iolist(struct nfs_inode* inode, struct nfs_iolist* list, int lblk, int n,
+                      uint8_t* buf) {
+    int idx = nfs_extent_find(inode, lblk);
+    int bias, len;
+    if (n > 0 && (idx < 0 || lblk + n > inode->blk_cnt)) {
+        return -NFS_ERROR_INVAL;
+    }
+    while (n > 0) {
+        bias = lblk - inode->extents[idx].lblk;
+        len  = inode->extents[idx].len - bias < n ? inode->extents[idx].len - bias : n;
+        if (nfs_iolist_add(list, NFS_DATA_OFS(inode->extents[idx].start + bias), buf,
+                           len * NFS_BLK_SZ()) != NFS_ERROR_NONE) {
+            return -NFS_ERROR_NOSPACE;
+        }
+        buf  += len * NFS_BLK_SZ();
+        lblk += len;
+        n    -= len;
+        idx++;
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 从磁盘inode中读出区间映射，区间树的所有叶子块一次向量读
+ *
+ * @param inode
+ * @param inode_d
+ * @return int
+ */
+int nfs_extent_load(struct nfs_inode* inode, const struct nfs_inode_d* inode_d) {
+    struct nfs_extent_d* ext_d;
+    struct nfs_iolist    list;
+    uint8_t* buf;
+    int      i, leaf_cnt;
+
+    nfs_extent_init(inode);
+    inode->ext_cap = inode_d->ext_cnt;
+    if (inode->ext_cap > 0) {
+        inode->extents = (struct nfs_extent*)malloc(inode->ext_cap * sizeof(struct nfs_extent));
+        if (inode->extents == NULL) {
+            return -NFS_ERROR_NOSPACE;
+        }
+    }
+    for (i = 0; i < inode_d->ext_cnt && i < NFS_INODE_EXTENTS; i++) {
+        nfs_extent_append(inode, inode_d->extents[i].start, inode_d->extents[i].len);
+    }
+    if (inode_d->ext_root == -1 || inode_d->ext_cnt <= NFS_INODE_EXTENTS) {
+        return NFS_ERROR_NONE;
+    }
+    leaf_cnt = inode_d->ext_cnt - NFS_INODE_EXTENTS;
+    leaf_cnt = (leaf_cnt + NFS_EXT_PER_BLK() - 1) / NFS_EXT_PER_BLK();
+    inode->ext_root   = inode_d->ext_root;
+    inode->ext_leaves = (int*)malloc(NFS_BLK_SZ());
+    buf               = (uint8_t*)malloc(leaf_cnt * NFS_BLK_SZ());
+    if (inode->ext_leaves == NULL || buf == NULL) {
+        free(buf);
+        return -NFS_ERROR_NOSPACE;
+    }
+    if (nfs_driver_read(NFS_DATA_OFS(inode->ext_root), (uint8_t*)inode->ext_leaves,
+                        NFS_BLK_SZ()) != NFS_ERROR_NONE) {
+        NFS_DBG("[%s] io error\n", __func__);
+        free(buf);
+        return -NFS_ERROR_IO;
+    }
+    inode->ext_leaf_cnt = leaf_cnt;
+    memset(&list, 0, sizeof(struct nfs_iolist));
+    for (i = 0; i < leaf_cnt; i++) {
+        nfs_iolist_add(&list, NFS_DATA_OFS(inode->ext_leaves[i]), buf + i * NFS_BLK_SZ(),
+                       NFS_BLK_SZ());
+    }
+    if (nfs_driver_readv(list.iov, list.cnt) != NFS_ERROR_NONE) {
+        NFS_DBG("[%s] io error\n", __func__);
+        nfs_iolist_free(&list);
+        free(buf);
+        return -NFS_ERROR_IO;
+    }
+    ext_d = (struct nfs_extent_d*)buf;
+    for (i = NFS_INODE_EXTENTS; i < inode_d->ext_cnt; i++) {
+        nfs_extent_append(inode, ext_d[i - NFS_INODE_EXTENTS].start,
+                          ext_d[i - NFS_INODE_EXTENTS].len);
+    }
+    nfs_iolist_free(&list);
+    free(buf);
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 将区间映射写入磁盘inode，溢出的区间连同区间树的块加入写回段
+ *
+ * @param inode
+ * @param inode_d
+ * @param list
+ * @return int
+ */
+int nfs_extent_store(struct nfs_inode* inode, struct nfs_inode_d* inode_d,
+                     struct nfs_iolist* list) {
+    struct nfs_extent_d* ext_d;
+    int* root;
+    int  i;
+
+    inode_d->blk_cnt  = inode->blk_cnt;
+    inode_d->ext_cnt  = inode->ext_cnt;
+    inode_d->ext_root = inode->ext_root;
+    for (i = 0; i < NFS_INODE_EXTENTS; i++) {
+        inode_d->extents[i].start = i < inode->ext_cnt ? inode->extents[i].start : -1;
+        inode_d->extents[i].len   = i < inode->ext_cnt ? inode->extents[i].len : 0;
+    }
+    if (inode->ext_root == -1) {
+        return NFS_ERROR_NONE;
+    }
+    root = (int*)nfs_iolist_alloc(list, NFS_DATA_OFS(inode->ext_root), NFS_BLK_SZ());
+    if (root == NULL) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    memcpy(root, inode->ext_leaves, inode->ext_leaf_cnt * sizeof(int));
+    ext_d = NULL;
+    for (i = NFS_INODE_EXTENTS; i < inode->ext_cnt; i++) {
+        if ((i - NFS_INODE_EXTENTS) % NFS_EXT_PER_BLK() == 0) {
+            ext_d = (struct nfs_extent_d*)nfs_iolist_alloc(list,
+                NFS_DATA_OFS(inode->ext_leaves[(i - NFS_INODE_EXTENTS) / NFS_EXT_PER_BLK()]),
+                NFS_BLK_SZ());
+            if (ext_d == NULL) {
+                return -NFS_ERROR_NOSPACE;
+            }
+        }
+        ext_d[(i - NFS_INODE_EXTENTS) % NFS_EXT_PER_BLK()].start = inode->extents[i].start;
+        ext_d[(i - NFS_INODE_EXTENTS) % NFS_EXT_PER_BLK()].len   = inode->extents[i].len;
+    }
+    return NFS_ERROR_NONE;
+}
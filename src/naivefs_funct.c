@@ -4,15 +4,53 @@
 * SECTION: 功能函数
 *******************************************************************************/
 
+/**
+ * @brief 写回超级块
+ * 
+ * @return int 
+ */
+static int nfs_write_super() {
+   struct nfs_super_d nfs_super_d;
+
+   nfs_super_d.magic_num         = NAIVEFS_MAGIC;
+   nfs_super_d.group_offset      = super.group_offset;
+   nfs_super_d.group_cnt         = super.group_cnt;
+   nfs_super_d.group_blks        = super.group_blks;
+   nfs_super_d.ino_per_group     = super.ino_per_group;
+   nfs_super_d.data_per_group    = super.data_per_group;
+   nfs_super_d.itable_blks       = super.itable_blks;
+   nfs_super_d.sum_inode_offset  = super.sum_inode_offset;
+   nfs_super_d.sum_data_offset   = super.sum_data_offset;
+   nfs_super_d.size_usage        = super.size_usage;
+   nfs_super_d.max_ino           = super.max_ino;
+   nfs_super_d.max_data          = super.max_data;
+   nfs_super_d.journal_offset    = super.journal_offset;
+   nfs_super_d.journal_blks      = super.journal_blks;
+   nfs_super_d.version           = super.version;
+
+   if (nfs_driver_write(NFS_SUPER_OFS, (uint8_t *)&nfs_super_d, 
+                     sizeof(struct nfs_super_d)) != NFS_ERROR_NONE) {
+      NFS_DBG("[%s] io error\n", __func__);
+      return -NFS_ERROR_IO;
+   }
+   return NFS_ERROR_NONE;
+}
+
  /**
  * @brief 挂载naivefs, Layout 如下
  * 
  * Layout
- * | Super | Inode Bitmap | Data Bitmap| Inode | Data |
+ * | Super | Bitmap Summary | Journal | Group 0 | Group 1 | ... |
+ * 
+ * 每个块组(Group)：
+ * | Inode Bitmap | Data Bitmap | Inode | Data |
  * 
  * 2*IO_SZ = BLK_SZ 
  * 
- * 每个Inode占用一个Blk
+ * 每个块组的两个位图各占一块，最后一组的数据块可能不满。
+ * Inode区是定长记录的表，每块存放BLK_SZ / NFS_INODE_SZ个Inode；
+ * 目录块中是紧密排列的变长目录项记录。
+ * Bitmap Summary是两个位图在每个块组中的空闲位数，挂载时只读它，位图块按需读入
  * @param options 
  * @return int    
  */
@@ -24,27 +62,49 @@ int naivefs_mount(struct custom_options nfs_options) {
    struct nfs_inode*       root_inode;
 
    int                     super_blks;
-   int                     inode_num;
-   int                     inode_blks;
-   int                     map_data_blks;
-   int                     map_inode_blks;
+   int                     ino_per_blk;
+   int                     journal_blks;
+   int                     sum_blks;
+   int                     group_blks;
+   int                     group_cnt;
+   int                     ino_per_group;
+   int                     itable_blks;
+   int                     remain_blks;
+   int                     last_data;
 
    int                     is_init = 0;
 
-   super.is_mounted = 0;
+   super.is_mounted   = 0;
+   super.data_delayed = 0;
 
    // 控制设备
-   driver_fd = ddriver_open(nfs_options.device);
+   driver_fd = nfs_backend_open(nfs_options.backend, nfs_options.device);
    if (driver_fd < 0) {
       return driver_fd;
    }
    super.driver_fd = driver_fd;
    // 获取磁盘容量和IO大小
-   ddriver_ioctl(NFS_DRIVER(), IOC_REQ_DEVICE_SIZE,  &super.size_disk);
-   ddriver_ioctl(NFS_DRIVER(), IOC_REQ_DEVICE_IO_SZ, &super.size_io);
+   NFS_BACKEND()->ioctl(NFS_DRIVER(), IOC_REQ_DEVICE_SIZE,  &super.size_disk);
+   NFS_BACKEND()->ioctl(NFS_DRIVER(), IOC_REQ_DEVICE_IO_SZ, &super.size_io);
+   // 初始化块缓存
+   if (nfs_cache_init(nfs_options.cache_kb * 1024) != NFS_ERROR_NONE) {
+      NFS_DBG("[%s] cache init error\n", __func__);
+      return -NFS_ERROR_NOSPACE;
+   }
    
+   // 初始化文件页缓存
+   nfs_page_init(nfs_options.page_kb * 1024);
+
+   // 初始化路径缓存
+   if (nfs_dcache_init(NFS_DCACHE_MAX) != NFS_ERROR_NONE) {
+      return -NFS_ERROR_NOSPACE;
+   }
+   // 目录项和inode的对象缓存
+   nfs_slab_init(&super.dentry_slab, "dentry", sizeof(struct nfs_dentry));
+   nfs_slab_init(&super.inode_slab, "inode", sizeof(struct nfs_inode));
+   nfs_icache_init(nfs_options.icache_kb);
    // 初始化根目录
-   root_dentry = new_dentry("/", NFS_DIR);
+   root_dentry = new_dentry(NULL, "/", NFS_DIR);
 
    // 读取磁盘中的super block
    if (nfs_driver_read(NFS_SUPER_OFS, (uint8_t*)(&nfs_super_d),
@@ -56,72 +116,118 @@ int naivefs_mount(struct custom_options nfs_options) {
    if (nfs_super_d.magic_num != NAIVEFS_MAGIC) {
       super_blks = NFS_ROUND_UP(sizeof(struct nfs_super_d), NFS_BLK_SZ()) 
                    / NFS_BLK_SZ();
-      // 假设每个文件大小为6k, 估计inode数
-      inode_num  = NFS_DISK_SZ() 
-                   / ((NFS_BLK_PER_FILE + NFS_INO_PER_FILE) * NFS_BLK_SZ());
-      // inode位图所占块数
-      map_inode_blks = NFS_ROUND_UP(inode_num, NFS_BLK_SZ()) / NFS_BLK_SZ();
-      // inode所占块数,假设一个inode占一块
-      inode_blks = inode_num;
-      // data位图所占块数
-      int remain_blks = NFS_BLK_NUM() - super_blks - inode_blks - map_inode_blks;
-      map_data_blks =  NFS_ROUND_UP(remain_blks, NFS_BLK_SZ()) / NFS_BLK_SZ();   
-      // 存放数据的块数              
-      remain_blks -= map_data_blks; 
+      // 日志区，小磁盘上不超过总块数的1/16
+      journal_blks = NFS_BLK_NUM() / 16 < NFS_JOURNAL_BLKS ? NFS_BLK_NUM() / 16 
+                                                           : NFS_JOURNAL_BLKS;
+      // 块组的数据位图占一块，小磁盘上至少划分NFS_GROUP_MIN_CNT个块组
+      group_blks = NFS_BLK_NUM() / NFS_GROUP_MIN_CNT;
+      group_blks = group_blks < NFS_BLK_SZ() * UINT8_BITS ? group_blks 
+                                                          : NFS_BLK_SZ() * UINT8_BITS;
+      // 假设每个文件大小为6k, 估计每个块组的inode数，inode表按整块分配
+      ino_per_blk   = NFS_BLK_SZ() / NFS_INODE_SZ;
+      ino_per_group = group_blks / (NFS_BLK_PER_FILE + NFS_INO_PER_FILE);
+      ino_per_group = NFS_ROUND_UP(ino_per_group, ino_per_blk);
+      itable_blks   = ino_per_group / ino_per_blk;
+      // 位图摘要所占块数，块组数不超过总块数/块组大小+1
+      group_cnt = NFS_BLK_NUM() / group_blks + 1;
+      sum_blks  = 2 * nfs_bmap_sum_blks(group_cnt);
+      // 其余的块划分为块组，剩余部分放得下位图和inode表时作为最后一个不满的块组
+      remain_blks = NFS_BLK_NUM() - super_blks - sum_blks - journal_blks;
+      group_cnt   = remain_blks / group_blks;
+      last_data   = group_blks - NFS_GROUP_BMAP_BLKS - itable_blks;
+      if (remain_blks % group_blks > NFS_GROUP_BMAP_BLKS + itable_blks) {
+         last_data = remain_blks % group_blks - NFS_GROUP_BMAP_BLKS - itable_blks;
+         group_cnt++;
+      }
       // 布局
-      super.max_ino                = inode_num;
-      nfs_super_d.max_ino          = inode_num;
-      super.max_data               = remain_blks;
-      nfs_super_d.max_data         = remain_blks;
-      nfs_super_d.map_inode_offset = NFS_SUPER_OFS + super_blks * NFS_BLK_SZ();
-      nfs_super_d.map_data_offset  = nfs_super_d.map_inode_offset 
-                                     + map_inode_blks * NFS_BLK_SZ();
-      nfs_super_d.inode_offset     = nfs_super_d.map_data_offset
-                                     + map_data_blks * NFS_BLK_SZ();
-      nfs_super_d.data_offset      = nfs_super_d.inode_offset
-                                     + inode_num * NFS_BLK_SZ();
-      nfs_super_d.map_inode_blks   = map_inode_blks;
-      nfs_super_d.map_data_blks    = map_data_blks;
+      nfs_super_d.group_cnt        = group_cnt;
+      nfs_super_d.group_blks       = group_blks;
+      nfs_super_d.ino_per_group    = ino_per_group;
+      nfs_super_d.data_per_group   = group_blks - NFS_GROUP_BMAP_BLKS - itable_blks;
+      nfs_super_d.itable_blks      = itable_blks;
+      nfs_super_d.max_ino          = group_cnt * ino_per_group;
+      nfs_super_d.max_data         = (group_cnt - 1) * nfs_super_d.data_per_group + last_data;
+      nfs_super_d.sum_inode_offset = NFS_SUPER_OFS + super_blks * NFS_BLK_SZ();
+      nfs_super_d.sum_data_offset  = nfs_super_d.sum_inode_offset
+                                     + sum_blks / 2 * NFS_BLK_SZ();
+      nfs_super_d.journal_offset   = nfs_super_d.sum_data_offset
+                                     + sum_blks / 2 * NFS_BLK_SZ();
+      nfs_super_d.journal_blks     = journal_blks;
+      nfs_super_d.group_offset     = nfs_super_d.journal_offset 
+                                     + journal_blks * NFS_BLK_SZ();
       nfs_super_d.size_usage         = 0;
+      nfs_super_d.version            = NFS_FORMAT_VERSION;
 
       is_init = 1;
    }
+   // 旧格式的inode和目录项都是定长的，布局不兼容，需要重新格式化
+   if (nfs_super_d.version != NFS_FORMAT_VERSION) {
+      NFS_DBG("[%s] unsupported format version %u\n", __func__, nfs_super_d.version);
+      return -NFS_ERROR_UNSUPPORTED;
+   }
    // 内存结构
    super.size_usage       = nfs_super_d.size_usage;
-   super.map_inode        = (uint8_t*)malloc(NFS_BLK_SZ() * nfs_super_d.map_inode_blks);
-   super.map_data         = (uint8_t*)malloc(NFS_BLK_SZ() * nfs_super_d.map_data_blks);
-   super.max_dentry       = NFS_BLK_SZ() / sizeof(struct nfs_dentry_d);
-   super.map_inode_blks   = nfs_super_d.map_inode_blks;
-   super.map_data_blks    = nfs_super_d.map_data_blks;
-   super.map_inode_offset = nfs_super_d.map_inode_offset;
-   super.map_data_offset  = nfs_super_d.map_data_offset;
-   super.inode_offset     = nfs_super_d.inode_offset;
-   super.data_offset      = nfs_super_d.data_offset;
-
-   // 读取inode位图
-   if (nfs_driver_read(nfs_super_d.map_inode_offset, (uint8_t*)(super.map_inode),
-                       super.map_inode_blks * NFS_BLK_SZ()) != NFS_ERROR_NONE) {
-      NFS_DBG("[%s] io error\n", __func__);
+   super.max_ino          = nfs_super_d.max_ino;
+   super.max_data         = nfs_super_d.max_data;
+   // 位图内存按需读入，未用到的部分不会真正占用物理内存
+   super.map_inode        = (uint8_t*)malloc(NFS_BLK_SZ() * nfs_super_d.group_cnt);
+   super.map_data         = (uint8_t*)malloc(NFS_BLK_SZ() * nfs_super_d.group_cnt);
+   super.group_offset     = nfs_super_d.group_offset;
+   super.group_cnt        = nfs_super_d.group_cnt;
+   super.group_blks       = nfs_super_d.group_blks;
+   super.ino_per_group    = nfs_super_d.ino_per_group;
+   super.data_per_group   = nfs_super_d.data_per_group;
+   super.itable_blks      = nfs_super_d.itable_blks;
+   super.sum_inode_offset = nfs_super_d.sum_inode_offset;
+   super.sum_data_offset  = nfs_super_d.sum_data_offset;
+   super.journal_offset   = nfs_super_d.journal_offset;
+   super.journal_blks     = nfs_super_d.journal_blks;
+   super.version          = nfs_super_d.version;
+   super.ino_per_blk      = NFS_BLK_SZ() / NFS_INODE_SZ;
+
+   // 格式化时写入超级块和空日志，否则重放日志中已提交的事务
+   if (is_init && nfs_write_super() != NFS_ERROR_NONE) {
       return -NFS_ERROR_IO;
    }
-   // 读取data位图
-   if (nfs_driver_read(nfs_super_d.map_data_offset, (uint8_t*)(super.map_data),
-                       super.map_data_blks * NFS_BLK_SZ()) != NFS_ERROR_NONE) {
-      NFS_DBG("[%s] io error\n", __func__);
+   if (nfs_journal_init(is_init) != NFS_ERROR_NONE) {
+      NFS_DBG("[%s] journal error\n", __func__);
+      return -NFS_ERROR_IO;
+   }
+
+   // 位图分配器，每个块组一区。格式化时所有区都是空闲的，只写回摘要
+   if (nfs_bmap_init(&super.bmap_inode, super.map_inode, super.max_ino, super.ino_per_group,
+                     NFS_GROUP_OFS(0), super.group_blks * NFS_BLK_SZ(),
+                     super.sum_inode_offset, is_init) != NFS_ERROR_NONE
+       || nfs_bmap_init(&super.bmap_data, super.map_data, super.max_data, super.data_per_group,
+                        NFS_GROUP_OFS(0) + NFS_BLK_SZ(), super.group_blks * NFS_BLK_SZ(),
+                        super.sum_data_offset, is_init) != NFS_ERROR_NONE) {
+      NFS_DBG("[%s] bitmap init error\n", __func__);
       return -NFS_ERROR_IO;
    }
    // 分配根节点并与磁盘同步
    if(is_init) {
       root_inode = nfs_alloc_inode(root_dentry);
 
-      nfs_sync_inode(root_inode);
+      nfs_sync_all();
    }
    // 从磁盘读取根inode
    root_inode         = nfs_read_inode(root_dentry, NFS_ROOT_INO);
+   if (root_inode == NULL) {
+      NFS_DBG("[%s] root inode error\n", __func__);
+      return -NFS_ERROR_IO;
+   }
    root_dentry->inode = root_inode;
+   // 根inode不会被回收，挂入链表以便卸载时一并释放
+   nfs_icache_add(root_inode);
    super.root_dentry  = root_dentry;
    super.is_mounted   = 1;
 
+   // 后台写回线程
+   if (nfs_flush_start(nfs_options.dirty_kb, nfs_options.flush_age) != NFS_ERROR_NONE) {
+      NFS_DBG("[%s] flusher start error\n", __func__);
+      return -NFS_ERROR_NOSPACE;
+   }
+
    return ret;
 }
 
@@ -131,53 +237,53 @@ int naivefs_mount(struct custom_options nfs_options) {
  * @return int 
  */
 int naivefs_umount() {
-   struct nfs_super_d nfs_super_d;
-
    if (!super.is_mounted) {
       return NFS_ERROR_NONE;
    }
 
-   nfs_sync_inode(super.root_dentry->inode);
-
-   nfs_super_d.magic_num         = NAIVEFS_MAGIC;
-   nfs_super_d.map_inode_blks    = super.map_inode_blks;
-   nfs_super_d.map_data_blks     = super.map_data_blks;
-   nfs_super_d.map_inode_offset  = super.map_inode_offset;
-   nfs_super_d.map_data_offset   = super.map_data_offset;
-   nfs_super_d.inode_offset      = super.inode_offset;
-   nfs_super_d.data_offset       = super.data_offset; 
-   nfs_super_d.size_usage        = super.size_usage;
-
-   // 写回超级块
-   if (nfs_driver_write(NFS_SUPER_OFS, (uint8_t *)&nfs_super_d, 
-                     sizeof(struct nfs_super_d)) != NFS_ERROR_NONE) {
+   nfs_flush_stop();
+   nfs_dcache_destroy();
+   // 已没有查找在进行，释放延迟释放的目录项和路径缓存表项
+   nfs_rcu_destroy();
+   // 只写回有改动的inode、目录块、数据页和位图块
+   if (nfs_sync_all() != NFS_ERROR_NONE) {
       NFS_DBG("[%s] io error\n", __func__);
       return -NFS_ERROR_IO;
    }
+   nfs_page_destroy();
+   // 日志中的块写回原位置
+   if (nfs_journal_checkpoint() != NFS_ERROR_NONE) {
+      return -NFS_ERROR_IO;
+   }
+   nfs_journal_destroy();
 
-   // 写回inode位图
-   if (nfs_driver_write(nfs_super_d.map_inode_offset, (uint8_t *)(super.map_inode), 
-                        nfs_super_d.map_inode_blks * NFS_BLK_SZ()) != NFS_ERROR_NONE) {
-      NFS_DBG("[%s] io error\n", __func__);
+   // 写回超级块
+   if (nfs_write_super() != NFS_ERROR_NONE) {
       return -NFS_ERROR_IO;
    }
 
-   // 写回数据位图
-   if (nfs_driver_write(nfs_super_d.map_data_offset, (uint8_t *)(super.map_data), 
-                        nfs_super_d.map_data_blks * NFS_BLK_SZ()) != NFS_ERROR_NONE) {
+   // 写回块缓存中的脏块
+   if (nfs_cache_destroy() != NFS_ERROR_NONE) {
       NFS_DBG("[%s] io error\n", __func__);
       return -NFS_ERROR_IO;
    }
 
+   nfs_bmap_destroy(&super.bmap_inode);
+   nfs_bmap_destroy(&super.bmap_data);
+   // 先释放已加载inode的区间、目录索引、名字区和内联数据，目录项和inode
+   // 本身随对象缓存一并释放
+   nfs_icache_destroy();
+   nfs_slab_destroy(&super.dentry_slab);
+   nfs_slab_destroy(&super.inode_slab);
    free(super.map_inode);
    free(super.map_data);
-   ddriver_close(NFS_DRIVER());
+   NFS_BACKEND()->close(NFS_DRIVER());
 
    return NFS_ERROR_NONE;
 }
 
 /**
- * @brief 
+ * @brief 逐级解析路径
  * path: /qwe/ad  total_lvl = 2,
  *      1) find /'s inode       lvl = 1
  *      2) find qwe's dentry 
@@ -188,19 +294,22 @@ int naivefs_umount() {
  *      1) find /'s inode       lvl = 1
  *      2) find qwe's dentry
  * 
+ * 解析结果在持有停下处目录的读锁时记入路径缓存
+ * 
  * @param path 
  * @return struct nfs_inode* 
  */
-struct nfs_dentry* nfs_lookup(const char * path, int* is_find, int* is_root) {
+static struct nfs_dentry* nfs_lookup_walk(const char * path, int* is_find, int* is_root) {
    struct nfs_dentry* dentry_cur = super.root_dentry;
    struct nfs_dentry* dentry_ret = NULL;
    struct nfs_inode*  inode;
    // 计算路径的层级
    int total_lvl = nfs_calc_lvl(path); 
    int lvl = 0;
-   int is_hit;
+   int miss_ofs = 0;
    char* name = NULL;
-   char* path_cpy = (char*)malloc(sizeof(path));
+   char* save = NULL;
+   char* path_cpy = (char*)malloc(strlen(path) + 1);
    *is_root = 0;
    // 复制路径
    strcpy(path_cpy, path); 
@@ -209,54 +318,133 @@ struct nfs_dentry* nfs_lookup(const char * path, int* is_find, int* is_root) {
       *is_find = 1;
       *is_root = 1;
       dentry_ret = super.root_dentry;
+      nfs_dcache_put(path, dentry_ret, *is_find, *is_root, 0);
    }
-   // 获取每个“/”间隔间的名字
-   name = strtok(path_cpy, "/");
+   // 获取每个“/”间隔间的名字，多个请求同时解析，不能用strtok
+   name = strtok_r(path_cpy, "/", &save);
    while (name) {
       lvl++;
-      //
-      if (dentry_cur->inode == NULL) { // Cache机制
-         dentry_cur->inode = nfs_read_inode(dentry_cur, dentry_cur->ino);
+      // Cache机制，并发的首次访问只读一次盘
+      inode = nfs_inode_get(dentry_cur);
+      if (inode == NULL) {
+         NFS_DBG("[%s] io error\n", __func__);
+         *is_find   = 0;
+         dentry_ret = NULL;
+         break;
       }
 
-      inode = dentry_cur->inode;
-
-      if (!NFS_IS_DIR(inode) && lvl < total_lvl) {
+      if (!NFS_IS_DIR(inode)) {
          NFS_DBG("[%s] not a dir\n", __func__);
+         *is_find = 0;
          dentry_ret = inode->dentry;
+         nfs_dcache_put(path, dentry_ret, *is_find, *is_root, name - path_cpy);
          break;
       }
-      if (NFS_IS_DIR(inode)) {
-         dentry_cur = inode->dentrys;
-         is_hit     = 0;
-
-         while (dentry_cur) {
-            // 遍历目录项，找到了就跳出
-            if (memcmp(dentry_cur->name, name, strlen(name)) == 0) {
-               is_hit = 1;
-               break;
-            }
-            dentry_cur = dentry_cur->brother;
-         }
-
-         if (!is_hit) {
-            *is_find = 0;
+      // 经由目录哈希索引精确匹配。持有目录读锁直到记下结果，
+      // 与在该目录下创建的请求互斥，不会缓存过时的负结果
+      nfs_inode_rdlock(inode);
+      dentry_cur = nfs_dir_lookup(inode, name, strlen(name));
+      if (dentry_cur == NULL || lvl == total_lvl) {
+         *is_find = dentry_cur != NULL;
+         if (*is_find) {
+            dentry_ret = dentry_cur;
+         } else {
             NFS_DBG("[%s] not found %s\n", __func__, name);
             dentry_ret = inode->dentry;
-            break;
-         }
-         // 找到了，且路径层级吻合
-         if (is_hit && lvl == total_lvl) {
-            *is_find = 1;
-            dentry_ret = dentry_cur;
-            break;
+            miss_ofs   = name - path_cpy;
          }
+         nfs_dcache_put(path, dentry_ret, *is_find, *is_root, miss_ofs);
+         nfs_inode_unlock(inode);
+         break;
       }
-      name = strtok(NULL, "/");
+      nfs_inode_unlock(inode);
+      name = strtok_r(NULL, "/", &save);
+   }
+   free(path_cpy);
+   return dentry_ret;
+}
+
+/**
+ * @brief 不取任何锁的路径查找，须在读侧临界区内调用
+ * 
+ * 先查路径缓存，未命中时经由各级目录的哈希索引逐级解析。只处理常见情况：
+ * 路径上有未加载的inode、中间分量不是目录或者没有找到时返回NULL，由调用者
+ * 退回持锁的查找。结果不记入路径缓存，避免与并发的删除交错留下过时表项
+ * 
+ * @param path 
+ * @param is_find 
+ * @param is_root 
+ * @return struct nfs_dentry* 返回的目录项的inode已加载
+ */
+struct nfs_dentry* nfs_lookup_rcu(const char * path, int* is_find, int* is_root) {
+   struct nfs_dentry* dentry_cur;
+   struct nfs_inode*  inode;
+   const char*        name = path;
+   const char*        end;
+
+   dentry_cur = nfs_dcache_get(path, is_find, is_root);
+   if (dentry_cur) {
+      return nfs_inode_peek(dentry_cur) ? dentry_cur : NULL;
    }
-   // 读inode
-   if (dentry_ret->inode == NULL) {
-       dentry_ret->inode = nfs_read_inode(dentry_ret, dentry_ret->ino);
+   *is_root   = 0;
+   dentry_cur = super.root_dentry;
+   if (nfs_calc_lvl(path) == 0) {
+      *is_find = 1;
+      *is_root = 1;
+      return dentry_cur;
+   }
+   for (;;) {
+      while (*name == '/') {
+         name++;
+      }
+      if (*name == '\0') {
+         break;
+      }
+      end = strchr(name, '/');
+      if (end == NULL) {
+         end = name + strlen(name);
+      }
+      inode = nfs_inode_peek(dentry_cur);
+      if (inode == NULL || dentry_cur->ftype != NFS_DIR) {
+         return NULL;
+      }
+      dentry_cur = nfs_dir_lookup(inode, name, end - name);
+      if (dentry_cur == NULL) {
+         return NULL;
+      }
+      name = end;
+   }
+   if (nfs_inode_peek(dentry_cur) == NULL) {
+      return NULL;
+   }
+   *is_find = 1;
+   return dentry_cur;
+}
+
+/**
+ * @brief 查找路径，先在读侧临界区内无锁地查找，不成功时逐级持锁解析并记录结果
+ * 
+ * @param path 
+ * @param is_find 是否找到
+ * @param is_root 是否为根目录
+ * @return struct nfs_dentry* 找到时为该目录项，否则为解析停下处的目录项，
+ *         其inode均已加载。路径上有inode读盘失败时返回NULL
+ */
+struct nfs_dentry* nfs_lookup(const char * path, int* is_find, int* is_root) {
+   struct nfs_dentry* dentry_ret = NULL;
+
+   // 调用者持有命名空间锁，返回的目录项在临界区外仍不会被释放
+   if (nfs_rcu_read_lock() == NFS_ERROR_NONE) {
+      dentry_ret = nfs_lookup_rcu(path, is_find, is_root);
+      nfs_rcu_read_unlock();
+   }
+   if (dentry_ret == NULL) {
+      dentry_ret = nfs_lookup_walk(path, is_find, is_root);
+      // 读inode
+      if (dentry_ret && nfs_inode_get(dentry_ret) == NULL) {
+         NFS_DBG("[%s] io error\n", __func__);
+         dentry_ret = NULL;
+      }
    }
 
    return dentry_ret;
@@ -0,0 +1,195 @@
+#include "../include/naivefs.h"
+
+/******************************************************************************
+* SECTION: inode缓存回收
+*
+* 已加载的inode按加载先后挂在一条链表上，访问时只置访问位，淘汰时按CLOCK
+* 给访问过的inode第二次机会，近似LRU。目录项、inode和目录名字区占用的内存
+* 超过上限时，在独占命名空间锁的情况下从链表尾部回收：
+*   1) 只回收干净的inode：不在脏inode链表中，也没有待写回的inode记录
+*   2) 打开着的目录、根目录以及还有子目录项的inode已加载的目录不回收，
+*      因此已加载的inode的父目录总是已加载的
+* 回收后目录项仍在父目录中，dentry->inode为NULL，下次访问时重新读入
+*******************************************************************************/
+static struct nfs_icache nfs_icache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/**
+ * @brief 初始化inode缓存回收
+ *
+ * @param limit_kb 内存上限(KB)，0表示不回收
+ */
+void nfs_icache_init(int limit_kb) {
+    nfs_icache.limit    = (long)(limit_kb > 0 ? limit_kb : 0) * 1024;
+    nfs_icache.lru_head = NULL;
+    nfs_icache.lru_tail = NULL;
+    nfs_icache.cnt      = 0;
+    nfs_icache.evicted  = 0;
+}
+
+/**
+ * @brief 估算目录项、inode和目录名字区占用的内存
+ *
+ * @return long 字节数
+ */
+static long nfs_icache_usage() {
+    return nfs_slab_usage(&super.dentry_slab) + nfs_slab_usage(&super.inode_slab)
+           + nfs_name_usage();
+}
+
+/**
+ * @brief 把inode放回链表头，调用者持有nfs_icache.lock
+ *
+ * @param inode
+ */
+static void nfs_icache_push(struct nfs_inode* inode) {
+    inode->lru_prev = NULL;
+    inode->lru_next = nfs_icache.lru_head;
+    if (nfs_icache.lru_head) {
+        nfs_icache.lru_head->lru_prev = inode;
+    } else {
+        nfs_icache.lru_tail = inode;
+    }
+    nfs_icache.lru_head = inode;
+    inode->on_lru = 1;
+    nfs_icache.cnt++;
+}
+
+/**
+ * @brief 新加载或新建的inode挂入链表头
+ *
+ * @param inode
+ */
+void nfs_icache_add(struct nfs_inode* inode) {
+    pthread_mutex_lock(&nfs_icache.lock);
+    nfs_icache_push(inode);
+    pthread_mutex_unlock(&nfs_icache.lock);
+}
+
+/**
+ * @brief 摘出链表，调用者持有nfs_icache.lock
+ *
+ * @param inode
+ */
+static void nfs_icache_unlink(struct nfs_inode* inode) {
+    if (inode->lru_prev) {
+        inode->lru_prev->lru_next = inode->lru_next;
+    } else {
+        nfs_icache.lru_head = inode->lru_next;
+    }
+    if (inode->lru_next) {
+        inode->lru_next->lru_prev = inode->lru_prev;
+    } else {
+        nfs_icache.lru_tail = inode->lru_prev;
+    }
+    inode->lru_prev = NULL;
+    inode->lru_next = NULL;
+    inode->on_lru   = 0;
+    nfs_icache.cnt--;
+}
+
+/**
+ * @brief inode被删除前调用，摘出链表
+ *
+ * @param inode
+ */
+void nfs_icache_del(struct nfs_inode* inode) {
+    pthread_mutex_lock(&nfs_icache.lock);
+    if (inode->on_lru) {
+        nfs_icache_unlink(inode);
+    }
+    pthread_mutex_unlock(&nfs_icache.lock);
+}
+
+/**
+ * @brief inode当前能否回收
+ *
+ * @param inode
+ * @return int
+ */
+static int nfs_icache_evictable(struct nfs_inode* inode) {
+    struct nfs_dentry* child;
+    if (inode->dentry == super.root_dentry || inode->dirty || inode->on_dirty
+        || __atomic_load_n(&inode->pin, __ATOMIC_ACQUIRE) > 0) {
+        return 0;
+    }
+    if (NFS_IS_DIR(inode)) {
+        for (child = inode->dentrys; child; child = child->brother) {
+            if (child->inode) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief 回收inode直到占用的内存降到上限的7/8以下，或者没有可回收的inode。
+ *        调用者独占命名空间锁，期间不会有inode被加载或删除
+ *
+ * @return int 回收的inode数
+ */
+int nfs_icache_shrink() {
+    struct nfs_inode* inode;
+    long target = nfs_icache.limit - nfs_icache.limit / 8;
+    long usage  = nfs_icache_usage();
+    int  scan, evicted = 0;
+
+    if (nfs_icache.limit == 0) {
+        return 0;
+    }
+    // 每个inode最多看两遍：第一遍清访问位，第二遍仍不能回收的说明都在使用中。
+    // 被回收的对象要等到无锁的查找结束才归还，按回收时估计的释放量计算
+    scan = nfs_icache.cnt * 2;
+    while (scan-- > 0 && usage > target) {
+        pthread_mutex_lock(&nfs_icache.lock);
+        inode = nfs_icache.lru_tail;
+        if (inode == NULL) {
+            pthread_mutex_unlock(&nfs_icache.lock);
+            break;
+        }
+        nfs_icache_unlink(inode);
+        if (__atomic_exchange_n(&inode->lru_ref, 0, __ATOMIC_RELAXED)
+            || !nfs_icache_evictable(inode)) {
+            nfs_icache_push(inode);
+            pthread_mutex_unlock(&nfs_icache.lock);
+            continue;
+        }
+        nfs_icache.evicted++;
+        pthread_mutex_unlock(&nfs_icache.lock);
+        usage -= nfs_evict_inode(inode);
+        evicted++;
+    }
+    // 被回收的inode在无锁的查找结束后才真正释放
+    if (evicted > 0) {
+        nfs_rcu_reclaim();
+    }
+    return evicted;
+}
+
+/**
+ * @brief 加锁的请求结束后调用，占用的内存超过上限时独占命名空间锁回收。
+ *        调用者不能持有命名空间锁
+ */
+void nfs_icache_balance() {
+    if (nfs_icache.limit == 0 || nfs_icache_usage() <= nfs_icache.limit) {
+        return;
+    }
+    nfs_ns_lock(NFS_LOCK_EXCL);
+    nfs_icache_shrink();
+    nfs_ns_unlock();
+}
+
+/**
+ * @brief 卸载时输出统计，并释放链表上所有已加载的inode
+ */
+void nfs_icache_destroy() {
+    struct nfs_inode* inode;
+    NFS_DBG("[%s] %d loaded, %d evicted, %ld bytes\n", __func__, nfs_icache.cnt,
+            nfs_icache.evicted, nfs_icache_usage());
+    while ((inode = nfs_icache.lru_head) != NULL) {
+        nfs_icache_unlink(inode);
+        nfs_inode_release(inode);
+    }
+}
@@ -0,0 +1,487 @@
+#include "../include/naivefs.h"
+
+/******************************************************************************
+* SECTION: 元数据日志
+*
+* 元数据(inode、目录块、区间树块、位图块)不直接写回原位置，而是以事务为单位
+* 顺序追加到日志区，事务由若干描述块组成，每个描述块后跟随它记录的块，最后
+* 一个描述块带提交标记，校验和覆盖块号表和块内容。提交后的块留在内存中，
+* 日志区将满或卸载时再统一写回原位置(检查点)，之后日志从头开始复用。
+* 挂载时重放头块记录位置之后所有完整的事务。
+*
+* 数据块先于引用它的元数据写出(有序模式)。已提交、尚未检查点的块被释放后
+* 如果作为文件数据重新写入，先做检查点，以免重放时旧内容覆盖新数据。
+*
+* 日志锁保护日志状态。驱动层读盘时先取日志锁，读出和覆盖之间不会插入
+* 检查点，否则可能既读到原位置的旧内容，又找不到已被清空的日志块
+*******************************************************************************/
+static struct nfs_journal nfs_journal;
+static pthread_mutex_t    nfs_journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief 获取日志锁
+ */
+void nfs_journal_lock() {
+    pthread_mutex_lock(&nfs_journal_mutex);
+}
+
+/**
+ * @brief 释放日志锁
+ */
+void nfs_journal_unlock() {
+    pthread_mutex_unlock(&nfs_journal_mutex);
+}
+
+/**
+ * @brief FNV-1a校验和
+ *
+ * @param h 初值
+ * @param buf
+ * @param len
+ * @return uint32_t
+ */
+static uint32_t nfs_journal_csum(uint32_t h, const uint8_t* buf, int len) {
+    int i;
+    for (i = 0; i < len; i++) {
+        h ^= buf[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * @brief 查找待检查点的块
+ *
+ * @param offset 块的原位置
+ * @return struct nfs_jblock*
+ */
+static struct nfs_jblock* nfs_journal_find(int offset) {
+    struct nfs_jblock* jb;
+    if (nfs_journal.hash == NULL) {
+        return NULL;
+    }
+    jb = nfs_journal.hash[(offset / NFS_BLK_SZ()) & (NFS_JOURNAL_HASH_SZ - 1)];
+    while (jb && jb->offset != offset) {
+        jb = jb->next;
+    }
+    return jb;
+}
+
+/**
+ * @brief 丢弃全部待检查点的块
+ */
+static void nfs_journal_unpin_all() {
+    struct nfs_jblock* jb;
+    struct nfs_jblock* next;
+    int i;
+    for (i = 0; i < NFS_JOURNAL_HASH_SZ; i++) {
+        for (jb = nfs_journal.hash[i]; jb; jb = next) {
+            next = jb->next;
+            free(jb->data);
+            free(jb);
+        }
+        nfs_journal.hash[i] = NULL;
+    }
+    nfs_journal.cnt = 0;
+}
+
+/**
+ * @brief 直接写日志头块，不经过块缓存
+ *
+ * @return int
+ */
+static int nfs_journal_write_head() {
+    struct nfs_journal_d* head_d;
+    int ret;
+    head_d = (struct nfs_journal_d*)calloc(1, NFS_BLK_SZ());
+    if (head_d == NULL) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    head_d->magic = NFS_JOURNAL_MAGIC;
+    head_d->seq   = nfs_journal.seq;
+    head_d->head  = nfs_journal.head;
+    ret = nfs_driver_write_raw(NFS_JNL_OFS(0), (uint8_t*)head_d, NFS_BLK_SZ());
+    free(head_d);
+    return ret;
+}
+
+/**
+ * @brief 重放日志中完整的事务，不完整或校验失败的事务及其后的内容被丢弃
+ *
+ * @param head_d 日志头
+ * @return int 重放的事务数，失败返回负数
+ */
+static int nfs_journal_replay(struct nfs_journal_d* head_d) {
+    struct nfs_iolist    tx;
+    struct nfs_jdesc_d*  desc;
+    uint8_t*             blks;
+    uint32_t             csum;
+    int pos = head_d->head, seq = head_d->seq, replayed = 0, done = 0, complete, i;
+    int ret = NFS_ERROR_NONE;
+
+    desc = (struct nfs_jdesc_d*)malloc(NFS_BLK_SZ());
+    if (desc == NULL) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    while (!done && ret == NFS_ERROR_NONE) {
+        memset(&tx, 0, sizeof(struct nfs_iolist));
+        complete = 0;
+        // 读出一个事务的全部描述块和块内容，校验通过才写回原位置
+        while (pos < super.journal_blks) {
+            if (nfs_driver_read_raw(NFS_JNL_OFS(pos), (uint8_t*)desc, NFS_BLK_SZ())
+                != NFS_ERROR_NONE) {
+                ret = -NFS_ERROR_IO;
+                break;
+            }
+            if (desc->magic != NFS_JDESC_MAGIC || desc->seq != (uint32_t)seq
+                || desc->cnt <= 0 || desc->cnt > NFS_JDESC_PER_BLK()
+                || pos + 1 + desc->cnt > super.journal_blks) {
+                break;
+            }
+            csum = nfs_journal_csum(2166136261u, (uint8_t*)desc->offsets,
+                                    desc->cnt * sizeof(int));
+            for (i = 0; i < desc->cnt; i++) {
+                blks = nfs_iolist_alloc(&tx, desc->offsets[i], NFS_BLK_SZ());
+                if (blks == NULL
+                    || nfs_driver_read_raw(NFS_JNL_OFS(pos + 1 + i), blks, NFS_BLK_SZ())
+                       != NFS_ERROR_NONE) {
+                    ret = -NFS_ERROR_IO;
+                    break;
+                }
+                csum = nfs_journal_csum(csum, blks, NFS_BLK_SZ());
+            }
+            if (ret != NFS_ERROR_NONE || csum != desc->csum) {
+                break;
+            }
+            pos += 1 + desc->cnt;
+            if (desc->last) {
+                complete = 1;
+                break;
+            }
+        }
+        if (complete) {
+            ret = nfs_driver_writev(tx.iov, tx.cnt);
+            seq++;
+            replayed++;
+        } else {
+            done = 1;
+        }
+        nfs_iolist_free(&tx);
+    }
+    free(desc);
+    nfs_journal.seq = seq;
+    if (ret == NFS_ERROR_NONE) {
+        ret = nfs_cache_flush();
+    }
+    return ret == NFS_ERROR_NONE ? replayed : ret;
+}
+
+/**
+ * @brief 初始化日志，格式化时写入空日志头，否则重放日志。挂载时单线程调用
+ *
+ * @param is_init 是否刚格式化
+ * @return int
+ */
+int nfs_journal_init(int is_init) {
+    struct nfs_journal_d* head_d;
+    int ret = NFS_ERROR_NONE;
+
+    memset(&nfs_journal, 0, sizeof(struct nfs_journal));
+    if (super.journal_blks <= 0) {
+        return NFS_ERROR_NONE;
+    }
+    nfs_journal.hash = (struct nfs_jblock**)calloc(NFS_JOURNAL_HASH_SZ,
+                                                   sizeof(struct nfs_jblock*));
+    head_d = (struct nfs_journal_d*)malloc(NFS_BLK_SZ());
+    if (nfs_journal.hash == NULL || head_d == NULL) {
+        free(head_d);
+        return -NFS_ERROR_NOSPACE;
+    }
+    nfs_journal.seq = 1;
+    if (!is_init) {
+        if (nfs_driver_read_raw(NFS_JNL_OFS(0), (uint8_t*)head_d, NFS_BLK_SZ())
+            != NFS_ERROR_NONE) {
+            free(head_d);
+            return -NFS_ERROR_IO;
+        }
+        if (head_d->magic == NFS_JOURNAL_MAGIC && head_d->head > 0
+            && head_d->head < super.journal_blks) {
+            ret = nfs_journal_replay(head_d);
+            if (ret > 0) {
+                NFS_DBG("[%s] replayed %d transactions\n", __func__, ret);
+            }
+        }
+    }
+    free(head_d);
+    if (ret < 0) {
+        return ret;
+    }
+    nfs_journal.head = 1;
+    return nfs_journal_write_head();
+}
+
+/**
+ * @brief 将所有已提交的块写回原位置，然后清空日志。调用者持有日志锁
+ *
+ * @return int
+ */
+static int nfs_journal_do_checkpoint() {
+    struct nfs_iolist  list;
+    struct nfs_jblock* jb;
+    int i, ret = NFS_ERROR_NONE;
+
+    if (super.journal_blks <= 0 || nfs_journal.head <= 1) {
+        return NFS_ERROR_NONE;
+    }
+    memset(&list, 0, sizeof(struct nfs_iolist));
+    for (i = 0; i < NFS_JOURNAL_HASH_SZ && ret == NFS_ERROR_NONE; i++) {
+        for (jb = nfs_journal.hash[i]; jb; jb = jb->next) {
+            ret = nfs_iolist_add(&list, jb->offset, jb->data, NFS_BLK_SZ());
+            if (ret != NFS_ERROR_NONE) {
+                break;
+            }
+        }
+    }
+    // 原位置写稳之后才能推进日志头，否则崩溃时会丢失这些事务
+    if (ret == NFS_ERROR_NONE && list.cnt > 0) {
+        ret = nfs_driver_writev(list.iov, list.cnt);
+    }
+    if (ret == NFS_ERROR_NONE) {
+        ret = nfs_cache_flush();
+    }
+    nfs_iolist_free(&list);
+    if (ret != NFS_ERROR_NONE) {
+        NFS_DBG("[%s] io error\n", __func__);
+        return -NFS_ERROR_IO;
+    }
+    nfs_journal_unpin_all();
+    nfs_journal.head = 1;
+    nfs_journal.checkpoints++;
+    return nfs_journal_write_head();
+}
+
+/**
+ * @brief 将所有已提交的块写回原位置，然后清空日志
+ *
+ * @return int
+ */
+int nfs_journal_checkpoint() {
+    int ret;
+    nfs_journal_lock();
+    ret = nfs_journal_do_checkpoint();
+    nfs_journal_unlock();
+    return ret;
+}
+
+/**
+ * @brief 记下已提交的块内容，供检查点写回和读时覆盖
+ *
+ * @param offset
+ * @param buf
+ * @return int
+ */
+static int nfs_journal_pin(int offset, const uint8_t* buf) {
+    struct nfs_jblock* jb = nfs_journal_find(offset);
+    int bucket;
+    if (jb == NULL) {
+        jb = (struct nfs_jblock*)calloc(1, sizeof(struct nfs_jblock));
+        if (jb == NULL) {
+            return -NFS_ERROR_NOSPACE;
+        }
+        jb->data = (uint8_t*)malloc(NFS_BLK_SZ());
+        if (jb->data == NULL) {
+            free(jb);
+            return -NFS_ERROR_NOSPACE;
+        }
+        jb->offset = offset;
+        bucket     = (offset / NFS_BLK_SZ()) & (NFS_JOURNAL_HASH_SZ - 1);
+        jb->next   = nfs_journal.hash[bucket];
+        nfs_journal.hash[bucket] = jb;
+        nfs_journal.cnt++;
+    }
+    memcpy(jb->data, buf, NFS_BLK_SZ());
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 以一个事务提交一组元数据块，调用者持有日志锁
+ *
+ * @param iov
+ * @param cnt
+ * @return int
+ */
+static int nfs_journal_do_commit(struct nfs_iovec* iov, int cnt) {
+    struct nfs_iolist   xfer;
+    struct nfs_jdesc_d* desc;
+    int per  = NFS_JDESC_PER_BLK();
+    int need = cnt + (cnt + per - 1) / per;
+    int pos, i, k, n, ret = NFS_ERROR_NONE;
+
+    if (cnt == 0) {
+        return NFS_ERROR_NONE;
+    }
+    if (super.journal_blks <= 0) {
+        return nfs_driver_writev(iov, cnt);
+    }
+    // 请求结束后nfs_sync_balance把待提交的元数据限制在日志区的四分之一以内，
+    // 正常不会走到这里。仍放不下时只能先清空日志再直接写回原位置，这次写回
+    // 不具备崩溃原子性，中途崩溃可能留下部分更新的元数据
+    if (need > super.journal_blks - 1) {
+        NFS_DBG("[%s] %d blocks exceed the journal, written in place\n", __func__, cnt);
+        if (nfs_journal_do_checkpoint() != NFS_ERROR_NONE) {
+            return -NFS_ERROR_IO;
+        }
+        return nfs_driver_writev(iov, cnt);
+    }
+    if (nfs_journal.head + need > super.journal_blks
+        && nfs_journal_do_checkpoint() != NFS_ERROR_NONE) {
+        return -NFS_ERROR_IO;
+    }
+    // 有序模式：事务引用的数据块先落盘
+    if (nfs_cache_flush() != NFS_ERROR_NONE) {
+        return -NFS_ERROR_IO;
+    }
+
+    memset(&xfer, 0, sizeof(struct nfs_iolist));
+    pos = nfs_journal.head;
+    for (i = 0; i < cnt && ret == NFS_ERROR_NONE; i += n) {
+        n    = cnt - i < per ? cnt - i : per;
+        desc = (struct nfs_jdesc_d*)nfs_iolist_alloc(&xfer, NFS_JNL_OFS(pos), NFS_BLK_SZ());
+        if (desc == NULL) {
+            ret = -NFS_ERROR_NOSPACE;
+            break;
+        }
+        desc->magic = NFS_JDESC_MAGIC;
+        desc->seq   = nfs_journal.seq;
+        desc->cnt   = n;
+        desc->last  = (i + n == cnt);
+        for (k = 0; k < n; k++) {
+            desc->offsets[k] = iov[i + k].offset;
+        }
+        desc->csum = nfs_journal_csum(2166136261u, (uint8_t*)desc->offsets, n * sizeof(int));
+        for (k = 0; k < n; k++) {
+            desc->csum = nfs_journal_csum(desc->csum, iov[i + k].buf, NFS_BLK_SZ());
+            ret = nfs_iolist_add(&xfer, NFS_JNL_OFS(pos + 1 + k), iov[i + k].buf,
+                                 NFS_BLK_SZ());
+            if (ret != NFS_ERROR_NONE) {
+                break;
+            }
+        }
+        pos += 1 + n;
+    }
+    // 整个事务在日志区中连续，一次顺序写出
+    if (ret == NFS_ERROR_NONE) {
+        ret = nfs_driver_writev_raw(xfer.iov, xfer.cnt);
+    }
+    nfs_iolist_free(&xfer);
+    if (ret != NFS_ERROR_NONE) {
+        NFS_DBG("[%s] io error\n", __func__);
+        return -NFS_ERROR_IO;
+    }
+    for (i = 0; i < cnt; i++) {
+        if (nfs_journal_pin(iov[i].offset, iov[i].buf) != NFS_ERROR_NONE) {
+            return -NFS_ERROR_NOSPACE;
+        }
+    }
+    nfs_journal.head = pos;
+    nfs_journal.seq++;
+    nfs_journal.commits++;
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 以一个事务提交一组元数据块，每段须为一个完整的块
+ *
+ * @param iov
+ * @param cnt
+ * @return int
+ */
+int nfs_journal_commit(struct nfs_iovec* iov, int cnt) {
+    int ret;
+    nfs_journal_lock();
+    ret = nfs_journal_do_commit(iov, cnt);
+    nfs_journal_unlock();
+    return ret;
+}
+
+/**
+ * @brief 数据写出前调用，目标块若仍有待检查点的旧元数据则先做检查点
+ *
+ * @param iov
+ * @param cnt
+ * @return int
+ */
+int nfs_journal_revoke(struct nfs_iovec* iov, int cnt) {
+    int i, ofs, ret = NFS_ERROR_NONE;
+    nfs_journal_lock();
+    for (i = 0; i < cnt && nfs_journal.cnt > 0; i++) {
+        for (ofs = NFS_ROUND_DOWN(iov[i].offset, NFS_BLK_SZ());
+             ofs < iov[i].offset + iov[i].size; ofs += NFS_BLK_SZ()) {
+            if (nfs_journal_find(ofs)) {
+                ret = nfs_journal_do_checkpoint();
+                break;
+            }
+        }
+    }
+    nfs_journal_unlock();
+    return ret;
+}
+
+/**
+ * @brief 区间内是否有块尚未检查点，即原位置上不是最新内容。调用者持有日志锁
+ *
+ * @param offset
+ * @param size
+ * @return int
+ */
+int nfs_journal_pinned(int offset, int size) {
+    int ofs;
+    if (nfs_journal.cnt == 0) {
+        return 0;
+    }
+    for (ofs = NFS_ROUND_DOWN(offset, NFS_BLK_SZ()); ofs < offset + size; ofs += NFS_BLK_SZ()) {
+        if (nfs_journal_find(ofs)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief 读出磁盘内容后调用，用尚未检查点的块内容覆盖原位置上的旧内容。
+ *        调用者从读盘之前起持有日志锁
+ *
+ * @param offset
+ * @param buf
+ * @param size
+ */
+void nfs_journal_overlay(int offset, uint8_t* buf, int size) {
+    struct nfs_jblock* jb;
+    int ofs, begin, end;
+    if (nfs_journal.cnt == 0) {
+        return;
+    }
+    for (ofs = NFS_ROUND_DOWN(offset, NFS_BLK_SZ()); ofs < offset + size; ofs += NFS_BLK_SZ()) {
+        jb = nfs_journal_find(ofs);
+        if (jb == NULL) {
+            continue;
+        }
+        begin = ofs > offset ? ofs : offset;
+        end   = ofs + NFS_BLK_SZ() < offset + size ? ofs + NFS_BLK_SZ() : offset + size;
+        memcpy(buf + begin - offset, jb->data + begin - ofs, end - begin);
+    }
+}
+
+/**
+ * @brief 释放日志，调用前应已做检查点
+ */
+void nfs_journal_destroy() {
+    if (nfs_journal.hash == NULL) {
+        return;
+    }
+    NFS_DBG("[%s] %d commits, %d checkpoints\n", __func__,
+            nfs_journal.commits, nfs_journal.checkpoints);
+    nfs_journal_unpin_all();
+    free(nfs_journal.hash);
+    memset(&nfs_journal, 0, sizeof(struct nfs_journal));
+}
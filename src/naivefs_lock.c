@@ -0,0 +1,105 @@
+#define _GNU_SOURCE
+#include "../include/naivefs.h"
+
+/******************************************************************************
+* SECTION: 并发控制
+*
+* FUSE以多线程方式运行时，请求按以下层次加锁，上层先于下层获取：
+*   1) 命名空间锁：不释放目录项的请求共享持有，删除、重命名、写回和回收
+*      inode独占持有。共享持有期间任何目录项和inode都不会被释放
+*   2) inode读写锁：目录的查找、遍历取读锁，增加目录项取写锁；文件的读取取
+*      读锁，写入和截断取写锁
+*   3) inode加载锁、各位图的锁、页缓存锁、路径缓存锁、已加载inode链表锁
+*   4) 脏inode链表锁、日志锁
+*   5) 设备锁，串行化块缓存和设备读写
+* 命名空间锁优先照顾写者：有线程等待独占时新的共享请求也要等待，源源不断的
+* 读写请求不会让删除和写回一直拿不到锁。因此共享持有期间不能再次共享获取
+*******************************************************************************/
+static pthread_rwlock_t nfs_ns_rwlock  = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+static pthread_mutex_t  nfs_load_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief 获取命名空间锁
+ *
+ * @param mode NFS_LOCK_SHARED或NFS_LOCK_EXCL
+ */
+void nfs_ns_lock(int mode) {
+    if (mode == NFS_LOCK_EXCL) {
+        pthread_rwlock_wrlock(&nfs_ns_rwlock);
+    } else {
+        pthread_rwlock_rdlock(&nfs_ns_rwlock);
+    }
+}
+
+/**
+ * @brief 释放命名空间锁
+ */
+void nfs_ns_unlock() {
+    pthread_rwlock_unlock(&nfs_ns_rwlock);
+}
+
+/**
+ * @brief 获取inode的读锁
+ *
+ * @param inode
+ */
+void nfs_inode_rdlock(struct nfs_inode* inode) {
+    pthread_rwlock_rdlock(&inode->lock);
+}
+
+/**
+ * @brief 获取inode的写锁
+ *
+ * @param inode
+ */
+void nfs_inode_wrlock(struct nfs_inode* inode) {
+    pthread_rwlock_wrlock(&inode->lock);
+}
+
+/**
+ * @brief 释放inode的锁
+ *
+ * @param inode
+ */
+void nfs_inode_unlock(struct nfs_inode* inode) {
+    pthread_rwlock_unlock(&inode->lock);
+}
+
+/**
+ * @brief 取目录项指向的inode，未加载时从磁盘读入。多个线程同时访问未加载的
+ *        目录项时只读一次，读入的inode初始化完成后才对其他线程可见
+ *
+ * @param dentry
+ * @return struct nfs_inode* 读盘失败返回NULL
+ */
+struct nfs_inode* nfs_inode_get(struct nfs_dentry* dentry) {
+    struct nfs_inode* inode = nfs_inode_peek(dentry);
+    if (inode) {
+        return inode;
+    }
+    pthread_mutex_lock(&nfs_load_mutex);
+    inode = dentry->inode;
+    if (inode == NULL) {
+        inode = nfs_read_inode(dentry, dentry->ino);
+        if (inode) {
+            nfs_icache_add(inode);
+        }
+        __atomic_store_n(&dentry->inode, inode, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&nfs_load_mutex);
+    return inode;
+}
+
+/**
+ * @brief 取目录项指向的inode，不触发加载。访问已加载的inode时置访问位
+ *
+ * @param dentry
+ * @return struct nfs_inode* 未加载返回NULL
+ */
+struct nfs_inode* nfs_inode_peek(struct nfs_dentry* dentry) {
+    struct nfs_inode* inode = __atomic_load_n(&dentry->inode, __ATOMIC_ACQUIRE);
+    if (inode && !__atomic_load_n(&inode->lru_ref, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&inode->lru_ref, 1, __ATOMIC_RELAXED);
+    }
+    return inode;
+}
@@ -0,0 +1,166 @@
+#include "../include/naivefs.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/******************************************************************************
+* SECTION: 内存映射后端
+*
+* 磁盘镜像文件整体以MAP_SHARED映射，读写都是映射内的拷贝，不经过系统调用。
+* 写入的范围记为脏区间，到同步点（块缓存刷出）时才msync落盘。
+* 元数据的访问是随机的，映射整体设为MADV_RANDOM，避免内核按顺序预读；
+* 较长的连续读在拷贝前用MADV_WILLNEED预取。
+* 映射与镜像文件共享内核页缓存，镜像文件描述符仍可用于splice
+*******************************************************************************/
+struct nfs_mmap {
+    uint8_t*           base;                 // 映射起始地址
+    size_t             size;                 // 映射长度
+    int                dirty_lo;             // 尚未msync的范围[dirty_lo, dirty_hi)
+    int                dirty_hi;
+};
+
+static struct nfs_mmap nfs_mmap;
+
+static int nfs_mmap_open(const char* path) {
+    struct stat st;
+    int fd = nfs_img_open(path);
+    if (fd < 0) {
+        return fd;
+    }
+    memset(&nfs_mmap, 0, sizeof(struct nfs_mmap));
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return -NFS_ERROR_IO;
+    }
+    nfs_mmap.size = st.st_size;
+    nfs_mmap.base = (uint8_t*)mmap(NULL, nfs_mmap.size, PROT_READ | PROT_WRITE,
+                                   MAP_SHARED, fd, 0);
+    if (nfs_mmap.base == MAP_FAILED) {
+        NFS_DBG("[%s] mmap %s failed\n", __func__, path);
+        nfs_mmap.base = NULL;
+        close(fd);
+        return -NFS_ERROR_UNSUPPORTED;
+    }
+    madvise(nfs_mmap.base, nfs_mmap.size, MADV_RANDOM);
+    nfs_mmap.dirty_lo = INT_MAX;
+    nfs_mmap.dirty_hi = 0;
+    return fd;
+}
+
+/**
+ * @brief 把脏区间msync到镜像文件
+ *
+ * @param fd
+ * @return int
+ */
+static int nfs_mmap_sync(int fd) {
+    long page = sysconf(_SC_PAGESIZE);
+    int  lo;
+    (void)fd;
+    if (nfs_mmap.dirty_lo >= nfs_mmap.dirty_hi) {
+        return NFS_ERROR_NONE;
+    }
+    lo = NFS_ROUND_DOWN(nfs_mmap.dirty_lo, page);
+    if (msync(nfs_mmap.base + lo, nfs_mmap.dirty_hi - lo, MS_SYNC) != 0) {
+        NFS_DBG("[%s] msync failed\n", __func__);
+        return -NFS_ERROR_IO;
+    }
+    nfs_mmap.dirty_lo = INT_MAX;
+    nfs_mmap.dirty_hi = 0;
+    return NFS_ERROR_NONE;
+}
+
+static int nfs_mmap_close(int fd) {
+    nfs_mmap_sync(fd);
+    munmap(nfs_mmap.base, nfs_mmap.size);
+    memset(&nfs_mmap, 0, sizeof(struct nfs_mmap));
+    return close(fd);
+}
+
+/**
+ * @brief 段是否落在映射范围内
+ *
+ * @param iov
+ * @return int
+ */
+static int nfs_mmap_valid(struct nfs_iovec* iov) {
+    if (iov->offset < 0 || iov->size < 0
+        || (size_t)iov->offset + iov->size > nfs_mmap.size) {
+        NFS_DBG("[%s] io error at %d\n", __func__, iov->offset);
+        return 0;
+    }
+    return 1;
+}
+
+static int nfs_mmap_readv(int fd, struct nfs_iovec* iov, int cnt) {
+    long page = sysconf(_SC_PAGESIZE);
+    int  i, lo;
+    (void)fd;
+    for (i = 0; i < cnt; i++) {
+        if (!nfs_mmap_valid(&iov[i])) {
+            return -NFS_ERROR_IO;
+        }
+        nfs_img_account(iov[i].offset, iov[i].size, 0);
+        if (iov[i].size >= NFS_MMAP_PREFETCH) {
+            lo = NFS_ROUND_DOWN(iov[i].offset, page);
+            madvise(nfs_mmap.base + lo, iov[i].offset + iov[i].size - lo, MADV_WILLNEED);
+        }
+        memcpy(iov[i].buf, nfs_mmap.base + iov[i].offset, iov[i].size);
+    }
+    return NFS_ERROR_NONE;
+}
+
+static int nfs_mmap_writev(int fd, struct nfs_iovec* iov, int cnt) {
+    int i;
+    (void)fd;
+    for (i = 0; i < cnt; i++) {
+        if (!nfs_mmap_valid(&iov[i])) {
+            return -NFS_ERROR_IO;
+        }
+        nfs_img_account(iov[i].offset, iov[i].size, 1);
+        memcpy(nfs_mmap.base + iov[i].offset, iov[i].buf, iov[i].size);
+        if (iov[i].offset < nfs_mmap.dirty_lo) {
+            nfs_mmap.dirty_lo = iov[i].offset;
+        }
+        if (iov[i].offset + iov[i].size > nfs_mmap.dirty_hi) {
+            nfs_mmap.dirty_hi = iov[i].offset + iov[i].size;
+        }
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 设备区间在映射中的地址
+ *
+ * @param fd
+ * @param offset
+ * @param size
+ * @return uint8_t* 越界返回NULL
+ */
+static uint8_t* nfs_mmap_map(int fd, int offset, int size) {
+    (void)fd;
+    if (offset < 0 || size < 0 || (size_t)offset + size > nfs_mmap.size) {
+        return NULL;
+    }
+    return nfs_mmap.base + offset;
+}
+
+static struct nfs_backend nfs_mmap_ops = {
+    .name    = "mmap",
+    .open    = nfs_mmap_open,
+    .close   = nfs_mmap_close,
+    .ioctl   = nfs_img_ioctl,
+    .readv   = nfs_mmap_readv,
+    .writev  = nfs_mmap_writev,
+    .is_file = 1,
+    .sync    = nfs_mmap_sync,
+    .map     = nfs_mmap_map,
+};
+
+/**
+ * @brief 获取内存映射后端
+ *
+ * @return struct nfs_backend*
+ */
+struct nfs_backend* nfs_mmap_backend() {
+    return &nfs_mmap_ops;
+}
@@ -0,0 +1,499 @@
+#include "../include/naivefs.h"
+
+/******************************************************************************
+* SECTION: 文件页缓存
+*
+* 文件数据以数据块为单位按需载入：inode加载时不读任何数据块，读写时才把涉及
+* 的块载入内存。所有文件的页共用一个LRU链表，总数超过上限时淘汰最久未用的页，
+* 脏页先写回。文件扩展出的新块直接以全0脏页的形式出现，不需要读盘。
+* 淘汰会触及其他文件的页，所以页缓存整体由一把锁保护；页记住自己的磁盘
+* 偏移，淘汰时不读所属文件的区间。推迟分配的块的页还没有磁盘偏移，
+* 淘汰时跳过，写回时分配了数据块才补上偏移
+*******************************************************************************/
+static struct nfs_pcache nfs_pcache;
+static pthread_mutex_t   nfs_pcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief 初始化页缓存
+ *
+ * @param size 页缓存容量(字节)，至少容纳两批页
+ * @return int
+ */
+int nfs_page_init(int size) {
+    memset(&nfs_pcache, 0, sizeof(struct nfs_pcache));
+    nfs_pcache.max_pages = size / NFS_BLK_SZ();
+    if (nfs_pcache.max_pages < 2 * NFS_PAGE_BATCH) {
+        nfs_pcache.max_pages = 2 * NFS_PAGE_BATCH;
+    }
+    return NFS_ERROR_NONE;
+}
+
+static void nfs_page_lru_unlink(struct nfs_page* pg) {
+    if (pg->lru_prev) {
+        pg->lru_prev->lru_next = pg->lru_next;
+    } else {
+        nfs_pcache.lru_head = pg->lru_next;
+    }
+    if (pg->lru_next) {
+        pg->lru_next->lru_prev = pg->lru_prev;
+    } else {
+        nfs_pcache.lru_tail = pg->lru_prev;
+    }
+    pg->lru_prev = pg->lru_next = NULL;
+}
+
+static void nfs_page_lru_push(struct nfs_page* pg) {
+    pg->lru_prev = NULL;
+    pg->lru_next = nfs_pcache.lru_head;
+    if (nfs_pcache.lru_head) {
+        nfs_pcache.lru_head->lru_prev = pg;
+    } else {
+        nfs_pcache.lru_tail = pg;
+    }
+    nfs_pcache.lru_head = pg;
+}
+
+/**
+ * @brief 将脏页写回对应的数据块
+ *
+ * @param pg
+ * @return int
+ */
+static int nfs_page_writeback(struct nfs_page* pg) {
+    struct nfs_iovec iov;
+    if (!pg->dirty) {
+        return NFS_ERROR_NONE;
+    }
+    iov.offset = pg->ofs;
+    iov.buf    = pg->data;
+    iov.size   = NFS_BLK_SZ();
+    if (nfs_journal_revoke(&iov, 1) != NFS_ERROR_NONE
+        || nfs_driver_write(iov.offset, iov.buf, iov.size) != NFS_ERROR_NONE) {
+        NFS_DBG("[%s] io error\n", __func__);
+        return -NFS_ERROR_IO;
+    }
+    pg->dirty = 0;
+    nfs_dirty_data(pg->inode, -1);
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 丢弃一页，不写回
+ *
+ * @param pg
+ */
+static void nfs_page_drop(struct nfs_page* pg) {
+    if (pg->dirty) {
+        nfs_dirty_data(pg->inode, -1);
+    }
+    if (pg->ofs < 0) {
+        nfs_pcache.delayed--;
+    }
+    nfs_page_lru_unlink(pg);
+    pg->inode->pages[pg->lblk] = NULL;
+    nfs_pcache.cnt--;
+    free(pg->data);
+    free(pg);
+}
+
+/**
+ * @brief 页数达到上限时淘汰最久未用的页，没有数据块的页无处写回，跳过
+ *
+ * @return int
+ */
+static int nfs_page_reclaim() {
+    struct nfs_page* pg = nfs_pcache.lru_tail;
+    struct nfs_page* prev;
+    while (nfs_pcache.cnt >= nfs_pcache.max_pages && pg) {
+        prev = pg->lru_prev;
+        if (pg->ofs >= 0) {
+            if (nfs_page_writeback(pg) != NFS_ERROR_NONE) {
+                return -NFS_ERROR_IO;
+            }
+            nfs_page_drop(pg);
+        }
+        pg = prev;
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 为逻辑块建立一页，内容未初始化
+ *
+ * @param inode
+ * @param lblk
+ * @return struct nfs_page*
+ */
+static struct nfs_page* nfs_page_new(struct nfs_inode* inode, int lblk) {
+    struct nfs_page*  pg;
+    struct nfs_page** pages;
+    int cap, blk;
+    if (lblk >= inode->page_cap) {
+        cap = inode->page_cap ? inode->page_cap : 8;
+        while (cap <= lblk) {
+            cap *= 2;
+        }
+        pages = (struct nfs_page**)realloc(inode->pages, cap * sizeof(struct nfs_page*));
+        if (pages == NULL) {
+            return NULL;
+        }
+        memset(pages + inode->page_cap, 0, (cap - inode->page_cap) * sizeof(struct nfs_page*));
+        inode->pages    = pages;
+        inode->page_cap = cap;
+    }
+    if (nfs_page_reclaim() != NFS_ERROR_NONE) {
+        return NULL;
+    }
+    pg = (struct nfs_page*)calloc(1, sizeof(struct nfs_page));
+    if (pg == NULL) {
+        return NULL;
+    }
+    pg->data = (uint8_t*)malloc(NFS_BLK_SZ());
+    if (pg->data == NULL) {
+        free(pg);
+        return NULL;
+    }
+    pg->inode = inode;
+    pg->lblk  = lblk;
+    blk       = nfs_extent_map(inode, lblk);
+    pg->ofs   = blk < 0 ? -1 : NFS_DATA_OFS(blk);
+    if (pg->ofs < 0) {
+        nfs_pcache.delayed++;
+    }
+    inode->pages[lblk] = pg;
+    nfs_page_lru_push(pg);
+    nfs_pcache.cnt++;
+    return pg;
+}
+
+/**
+ * @brief 取已在内存中的页
+ *
+ * @param inode
+ * @param lblk
+ * @return struct nfs_page* 不在内存中返回NULL
+ */
+static struct nfs_page* nfs_page_find(struct nfs_inode* inode, int lblk) {
+    return lblk < inode->page_cap ? inode->pages[lblk] : NULL;
+}
+
+/**
+ * @brief 保证[offset, offset + size)涉及的块都在内存中，缺页一次向量读入。
+ *        写操作完整覆盖的块不读盘。失败时丢弃本次新建的页，它们的内容未初始化
+ *
+ * @param inode
+ * @param offset
+ * @param size 不超过NFS_PAGE_BATCH块
+ * @param is_write
+ * @return int
+ */
+static int nfs_page_prepare(struct nfs_inode* inode, int offset, int size, int is_write) {
+    struct nfs_iolist list;
+    struct nfs_page*  pg;
+    int begin = offset / NFS_BLK_SZ();
+    int end   = (offset + size - 1) / NFS_BLK_SZ();
+    int created[NFS_PAGE_BATCH + 1];
+    int lblk, i, cnt = 0, ret = NFS_ERROR_NONE;
+
+    memset(&list, 0, sizeof(struct nfs_iolist));
+    for (lblk = begin; lblk <= end; lblk++) {
+        pg = nfs_page_find(inode, lblk);
+        if (pg) {
+            nfs_pcache.hit++;
+            nfs_page_lru_unlink(pg);
+            nfs_page_lru_push(pg);
+            continue;
+        }
+        nfs_pcache.miss++;
+        pg = nfs_page_new(inode, lblk);
+        if (pg == NULL) {
+            ret = -NFS_ERROR_NOSPACE;
+            break;
+        }
+        created[cnt++] = lblk;
+        if (is_write && lblk * NFS_BLK_SZ() >= offset
+            && (lblk + 1) * NFS_BLK_SZ() <= offset + size) {
+            continue;
+        }
+        if (nfs_iolist_add(&list, pg->ofs, pg->data, NFS_BLK_SZ()) != NFS_ERROR_NONE) {
+            ret = -NFS_ERROR_NOSPACE;
+            break;
+        }
+    }
+    if (ret == NFS_ERROR_NONE && list.cnt > 0
+        && nfs_driver_readv(list.iov, list.cnt) != NFS_ERROR_NONE) {
+        NFS_DBG("[%s] io error\n", __func__);
+        ret = -NFS_ERROR_IO;
+    }
+    nfs_iolist_free(&list);
+    for (i = 0; ret != NFS_ERROR_NONE && i < cnt; i++) {
+        pg = nfs_page_find(inode, created[i]);
+        if (pg && !pg->dirty) {
+            nfs_page_drop(pg);
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief 页与用户缓冲区之间拷贝，按批处理以免一次载入的页超过缓存容量
+ *
+ * @param inode
+ * @param buf
+ * @param offset
+ * @param size
+ * @param is_write
+ * @return int
+ */
+static int nfs_page_rw(struct nfs_inode* inode, uint8_t* buf, int offset, int size,
+                       int is_write) {
+    struct nfs_page* pg;
+    int batch, len, bias;
+    while (size > 0) {
+        bias  = offset % NFS_BLK_SZ();
+        batch = NFS_PAGE_BATCH * NFS_BLK_SZ() - bias;
+        batch = batch < size ? batch : size;
+        if (nfs_page_prepare(inode, offset, batch, is_write) != NFS_ERROR_NONE) {
+            return -NFS_ERROR_IO;
+        }
+        while (batch > 0) {
+            pg   = inode->pages[offset / NFS_BLK_SZ()];
+            bias = offset % NFS_BLK_SZ();
+            len  = NFS_BLK_SZ() - bias < batch ? NFS_BLK_SZ() - bias : batch;
+            if (is_write) {
+                memcpy(pg->data + bias, buf, len);
+                if (!pg->dirty) {
+                    pg->dirty = 1;
+                    nfs_dirty_data(inode, 1);
+                }
+            } else {
+                memcpy(buf, pg->data + bias, len);
+            }
+            buf    += len;
+            offset += len;
+            size   -= len;
+            batch  -= len;
+        }
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 读文件数据，调用者保证范围在已分配的块内。内联文件直接读内联区
+ *
+ * @param inode
+ * @param buf
+ * @param offset
+ * @param size
+ * @return int
+ */
+int nfs_page_read(struct nfs_inode* inode, uint8_t* buf, int offset, int size) {
+    int ret;
+    if (inode->is_inline) {
+        memcpy(buf, inode->inline_data + offset, size);
+        return NFS_ERROR_NONE;
+    }
+    pthread_mutex_lock(&nfs_pcache_lock);
+    ret = nfs_page_rw(inode, buf, offset, size, 0);
+    pthread_mutex_unlock(&nfs_pcache_lock);
+    return ret;
+}
+
+/**
+ * @brief 写文件数据，调用者保证范围在已分配的块内。内联文件直接写内联区，
+ *        随inode记录写回
+ *
+ * @param inode
+ * @param buf
+ * @param offset
+ * @param size
+ * @return int
+ */
+int nfs_page_write(struct nfs_inode* inode, const uint8_t* buf, int offset, int size) {
+    int ret;
+    if (inode->is_inline) {
+        memcpy(inode->inline_data + offset, buf, size);
+        nfs_dirty_inode(inode);
+        return NFS_ERROR_NONE;
+    }
+    pthread_mutex_lock(&nfs_pcache_lock);
+    ret = nfs_page_rw(inode, (uint8_t*)buf, offset, size, 1);
+    pthread_mutex_unlock(&nfs_pcache_lock);
+    return ret;
+}
+
+/**
+ * @brief 新分配的块[begin, end)以全0脏页的形式载入，不读盘
+ *
+ * @param inode
+ * @param begin
+ * @param end
+ * @return int
+ */
+int nfs_page_zero(struct nfs_inode* inode, int begin, int end) {
+    struct nfs_page* pg;
+    int lblk, ret = NFS_ERROR_NONE;
+    pthread_mutex_lock(&nfs_pcache_lock);
+    for (lblk = begin; lblk < end; lblk++) {
+        pg = nfs_page_find(inode, lblk);
+        if (pg == NULL) {
+            pg = nfs_page_new(inode, lblk);
+            if (pg == NULL) {
+                ret = -NFS_ERROR_NOSPACE;
+                break;
+            }
+        }
+        memset(pg->data, 0, NFS_BLK_SZ());
+        if (!pg->dirty) {
+            pg->dirty = 1;
+            nfs_dirty_data(inode, 1);
+        }
+    }
+    pthread_mutex_unlock(&nfs_pcache_lock);
+    return ret;
+}
+
+/**
+ * @brief 逻辑块是否有页在内存中。不在内存中的块，磁盘上的数据块就是文件内容
+ *
+ * @param inode
+ * @param lblk
+ * @return int
+ */
+int nfs_page_cached(struct nfs_inode* inode, int lblk) {
+    int ret;
+    pthread_mutex_lock(&nfs_pcache_lock);
+    ret = nfs_page_find(inode, lblk) != NULL;
+    pthread_mutex_unlock(&nfs_pcache_lock);
+    return ret;
+}
+
+/**
+ * @brief 丢弃逻辑块[begin, end)的页，不写回。用于这些块即将被整块覆盖写入磁盘
+ *
+ * @param inode
+ * @param begin
+ * @param end
+ */
+void nfs_page_discard(struct nfs_inode* inode, int begin, int end) {
+    struct nfs_page* pg;
+    int lblk;
+    pthread_mutex_lock(&nfs_pcache_lock);
+    for (lblk = begin; lblk < end; lblk++) {
+        pg = nfs_page_find(inode, lblk);
+        if (pg) {
+            nfs_page_drop(pg);
+        }
+    }
+    pthread_mutex_unlock(&nfs_pcache_lock);
+}
+
+/**
+ * @brief 丢弃逻辑块号不小于n的页，用于截断和删除文件
+ *
+ * @param inode
+ * @param n
+ */
+void nfs_page_truncate(struct nfs_inode* inode, int n) {
+    int lblk;
+    pthread_mutex_lock(&nfs_pcache_lock);
+    for (lblk = n; lblk < inode->page_cap; lblk++) {
+        if (inode->pages[lblk]) {
+            nfs_page_drop(inode->pages[lblk]);
+        }
+    }
+    if (n == 0) {
+        free(inode->pages);
+        inode->pages    = NULL;
+        inode->page_cap = 0;
+    }
+    pthread_mutex_unlock(&nfs_pcache_lock);
+}
+
+/**
+ * @brief 推迟分配的块[begin, end)分配了数据块后，为它们的页补上磁盘偏移
+ *
+ * @param inode
+ * @param begin
+ * @param end
+ */
+void nfs_page_remap(struct nfs_inode* inode, int begin, int end) {
+    struct nfs_page* pg;
+    int lblk;
+    pthread_mutex_lock(&nfs_pcache_lock);
+    for (lblk = begin; lblk < end; lblk++) {
+        pg = nfs_page_find(inode, lblk);
+        if (pg && pg->ofs < 0) {
+            pg->ofs = NFS_DATA_OFS(nfs_extent_map(inode, lblk));
+            nfs_pcache.delayed--;
+        }
+    }
+    pthread_mutex_unlock(&nfs_pcache_lock);
+}
+
+/**
+ * @brief 还能再推迟分配多少块。没有数据块的页不能淘汰，最多占页缓存的一半
+ *
+ * @return int 页数
+ */
+int nfs_page_delay_room() {
+    int room;
+    pthread_mutex_lock(&nfs_pcache_lock);
+    room = nfs_pcache.max_pages / 2 - nfs_pcache.delayed;
+    pthread_mutex_unlock(&nfs_pcache_lock);
+    return room;
+}
+
+/**
+ * @brief 收集文件的脏页加入写回段。页仍保持为脏，事务提交后由nfs_page_clean清除
+ *
+ * @param inode
+ * @param list
+ * @return int
+ */
+int nfs_page_collect(struct nfs_inode* inode, struct nfs_iolist* list) {
+    struct nfs_page* pg;
+    int lblk;
+    pthread_mutex_lock(&nfs_pcache_lock);
+    for (lblk = 0; lblk < inode->page_cap; lblk++) {
+        pg = inode->pages[lblk];
+        if (pg == NULL || !pg->dirty) {
+            continue;
+        }
+        if (nfs_iolist_add(list, pg->ofs, pg->data, NFS_BLK_SZ()) != NFS_ERROR_NONE) {
+            pthread_mutex_unlock(&nfs_pcache_lock);
+            return -NFS_ERROR_NOSPACE;
+        }
+    }
+    pthread_mutex_unlock(&nfs_pcache_lock);
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 清除文件所有页的脏标记，用于nfs_page_collect收集的页已写回之后
+ *
+ * @param inode
+ */
+void nfs_page_clean(struct nfs_inode* inode) {
+    int lblk;
+    pthread_mutex_lock(&nfs_pcache_lock);
+    for (lblk = 0; lblk < inode->page_cap; lblk++) {
+        if (inode->pages[lblk]) {
+            inode->pages[lblk]->dirty = 0;
+        }
+    }
+    pthread_mutex_unlock(&nfs_pcache_lock);
+}
+
+/**
+ * @brief 释放所有页，调用前应已将脏页写回
+ */
+void nfs_page_destroy() {
+    if (nfs_pcache.max_pages > 0) {
+        NFS_DBG("[%s] hit %d, miss %d\n", __func__, nfs_pcache.hit, nfs_pcache.miss);
+    }
+    while (nfs_pcache.lru_head) {
+        nfs_page_drop(nfs_pcache.lru_head);
+    }
+    memset(&nfs_pcache, 0, sizeof(struct nfs_pcache));
+}
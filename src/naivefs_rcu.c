@@ -0,0 +1,224 @@
+#include "../include/naivefs.h"
+#include <sched.h>
+
+/******************************************************************************
+* SECTION: 基于纪元的延迟释放
+*
+* 只读的路径解析不取任何锁，在读侧临界区内访问目录索引和路径缓存。
+* 写者先原子地摘除对象，再用nfs_rcu_retire登记释放函数。每个线程进入临界区时
+* 记下当前的全局纪元；只有全部处于临界区的线程都已看到当前纪元，全局纪元才能
+* 前进。对象在纪元e被登记，全局纪元到达e+2时，摘除前进入临界区的线程都已
+* 离开，对象才真正释放。
+* 临界区内不能取命名空间锁，也不能调用nfs_rcu_synchronize
+*******************************************************************************/
+static uint64_t               nfs_rcu_epoch = 1;
+static struct nfs_rcu_reader* nfs_rcu_readers;
+static pthread_mutex_t        nfs_rcu_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct nfs_rcu_node*   nfs_rcu_head;   // 待释放对象，按登记的纪元排列
+static struct nfs_rcu_node*   nfs_rcu_tail;
+static int                    nfs_rcu_pending;
+static int                    nfs_rcu_freed;
+static pthread_key_t          nfs_rcu_key;
+static pthread_once_t         nfs_rcu_once = PTHREAD_ONCE_INIT;
+static __thread struct nfs_rcu_reader* nfs_rcu_self;
+
+/**
+ * @brief 线程退出时归还其读者记录，供之后的线程复用
+ *
+ * @param arg 读者记录
+ */
+static void nfs_rcu_reader_exit(void* arg) {
+    struct nfs_rcu_reader* reader = (struct nfs_rcu_reader*)arg;
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&reader->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void nfs_rcu_key_init() {
+    pthread_key_create(&nfs_rcu_key, nfs_rcu_reader_exit);
+}
+
+/**
+ * @brief 取当前线程的读者记录，首次调用时登记。读者记录不会被释放
+ *
+ * @return struct nfs_rcu_reader* 内存不足返回NULL
+ */
+static struct nfs_rcu_reader* nfs_rcu_reader_get() {
+    struct nfs_rcu_reader* reader;
+    int    expect;
+    if (nfs_rcu_self) {
+        return nfs_rcu_self;
+    }
+    pthread_once(&nfs_rcu_once, nfs_rcu_key_init);
+    for (reader = __atomic_load_n(&nfs_rcu_readers, __ATOMIC_ACQUIRE);
+         reader; reader = reader->next) {
+        expect = 0;
+        if (__atomic_compare_exchange_n(&reader->in_use, &expect, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (reader == NULL) {
+        reader = (struct nfs_rcu_reader*)calloc(1, sizeof(struct nfs_rcu_reader));
+        if (reader == NULL) {
+            return NULL;
+        }
+        reader->in_use = 1;
+        reader->next   = __atomic_load_n(&nfs_rcu_readers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&nfs_rcu_readers, &reader->next, reader, 0,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+    pthread_setspecific(nfs_rcu_key, reader);
+    nfs_rcu_self = reader;
+    return reader;
+}
+
+/**
+ * @brief 进入读侧临界区，可以嵌套
+ *
+ * @return int 无法登记读者时返回-NFS_ERROR_NOSPACE，此时不能走无锁路径
+ */
+int nfs_rcu_read_lock() {
+    struct nfs_rcu_reader* reader = nfs_rcu_reader_get();
+    if (reader == NULL) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    if (reader->nest++ == 0) {
+        __atomic_store_n(&reader->epoch, __atomic_load_n(&nfs_rcu_epoch, __ATOMIC_SEQ_CST),
+                         __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 离开读侧临界区，与成功的nfs_rcu_read_lock配对
+ */
+void nfs_rcu_read_unlock() {
+    struct nfs_rcu_reader* reader = nfs_rcu_self;
+    if (--reader->nest == 0) {
+        __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * @brief 所有处于临界区的线程都已看到当前纪元时，将全局纪元推进一步
+ *
+ * @return int 推进了返回1
+ */
+static int nfs_rcu_advance() {
+    uint64_t epoch = __atomic_load_n(&nfs_rcu_epoch, __ATOMIC_SEQ_CST);
+    uint64_t seen;
+    struct nfs_rcu_reader* reader;
+    for (reader = __atomic_load_n(&nfs_rcu_readers, __ATOMIC_ACQUIRE);
+         reader; reader = reader->next) {
+        seen = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST);
+        if (seen != 0 && seen != epoch) {
+            return 0;
+        }
+    }
+    return __atomic_compare_exchange_n(&nfs_rcu_epoch, &epoch, epoch + 1, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief 尝试推进纪元，释放已经没有读者能访问到的对象
+ */
+void nfs_rcu_reclaim() {
+    struct nfs_rcu_node* list;
+    struct nfs_rcu_node* node;
+    struct nfs_rcu_node** cur;
+    uint64_t epoch;
+
+    pthread_mutex_lock(&nfs_rcu_mutex);
+    nfs_rcu_advance();
+    epoch = __atomic_load_n(&nfs_rcu_epoch, __ATOMIC_SEQ_CST);
+    // 摘下纪元足够老的前缀
+    list = NULL;
+    cur  = &list;
+    while (nfs_rcu_head && nfs_rcu_head->epoch + 2 <= epoch) {
+        *cur = nfs_rcu_head;
+        cur  = &nfs_rcu_head->next;
+        nfs_rcu_head = nfs_rcu_head->next;
+        nfs_rcu_pending--;
+        nfs_rcu_freed++;
+    }
+    *cur = NULL;
+    if (nfs_rcu_head == NULL) {
+        nfs_rcu_tail = NULL;
+    }
+    pthread_mutex_unlock(&nfs_rcu_mutex);
+
+    while (list) {
+        node = list;
+        list = list->next;
+        node->fn(node->ptr);
+        free(node);
+    }
+}
+
+/**
+ * @brief 登记一个已从共享结构中摘除的对象，等到没有读者能访问它时再调用fn释放
+ *
+ * 调用者可能持有inode锁，不能在此同步等待，因此内存不足时宁可泄漏该对象
+ *
+ * @param ptr 对象
+ * @param fn 释放函数
+ */
+void nfs_rcu_retire(void* ptr, void (*fn)(void*)) {
+    struct nfs_rcu_node* node = (struct nfs_rcu_node*)malloc(sizeof(struct nfs_rcu_node));
+    if (node == NULL) {
+        NFS_DBG("[%s] no memory, leaking %p\n", __func__, ptr);
+        return;
+    }
+    node->ptr  = ptr;
+    node->fn   = fn;
+    node->next = NULL;
+    pthread_mutex_lock(&nfs_rcu_mutex);
+    node->epoch = __atomic_load_n(&nfs_rcu_epoch, __ATOMIC_SEQ_CST);
+    if (nfs_rcu_tail) {
+        nfs_rcu_tail->next = node;
+    } else {
+        nfs_rcu_head = node;
+    }
+    nfs_rcu_tail = node;
+    nfs_rcu_pending++;
+    pthread_mutex_unlock(&nfs_rcu_mutex);
+    nfs_rcu_reclaim();
+}
+
+/**
+ * @brief 等待调用前已进入临界区的读者全部离开。调用者不能处于临界区中，
+ *        也不能持有临界区内会去获取的inode锁
+ */
+void nfs_rcu_synchronize() {
+    uint64_t target = __atomic_load_n(&nfs_rcu_epoch, __ATOMIC_SEQ_CST) + 2;
+    while (__atomic_load_n(&nfs_rcu_epoch, __ATOMIC_SEQ_CST) < target) {
+        if (!nfs_rcu_advance()) {
+            sched_yield();
+        }
+    }
+    nfs_rcu_reclaim();
+}
+
+/**
+ * @brief 卸载时调用，此时已没有读者，释放全部待释放对象
+ */
+void nfs_rcu_destroy() {
+    struct nfs_rcu_node* list;
+    struct nfs_rcu_node* node;
+
+    pthread_mutex_lock(&nfs_rcu_mutex);
+    list = nfs_rcu_head;
+    nfs_rcu_head = nfs_rcu_tail = NULL;
+    NFS_DBG("[%s] freed %d, pending %d\n", __func__, nfs_rcu_freed, nfs_rcu_pending);
+    nfs_rcu_freed = nfs_rcu_pending = 0;
+    pthread_mutex_unlock(&nfs_rcu_mutex);
+
+    while (list) {
+        node = list;
+        list = list->next;
+        node->fn(node->ptr);
+        free(node);
+    }
+}
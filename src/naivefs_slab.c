@@ -0,0 +1,254 @@
+#include "../include/naivefs.h"
+
+/******************************************************************************
+* SECTION: 对象缓存
+*
+* 目录项和inode数量多、大小固定，逐个malloc既有分配器的头部开销，载入大目录
+* 时也频繁进出分配器。对象缓存每次向系统申请一大块，切成等长的对象挂在空闲
+* 链表上，释放的对象放回链表复用。内存块在卸载时才整体归还
+*******************************************************************************/
+
+/**
+ * @brief 初始化对象缓存
+ *
+ * @param slab
+ * @param name 统计输出中的名字
+ * @param obj_sz 对象大小
+ */
+void nfs_slab_init(struct nfs_slab* slab, const char* name, int obj_sz) {
+    memset(slab, 0, sizeof(struct nfs_slab));
+    slab->name      = name;
+    // 空闲对象的开头存放链表指针，对象按指针对齐
+    slab->obj_sz    = NFS_ROUND_UP(obj_sz, sizeof(void*));
+    slab->per_chunk = (NFS_SLAB_CHUNK_SZ - sizeof(void*)) / slab->obj_sz;
+    pthread_mutex_init(&slab->lock, NULL);
+}
+
+/**
+ * @brief 申请一块内存，切成对象挂入空闲链表。调用者持有slab->lock
+ *
+ * @param slab
+ * @return int
+ */
+static int nfs_slab_grow(struct nfs_slab* slab) {
+    uint8_t* chunk = (uint8_t*)malloc(sizeof(void*) + slab->per_chunk * slab->obj_sz);
+    uint8_t* obj;
+    int      i;
+    if (chunk == NULL) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    *(void**)chunk = slab->chunks;
+    slab->chunks   = chunk;
+    slab->chunk_cnt++;
+    for (i = slab->per_chunk - 1; i >= 0; i--) {
+        obj = chunk + sizeof(void*) + i * slab->obj_sz;
+        *(void**)obj = slab->free;
+        slab->free   = obj;
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 分配一个清零的对象
+ *
+ * @param slab
+ * @return void* 内存不足返回NULL
+ */
+void* nfs_slab_alloc(struct nfs_slab* slab) {
+    void* obj;
+    pthread_mutex_lock(&slab->lock);
+    if (slab->free == NULL && nfs_slab_grow(slab) != NFS_ERROR_NONE) {
+        pthread_mutex_unlock(&slab->lock);
+        return NULL;
+    }
+    obj        = slab->free;
+    slab->free = *(void**)obj;
+    __atomic_add_fetch(&slab->in_use, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&slab->lock);
+    memset(obj, 0, slab->obj_sz);
+    return obj;
+}
+
+/**
+ * @brief 把对象放回空闲链表
+ *
+ * @param slab
+ * @param obj 可以为NULL
+ */
+void nfs_slab_free(struct nfs_slab* slab, void* obj) {
+    if (obj == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&slab->lock);
+    *(void**)obj = slab->free;
+    slab->free   = obj;
+    __atomic_sub_fetch(&slab->in_use, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&slab->lock);
+}
+
+/**
+ * @brief 已分配的对象占用的内存，可以不持锁调用
+ *
+ * @param slab
+ * @return long 字节数
+ */
+long nfs_slab_usage(struct nfs_slab* slab) {
+    return (long)__atomic_load_n(&slab->in_use, __ATOMIC_RELAXED) * slab->obj_sz;
+}
+
+/**
+ * @brief 卸载时调用，归还全部内存块，其中仍在使用的对象一并失效
+ *
+ * @param slab
+ */
+void nfs_slab_destroy(struct nfs_slab* slab) {
+    void* chunk;
+    NFS_DBG("[%s] %s: %d chunks, %d in use\n", __func__, slab->name, slab->chunk_cnt,
+            slab->in_use);
+    while (slab->chunks) {
+        chunk        = slab->chunks;
+        slab->chunks = *(void**)chunk;
+        free(chunk);
+    }
+    pthread_mutex_destroy(&slab->lock);
+    memset(slab, 0, sizeof(struct nfs_slab));
+}
+
+/******************************************************************************
+* SECTION: 目录项名字区
+*
+* 目录项的名字不再各占MAX_NAME_LEN字节，而是紧密地存放在父目录的名字区中。
+* 名字区由若干块组成，新块的大小随目录增长而翻倍，小目录只占很少的内存。
+* 名字只追加不单独释放；目录项离开目录后它的名字成为空洞，空洞超过一半时
+* 把仍在目录中的名字拷贝到新块，旧块等无锁的查找结束后再释放。
+* 名字区只在持有目录写锁时修改
+*******************************************************************************/
+static long nfs_name_mem;                    // 所有名字块占用的内存
+
+/**
+ * @brief 释放一串名字块
+ *
+ * @param arg 第一块
+ */
+static void nfs_name_chunks_free(void* arg) {
+    struct nfs_name_chunk* chunk = (struct nfs_name_chunk*)arg;
+    struct nfs_name_chunk* next;
+    while (chunk) {
+        next = chunk->next;
+        __atomic_sub_fetch(&nfs_name_mem, sizeof(struct nfs_name_chunk) + chunk->size,
+                           __ATOMIC_RELAXED);
+        free(chunk);
+        chunk = next;
+    }
+}
+
+/**
+ * @brief 在名字区中预留len字节，不够时申请新块
+ *
+ * @param names
+ * @param len
+ * @return char* 内存不足返回NULL
+ */
+static char* nfs_name_reserve(struct nfs_name_arena* names, int len) {
+    struct nfs_name_chunk* chunk = names->chunks;
+    int    size;
+    char*  name;
+    if (chunk == NULL || chunk->used + len > chunk->size) {
+        size = chunk ? chunk->size * 2 : NFS_NAME_CHUNK_MIN;
+        size = size < NFS_NAME_CHUNK_MAX ? size : NFS_NAME_CHUNK_MAX;
+        size = size > len ? size : len;
+        chunk = (struct nfs_name_chunk*)malloc(sizeof(struct nfs_name_chunk) + size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->next   = names->chunks;
+        chunk->size   = size;
+        chunk->used   = 0;
+        names->chunks = chunk;
+        __atomic_add_fetch(&nfs_name_mem, sizeof(struct nfs_name_chunk) + size,
+                           __ATOMIC_RELAXED);
+    }
+    name = chunk->buf + chunk->used;
+    chunk->used += len;
+    names->used += len;
+    return name;
+}
+
+/**
+ * @brief 把目录中的名字拷贝到新的名字区，旧的名字块延迟释放
+ *
+ * 无锁的查找可能正在读旧名字：先写好新名字再原子地改指针，旧块在它们
+ * 都结束后才释放
+ *
+ * @param inode 持有写锁的目录inode
+ */
+static void nfs_name_compact(struct nfs_inode* inode) {
+    struct nfs_name_arena  names;
+    struct nfs_name_chunk* tail;
+    struct nfs_dentry*     dentry;
+    char*  name;
+    int    len;
+
+    memset(&names, 0, sizeof(struct nfs_name_arena));
+    for (dentry = inode->dentrys; dentry; dentry = dentry->brother) {
+        len  = strlen(dentry->name) + 1;
+        name = nfs_name_reserve(&names, len);
+        if (name == NULL) {
+            // 内存不足时放弃整理，已经改过的名字指向新块，新旧块都要保留
+            if (names.chunks) {
+                for (tail = names.chunks; tail->next; tail = tail->next) {
+                }
+                tail->next          = inode->names.chunks;
+                inode->names.chunks = names.chunks;
+                inode->names.used  += names.used;
+            }
+            return;
+        }
+        memcpy(name, dentry->name, len);
+        __atomic_store_n(&dentry->name, name, __ATOMIC_RELEASE);
+    }
+    nfs_rcu_retire(inode->names.chunks, nfs_name_chunks_free);
+    names.live   = inode->names.live;
+    inode->names = names;
+}
+
+/**
+ * @brief 把名字存入目录的名字区，存入的名字以'\0'结尾
+ *
+ * @param inode 持有写锁的目录inode
+ * @param name
+ * @param len 名字长度，不含结尾的'\0'
+ * @return const char* 内存不足返回NULL
+ */
+const char* nfs_name_intern(struct nfs_inode* inode, const char* name, int len) {
+    char* ret;
+    if (inode->names.used - inode->names.live > NFS_NAME_CHUNK_MAX
+        && inode->names.used - inode->names.live > inode->names.live) {
+        nfs_name_compact(inode);
+    }
+    ret = nfs_name_reserve(&inode->names, len + 1);
+    if (ret) {
+        memcpy(ret, name, len);
+        ret[len] = '\0';
+    }
+    return ret;
+}
+
+/**
+ * @brief 所有目录的名字区占用的内存，包括等待释放的名字块，可以不持锁调用
+ *
+ * @return long 字节数
+ */
+long nfs_name_usage() {
+    return __atomic_load_n(&nfs_name_mem, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 释放目录的名字区
+ *
+ * @param inode 目录inode，已没有目录项引用其中的名字
+ */
+void nfs_name_destroy(struct nfs_inode* inode) {
+    nfs_name_chunks_free(inode->names.chunks);
+    memset(&inode->names, 0, sizeof(struct nfs_name_arena));
+}
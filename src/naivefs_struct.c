@@ -1,155 +1,171 @@
 #include "../include/naivefs.h"
 
+static void nfs_inode_reclaim(void* arg);
+
 /******************************************************************************
 * SECTION: 数据结构操作
 *******************************************************************************/
 
 /**
- * @brief 分配一个inode，占用位图
+ * @brief 创建内存inode并初始化各字段
  * 
- * @param dentry 该dentry指向分配的inode
- * @return nfs_inode
+ * @param dentry 指向该inode的dentry
+ * @param ino 
+ * @return struct nfs_inode* 
  */
-struct nfs_inode* nfs_alloc_inode(struct nfs_dentry * dentry) {
-    struct nfs_inode* inode;
-    int byte_cur = 0;
-    int bit_cur  = 0;
-    int ino_cur  = 0;               // 记录已遍历的inode数
-    int is_find_free_entry = 0;
-
-    for (byte_cur = 0; byte_cur < super.map_inode_blks * NFS_BLK_SZ(); byte_cur++) {
-        for (bit_cur = 0; bit_cur < UINT8_BITS; bit_cur++) {
-            // inode位图当前位置空闲
-            if ((super.map_inode[byte_cur] & (0x1 << bit_cur)) == 0) {
-                super.map_inode[byte_cur] |= (0x1 << bit_cur);
-                is_find_free_entry = 1;
-                break;
-            }
-            ino_cur++;
+static struct nfs_inode* nfs_new_inode(struct nfs_dentry * dentry, int ino) {
+    struct nfs_inode* inode = (struct nfs_inode*)nfs_slab_alloc(&super.inode_slab);
+    if (inode == NULL) {
+        return NULL;
+    }
+    inode->ino    = ino;
+    inode->dentry = dentry;
+    nfs_extent_init(inode);
+    pthread_rwlock_init(&inode->lock, NULL);
+    return inode;
+}
+
+/**
+ * @brief 为新目录选择块组：从上一次选中的块组之后开始，选第一个空闲inode和
+ *        空闲数据块都不少于平均值的块组，使目录分散到各个块组
+ * 
+ * @return int 块组号
+ */
+static int nfs_dir_group() {
+    static int next;
+    int avg_ino  = nfs_bmap_avail(&super.bmap_inode) / super.group_cnt;
+    int avg_data = nfs_bmap_avail(&super.bmap_data) / super.group_cnt;
+    int first    = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) % super.group_cnt;
+    int best     = first;
+    int i, grp;
+    for (i = 0; i < super.group_cnt; i++) {
+        grp = (first + i) % super.group_cnt;
+        if (nfs_bmap_chunk_avail(&super.bmap_inode, grp) >= avg_ino
+            && nfs_bmap_chunk_avail(&super.bmap_data, grp) >= avg_data) {
+            return grp;
         }
-        if(is_find_free_entry) {
-            break;
+        // 都低于平均值时退而选空闲inode最多的块组
+        if (nfs_bmap_chunk_avail(&super.bmap_inode, grp)
+            > nfs_bmap_chunk_avail(&super.bmap_inode, best)) {
+            best = grp;
         }
     }
-    // 没找到或已经超过最大值
-    if (!is_find_free_entry || ino_cur >= super.max_ino) {
-        return -NFS_ERROR_NOSPACE;   // error no space
-    }
+    return best;
+}
 
-    inode = (struct nfs_inode*)malloc(sizeof(struct nfs_inode));
-    inode->ino  = ino_cur;
-    inode->size = 0;
+/**
+ * @brief 分配一个inode，占用位图。文件放在父目录所在的块组，目录分散到各个块组
+ * 
+ * @param dentry 该dentry指向分配的inode
+ * @return nfs_inode 没有空闲inode时返回NULL
+ */
+struct nfs_inode* nfs_alloc_inode(struct nfs_dentry * dentry) {
+    struct nfs_inode* inode;
+    int grp = 0;
+    int ino_cur;
 
-    dentry->inode = inode;
-    dentry->ino   = inode->ino;
+    if (dentry->parent) {
+        grp = dentry->ftype == NFS_DIR ? nfs_dir_group() : NFS_INO_GROUP(dentry->parent->ino);
+    }
+    ino_cur = nfs_bmap_alloc(&super.bmap_inode, grp * super.ino_per_group);
 
-    inode->dentry = dentry;
+    if (ino_cur < 0) {
+        return NULL;   // error no space
+    }
 
-    inode->dir_cnt = 0;
-    inode->dentrys = NULL;
-    // 所有指针初始化为-1
-    memset(inode->blocks, -1, sizeof(int)*NFS_BLK_PER_FILE);
-    // 若不为目录则为文件申请数据空间
-    if (!NFS_IS_DIR(inode)) {
-        inode->data = (uint8_t*)malloc(NFS_BLK_SZ() * NFS_BLK_PER_FILE);
+    inode = nfs_new_inode(dentry, ino_cur);
+    if (inode == NULL) {
+        nfs_bmap_free(&super.bmap_inode, ino_cur, 1);
+        return NULL;
     }
+    // 新文件和新目录先内联在inode记录中，超出内联长度时再迁移到数据块
+    inode->is_inline = 1;
+    dentry->ino   = inode->ino;
+    __atomic_store_n(&dentry->inode, inode, __ATOMIC_RELEASE);
+    nfs_dirty_inode(inode);
+    nfs_icache_add(inode);
 
     return inode;
 }
 
 /**
- * @brief 将内存inode及其下方结构全部刷回磁盘
+ * @brief 创建目录项，名字存入将要加入的目录的名字区
  * 
- * @param inode 
- * @return int 
+ * @param dir 持有写锁的父目录inode，为NULL时name须为静态字符串，仅用于根目录
+ * @param name 
+ * @param ftype 
+ * @return struct nfs_dentry* 内存不足返回NULL
  */
-int nfs_sync_inode(struct nfs_inode * inode) {
-    struct nfs_inode_d  inode_d;
-    struct nfs_dentry*  dentry_cur;
-    struct nfs_dentry_d dentry_d;
-    
-    int ino         = inode->ino;
-    inode_d.ino     = ino;
-    inode_d.size    = inode->size;
-    inode_d.ftype   = inode->dentry->ftype;
-    inode_d.dir_cnt = inode->dir_cnt;
-    int offset, i;
-    for (i = 0; i < NFS_BLK_PER_FILE; i++) {
-        inode_d.blocks[i] = inode->blocks[i];
-    }
-    // 将inode写入磁盘
-    if (nfs_driver_write(NFS_INO_OFS(ino), (uint8_t*)&inode_d,
-                         sizeof(struct nfs_inode_d)) != NFS_ERROR_NONE) {
-        NFS_DBG("[%s] io error\n", __func__);
-        return -NFS_ERROR_IO;
+struct nfs_dentry* new_dentry(struct nfs_inode* dir, const char* name, FILE_TYPE ftype) {
+    struct nfs_dentry* dentry = (struct nfs_dentry*)nfs_slab_alloc(&super.dentry_slab);
+    if (dentry == NULL) {
+        return NULL;
     }
-    // 处理目录
-    if (NFS_IS_DIR(inode)) {
-        // dentry_cur = inode->dentrys;
-        // offset     = NFS_DATA_OFS(ino);
-        // while(dentry_cur != NULL) {
-        //     memcpy(dentry_d.name, dentry_cur->name, MAX_NAME_LEN);
-        //     dentry_d.ftype = dentry_cur->ftype;
-        //     dentry_d.ino   = dentry_cur->ino;
-        //     // 目录项内容写入数据块
-        //     if (nfs_driver_write(offset, (uint8_t*)&dentry_d,
-        //                          sizeof(struct nfs_dentry_d)) != NFS_ERROR_NONE) {
-        //         NFS_DBG("[%s] io error\n", __func__);                     
-        //         return -NFS_ERROR_IO;
-        //     }
-        //     // 递归同步该目录项指向的内存和磁盘inode
-        //     if (dentry_cur->inode != NULL) {
-        //         nfs_sync_inode(dentry_cur->inode);
-        //     }
-        //     // 遍历下一个目录项，修改偏移量
-        //     dentry_cur = dentry_cur->brother;
-        //     offset    += sizeof(struct nfs_dentry_d);
-        // }
-        int blk_cur = 0;
-        int dentry_num = 0;
-        if (inode->blocks[blk_cur] == -1) {
-            return NFS_ERROR_NONE;
+    dentry->name = dir ? nfs_name_intern(dir, name, strlen(name)) : name;
+    if (dentry->name == NULL) {
+        nfs_slab_free(&super.dentry_slab, dentry);
+        return NULL;
+    }
+    dentry->ftype = ftype;
+    dentry->ino   = -1;
+    dentry->hash  = nfs_name_hash(dentry->name, strlen(dentry->name));
+    dentry->blk   = -1;
+    return dentry;
+}
+
+/**
+ * @brief 由磁盘目录项记录建立目录项，哈希直接取自记录
+ * 
+ * @param inode 正在载入的目录inode
+ * @param dentry_d 
+ * @return struct nfs_dentry* 
+ */
+static struct nfs_dentry* nfs_dentry_from_disk(struct nfs_inode* inode,
+                                               const struct nfs_dentry_d* dentry_d) {
+    struct nfs_dentry* dentry = (struct nfs_dentry*)nfs_slab_alloc(&super.dentry_slab);
+    if (dentry == NULL) {
+        return NULL;
+    }
+    dentry->name = nfs_name_intern(inode, dentry_d->name, dentry_d->name_len);
+    if (dentry->name == NULL) {
+        nfs_slab_free(&super.dentry_slab, dentry);
+        return NULL;
+    }
+    dentry->ftype = (FILE_TYPE)dentry_d->ftype;
+    dentry->ino   = dentry_d->ino;
+    dentry->hash  = dentry_d->hash;
+    dentry->blk   = -1;
+    return dentry;
+}
+
+/**
+ * @brief 解析一个目录块中的目录项记录，目录项放回原来所在的块
+ * 
+ * @param inode 目录inode
+ * @param data 目录块内容，内联目录为inode记录中的内联区
+ * @param blk 块号
+ * @param cap 目录块长度
+ * @return int 内存不足时返回-NFS_ERROR_NOSPACE，已解析出的目录项仍挂在目录中
+ */
+static int nfs_dir_parse(struct nfs_inode* inode, const uint8_t* data, int blk, int cap) {
+    const struct nfs_dentry_d* dentry_d;
+    struct nfs_dentry*         sub_dentry;
+    int    pos;
+    for (pos = 0; pos + (int)offsetof(struct nfs_dentry_d, name) <= cap;
+         pos += NFS_DENTRY_LEN(dentry_d->name_len)) {
+        dentry_d = (const struct nfs_dentry_d*)(data + pos);
+        if (dentry_d->name_len == 0 || dentry_d->name_len >= MAX_NAME_LEN
+            || pos + NFS_DENTRY_LEN(dentry_d->name_len) > cap) {
+            break;
         }
-        dentry_cur = inode->dentrys;
-        offset     = NFS_DATA_OFS(inode->blocks[blk_cur]);
-        while(dentry_cur != NULL) {
-            // 当前块放不下目录项，存进下一个块
-            if (dentry_num >= super.max_dentry) {
-                blk_cur++;
-                dentry_num = 0;
-                offset = NFS_DATA_OFS(inode->blocks[blk_cur]);
-            }
-            memcpy(dentry_d.name, dentry_cur->name, MAX_NAME_LEN);
-            dentry_d.ftype = dentry_cur->ftype;
-            dentry_d.ino   = dentry_cur->ino;
-            // 目录项内容写入数据块
-            if (nfs_driver_write(offset, (uint8_t*)&dentry_d,
-                                 sizeof(struct nfs_dentry_d)) != NFS_ERROR_NONE) {
-                NFS_DBG("[%s] io error\n", __func__);                     
-                return -NFS_ERROR_IO;
-            }
-            // 递归同步该目录项指向的内存和磁盘inode
-            if (dentry_cur->inode != NULL) {
-                nfs_sync_inode(dentry_cur->inode);
-            }
-            // 遍历下一个目录项，修改偏移量
-            dentry_cur = dentry_cur->brother;
-            offset    += sizeof(struct nfs_dentry_d);
-            dentry_num++;
-        }
-    } else {  
-        // 处理文件，将整个文件写入磁盘
-        // if (nfs_driver_write(NFS_DATA_OFS(ino), inode->data,
-        //                      NFS_BLK_SZ() * NFS_BLK_PER_FILE) != NFS_ERROR_NONE) {
-        //     NFS_DBG("[%s] io error\n", __func__);
-        //     return -NFS_ERROR_IO;
-        // }
-        for (i = 0; i < inode->size; i++) {
-            if (nfs_driver_write(NFS_DATA_OFS(inode->blocks[i]), 
-                inode->data + i * NFS_BLK_SZ(), NFS_BLK_SZ()) != NFS_ERROR_NONE) {
-                NFS_DBG("[%s] io error\n", __func__);
-                return -NFS_ERROR_IO;
-            }
+        sub_dentry = nfs_dentry_from_disk(inode, dentry_d);
+        if (sub_dentry == NULL) {
+            return -NFS_ERROR_NOSPACE;
+        }
+        sub_dentry->parent = inode->dentry;
+        if (nfs_dir_link(inode, sub_dentry, blk) != NFS_ERROR_NONE) {
+            nfs_slab_free(&super.dentry_slab, sub_dentry);
+            return -NFS_ERROR_NOSPACE;
         }
     }
     return NFS_ERROR_NONE;
@@ -158,70 +174,136 @@ int nfs_sync_inode(struct nfs_inode * inode) {
 /**
  * @brief 
  * 
+ * 设备映射在内存中时，磁盘inode和目录块原地解析，不拷贝
+ * 
  * @param dentry dentry指向ino，读取该inode
  * @param ino inode唯一编号
- * @return struct nfs_inode* 
+ * @return struct nfs_inode* 读盘失败或内存不足返回NULL，已分配的结构都已释放
  */
 struct nfs_inode*  nfs_read_inode(struct nfs_dentry * dentry, int ino) {
-    struct nfs_inode* inode = (struct nfs_inode*)malloc(sizeof(struct nfs_inode));
-    struct nfs_inode_d  inode_d;
-    struct nfs_dentry*  sub_dentry;
-    struct nfs_dentry_d dentry_d;
-    int    dir_cnt = 0, i;
-    if (nfs_driver_read(NFS_INO_OFS(ino), (uint8_t*)&inode_d,
-                        sizeof(struct nfs_inode_d)) != NFS_ERROR_NONE) {
+    struct nfs_inode*          inode;
+    struct nfs_inode_d         inode_buf;
+    const struct nfs_inode_d*  inode_d;
+    struct nfs_iolist          list;
+    uint8_t*                   dir_buf = NULL;
+    uint8_t**                  dir_blks;
+    int    blk_cnt, i;
+    inode_d = (const struct nfs_inode_d*)nfs_driver_map(NFS_INO_OFS(ino),
+                                                        sizeof(struct nfs_inode_d));
+    if (inode_d == NULL) {
+        if (nfs_driver_read(NFS_INO_OFS(ino), (uint8_t*)&inode_buf,
+                            sizeof(struct nfs_inode_d)) != NFS_ERROR_NONE) {
+            NFS_DBG("[%s] io error\n", __func__);
+            return NULL;
+        }
+        inode_d = &inode_buf;
+    }
+    inode = nfs_new_inode(dentry, inode_d->ino);
+    if (inode == NULL) {
+        return NULL;
+    }
+    inode->size = inode_d->size;
+    if (nfs_extent_load(inode, inode_d) != NFS_ERROR_NONE) {
         NFS_DBG("[%s] io error\n", __func__);
+        nfs_inode_release(inode);
         return NULL;
     }
-    inode->dir_cnt = 0;
-    inode->ino     = inode_d.ino;
-    inode->size    = inode_d.size;
-    inode->dentry  = dentry;
-    inode->dentrys = NULL;
-    for (i = 0; i < NFS_BLK_PER_FILE; i++) {
-        inode->blocks[i] = inode_d.blocks[i];
+    memset(&list, 0, sizeof(struct nfs_iolist));
+    // 内联的数据随inode记录一起读出，不再访问数据块
+    if (inode_d->flags & NFS_INODE_F_INLINE) {
+        inode->is_inline = 1;
+        if (NFS_IS_DIR(inode)) {
+            if (nfs_dir_blks_reserve(inode, 1) != NFS_ERROR_NONE) {
+                nfs_inode_release(inode);
+                return NULL;
+            }
+            // 少了目录项的目录写回时会丢掉它们，解析不完整就不能载入
+            if (nfs_dir_parse(inode, inode_d->data, 0, NFS_INODE_INLINE) != NFS_ERROR_NONE) {
+                nfs_dirty_clear(inode);
+                nfs_inode_reclaim(inode);
+                return NULL;
+            }
+            nfs_dirty_clear(inode);
+        } else if (inode->size > 0) {
+            inode->inline_data = (uint8_t*)malloc(inode->size);
+            if (inode->inline_data == NULL) {
+                nfs_inode_release(inode);
+                return NULL;
+            }
+            memcpy(inode->inline_data, inode_d->data, inode->size);
+        }
+        return inode;
     }
     if (NFS_IS_DIR(inode)) {
-        dir_cnt = inode_d.dir_cnt;
-        for (i = 0; i < dir_cnt; i++) {
-            // 遍历每一个目录项
-            if (nfs_driver_read(NFS_DATA_OFS(ino) + i * sizeof(struct nfs_dentry_d),
-               (uint8_t*)&dentry_d, sizeof(struct nfs_dentry_d)) != NFS_ERROR_NONE) {
+        blk_cnt = inode->blk_cnt;
+        if (blk_cnt == 0) {
+            return inode;
+        }
+        dir_blks = (uint8_t**)malloc(blk_cnt * sizeof(uint8_t*));
+        if (dir_blks == NULL || nfs_dir_blks_reserve(inode, blk_cnt) != NFS_ERROR_NONE) {
+            free(dir_blks);
+            nfs_inode_release(inode);
+            return NULL;
+        }
+        for (i = 0; i < blk_cnt; i++) {
+            dir_blks[i] = nfs_driver_map(NFS_DATA_OFS(nfs_extent_map(inode, i)), NFS_BLK_SZ());
+            if (dir_blks[i] == NULL) {
+                break;
+            }
+        }
+        // 有目录块不能原地访问时，一次向量读读出所有目录块，每个区间一段
+        if (i < blk_cnt) {
+            dir_buf = (uint8_t*)malloc(blk_cnt * NFS_BLK_SZ());
+            if (dir_buf == NULL
+                || nfs_extent_iolist(inode, &list, 0, blk_cnt, dir_buf) != NFS_ERROR_NONE
+                || nfs_driver_readv(list.iov, list.cnt) != NFS_ERROR_NONE) {
                 NFS_DBG("[%s] io error\n", __func__);
+                nfs_iolist_free(&list);
+                free(dir_buf);
+                free(dir_blks);
+                nfs_inode_release(inode);
                 return NULL;
             }
-            sub_dentry = new_dentry(dentry_d.name, dentry_d.ftype);
-            sub_dentry->parent = inode->dentry;
-            sub_dentry->ino    = dentry_d.ino;
-            nfs_alloc_dentry(inode, sub_dentry);
+            for (i = 0; i < blk_cnt; i++) {
+                dir_blks[i] = dir_buf + i * NFS_BLK_SZ();
+            }
         }
-    } else {
-        // 读取文件
-        inode->data = (uint8_t*)malloc(NFS_BLK_PER_FILE * NFS_BLK_SZ());
-        // if (nfs_driver_read(NFS_DATA_OFS(ino), (uint8_t*)inode->data,
-        //                     NFS_BLK_PER_FILE * NFS_BLK_SZ()) != NFS_ERROR_NONE) {
-        //     NFS_DBG("[%s] io error\n", __func__);
-        //     return NULL;
-        // }
-        for (i = 0; i < inode->size; i++) {
-            if (nfs_driver_read(NFS_DATA_OFS(inode->blocks[i]), 
-                inode->data + i * NFS_BLK_SZ(), NFS_BLK_SZ()) != NFS_ERROR_NONE) {
-                NFS_DBG("[%s] io error\n", __func__);
-                return -NFS_ERROR_IO;
+        for (i = 0; i < blk_cnt; i++) {
+            if (nfs_dir_parse(inode, dir_blks[i], i, NFS_BLK_SZ()) != NFS_ERROR_NONE) {
+                break;
             }
         }
+        free(dir_buf);
+        free(dir_blks);
+        // 与磁盘一致，重建目录项不算改动
+        nfs_dirty_clear(inode);
+        if (i < blk_cnt) {
+            nfs_iolist_free(&list);
+            nfs_inode_reclaim(inode);
+            return NULL;
+        }
     }
+    // 文件数据在读写时才按块载入
+    nfs_iolist_free(&list);
     return inode;
 }
 
 /**
- * @brief 为一个inode分配dentry，采用头插法
+ * @brief 把目录项挂入目录的第blk个数据块，采用头插法
  * 
- * @param inode 
+ * @param inode 目录inode，已有blk+1个目录块的位置
  * @param dentry 
- * @return int 
+ * @param blk 
+ * @return int 哈希索引扩容失败时撤销挂入，返回-NFS_ERROR_NOSPACE
  */
-int nfs_alloc_dentry(struct nfs_inode* inode, struct nfs_dentry* dentry) {
+int nfs_dir_link(struct nfs_inode* inode, struct nfs_dentry* dentry, int blk) {
+    dentry->blk      = blk;
+    dentry->blk_next = inode->dir_blk_dentrys[blk];
+    inode->dir_blk_dentrys[blk] = dentry;
+    inode->dir_blk_used[blk] += NFS_DENTRY_LEN(strlen(dentry->name));
+    inode->names.live        += strlen(dentry->name) + 1;
+    nfs_dirty_dir_block(inode, blk);
+    nfs_dirty_inode(inode);
     if (inode->dentrys == NULL) {
         inode->dentrys = dentry;
     }
@@ -229,38 +311,477 @@ int nfs_alloc_dentry(struct nfs_inode* inode, struct nfs_dentry* dentry) {
         dentry->brother = inode->dentrys;
         inode->dentrys = dentry;
     }
-    // 数据块已满
-    if (inode->dir_cnt % super.max_dentry == 0) {
-        int blk_num = inode->dir_cnt / super.max_dentry;
-        if (blk_num == 6) {
-            return NFS_ERROR_NOSPACE;
-        }
-        int byte_cur, bit_cur;
-        int blk_cur = 0;
-        int is_find = 0;
-        for (byte_cur = 0; byte_cur < super.map_data_blks * NFS_BLK_SZ(); byte_cur++) {
-            for (bit_cur = 0; bit_cur < UINT8_BITS; bit_cur++) {
-                // inode位图当前位置空闲
-                if ((super.map_data[byte_cur] & (0x1 << bit_cur)) == 0) {
-                    super.map_data[byte_cur] |= (0x1 << bit_cur);
-                    is_find = 1;
-                    break;
-                }
-                blk_cur++;
+    // 两个链表都是头插，摘掉表头即可撤销。只有持锁路径遍历这两个链表，
+    // 目录项不在索引中，无锁的查找看不到它。多出的脏标记只会多写一次
+    if (nfs_dir_index_insert(inode, dentry) != NFS_ERROR_NONE) {
+        inode->dentrys              = dentry->brother;
+        inode->dir_blk_dentrys[blk] = dentry->blk_next;
+        inode->dir_blk_used[blk]   -= NFS_DENTRY_LEN(strlen(dentry->name));
+        inode->names.live          -= strlen(dentry->name) + 1;
+        dentry->blk      = -1;
+        dentry->blk_next = NULL;
+        dentry->brother  = NULL;
+        return -NFS_ERROR_NOSPACE;
+    }
+    inode->dir_cnt++;
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 为一个inode分配dentry，采用头插法
+ * 
+ * 目录项记录是变长的，先尝试最后一个目录块，放不下时再找删除目录项后
+ * 空出足够空间的块，都没有才扩展新块。内联目录放不下时先迁移到数据块
+ * 
+ * @param inode 
+ * @param dentry 
+ * @return int 
+ */
+int nfs_alloc_dentry(struct nfs_inode* inode, struct nfs_dentry* dentry) {
+    int len = NFS_DENTRY_LEN(strlen(dentry->name));
+    int blk;
+    if (inode->is_inline) {
+        if (nfs_dir_blks_reserve(inode, 1) != NFS_ERROR_NONE) {
+            return -NFS_ERROR_NOSPACE;
+        }
+        if (inode->dir_blk_used[0] + len <= NFS_INODE_INLINE) {
+            if (nfs_dir_link(inode, dentry, 0) != NFS_ERROR_NONE) {
+                return -NFS_ERROR_NOSPACE;
             }
-            if(is_find) {
+            return inode->dir_cnt;
+        }
+        if (nfs_inline_migrate(inode) != NFS_ERROR_NONE) {
+            return -NFS_ERROR_NOSPACE;
+        }
+    }
+    blk = inode->blk_cnt - 1;
+    if (blk < 0 || inode->dir_blk_used[blk] + len > NFS_BLK_SZ()) {
+        for (blk = 0; blk < inode->blk_cnt; blk++) {
+            if (inode->dir_blk_used[blk] + len <= NFS_BLK_SZ()) {
                 break;
             }
         }
-        if (!is_find || blk_cur >= super.max_data) {
+    }
+    if (blk == inode->blk_cnt) {
+        if (nfs_dir_blks_reserve(inode, blk + 1) != NFS_ERROR_NONE
+            || nfs_extent_grow(inode, 1) != NFS_ERROR_NONE) {
             return -NFS_ERROR_NOSPACE;   // error no space
         }
-        inode->blocks[blk_num] = blk_cur;
     }
-    inode->dir_cnt++;
+    if (nfs_dir_link(inode, dentry, blk) != NFS_ERROR_NONE) {
+        return -NFS_ERROR_NOSPACE;
+    }
     return inode->dir_cnt;
 }
 
+/**
+ * @brief 将目录项从目录中摘除，不释放目录项本身
+ * 
+ * @param inode 目录inode
+ * @param dentry 
+ * @return int 
+ */
+int nfs_drop_dentry(struct nfs_inode* inode, struct nfs_dentry* dentry) {
+    struct nfs_dentry** cur = &inode->dentrys;
+    while (*cur && *cur != dentry) {
+        cur = &(*cur)->brother;
+    }
+    if (*cur == NULL) {
+        return -NFS_ERROR_NOTFOUND;
+    }
+    *cur = dentry->brother;
+    nfs_dir_index_remove(inode, dentry);
+    // 只有所在的目录块改变，空出的空间留给之后的目录项
+    for (cur = &inode->dir_blk_dentrys[dentry->blk]; *cur != dentry; cur = &(*cur)->blk_next) {
+    }
+    *cur = dentry->blk_next;
+    inode->dir_blk_used[dentry->blk] -= NFS_DENTRY_LEN(strlen(dentry->name));
+    inode->names.live                -= strlen(dentry->name) + 1;
+    nfs_dirty_dir_block(inode, dentry->blk);
+    nfs_dirty_inode(inode);
+    dentry->blk      = -1;
+    dentry->blk_next = NULL;
+    dentry->brother  = NULL;
+    dentry->parent   = NULL;
+    inode->dir_cnt--;
+    inode->dir_gen++;
+    return inode->dir_cnt;
+}
+
+/**
+ * @brief 释放只有持锁路径会访问的inode结构：目录块链表、内联数据和区间
+ * 
+ * @param inode 
+ */
+static void nfs_inode_drop_data(struct nfs_inode* inode) {
+    if (NFS_IS_DIR(inode)) {
+        free(inode->dir_blk_dentrys);
+        free(inode->dir_blk_used);
+        free(inode->dir_dirty);
+        inode->dir_blk_dentrys = NULL;
+        inode->dir_blk_used    = NULL;
+        inode->dir_dirty       = NULL;
+        inode->dir_blk_cap     = 0;
+    } else {
+        free(inode->inline_data);
+        inode->inline_data = NULL;
+    }
+    nfs_extent_destroy(inode);
+}
+
+/**
+ * @brief 释放无锁的查找可能仍在访问的inode结构：inode本身、目录索引和
+ *        子目录项的名字
+ * 
+ * @param inode 
+ */
+static void nfs_inode_free(struct nfs_inode* inode) {
+    free(inode->dir_hash);
+    nfs_name_destroy(inode);
+    pthread_rwlock_destroy(&inode->lock);
+    nfs_slab_free(&super.inode_slab, inode);
+}
+
+/**
+ * @brief 释放inode及其全部结构，用于卸载时和读入失败时。卸载时目录项随
+ *        对象缓存一并释放，调用前改动已写回，不再有查找进行
+ * 
+ * @param inode 
+ */
+void nfs_inode_release(struct nfs_inode* inode) {
+    if (!NFS_IS_DIR(inode)) {
+        nfs_page_truncate(inode, 0);
+    }
+    nfs_inode_drop_data(inode);
+    nfs_inode_free(inode);
+}
+
+/**
+ * @brief 延迟释放的部分：无锁的查找可能仍持有目录项、inode、目录索引和
+ *        子目录项的名字
+ * 
+ * @param arg 目录项
+ */
+static void nfs_dentry_reclaim(void* arg) {
+    struct nfs_dentry* dentry = (struct nfs_dentry*)arg;
+    if (dentry->inode) {
+        nfs_inode_free(dentry->inode);
+    }
+    nfs_slab_free(&super.dentry_slab, dentry);
+}
+
+/**
+ * @brief 释放目录项及其已加载的inode
+ * 
+ * 数据页、区间等只有持锁路径会访问的结构立即释放；目录项、inode和目录索引
+ * 在已进入读侧临界区的查找都结束后才释放
+ * 
+ * @param dentry 
+ */
+void nfs_free_dentry(struct nfs_dentry* dentry) {
+    struct nfs_inode* inode = dentry->inode;
+    if (inode) {
+        nfs_icache_del(inode);
+        nfs_inode_wrlock(inode);
+        nfs_dirty_clear(inode);
+        if (!NFS_IS_DIR(inode)) {
+            nfs_page_truncate(inode, 0);
+        }
+        nfs_inode_drop_data(inode);
+        nfs_inode_unlock(inode);
+    }
+    nfs_rcu_retire(dentry, nfs_dentry_reclaim);
+}
+
+/**
+ * @brief 延迟释放被回收的inode，目录的子目录项随之释放
+ * 
+ * @param arg inode
+ */
+static void nfs_inode_reclaim(void* arg) {
+    struct nfs_inode*  inode = (struct nfs_inode*)arg;
+    struct nfs_dentry* child;
+    if (NFS_IS_DIR(inode)) {
+        while (inode->dentrys) {
+            child          = inode->dentrys;
+            inode->dentrys = child->brother;
+            nfs_slab_free(&super.dentry_slab, child);
+        }
+    }
+    nfs_inode_drop_data(inode);
+    nfs_inode_free(inode);
+}
+
+/**
+ * @brief 回收一个干净的inode，目录项留在父目录中，下次访问时经由
+ *        nfs_inode_get重新读入。目录的子目录项一并回收
+ * 
+ * 无锁的查找可能仍在读inode、目录索引和子目录项，它们在读侧临界区都结束后
+ * 才释放；文件页挂在全局的页缓存链表上，立即丢弃
+ * 
+ * @param inode 不在脏inode链表中的inode，目录的子目录项均未加载inode。
+ *              调用者独占命名空间锁
+ * @return long 估计释放的内存(字节)
+ */
+long nfs_evict_inode(struct nfs_inode* inode) {
+    struct nfs_name_chunk* chunk;
+    struct nfs_dentry*     child;
+    long freed = super.inode_slab.obj_sz;
+
+    if (NFS_IS_DIR(inode)) {
+        nfs_dcache_invalidate_children(inode);
+        for (child = inode->dentrys; child; child = child->brother) {
+            freed += super.dentry_slab.obj_sz;
+        }
+        for (chunk = inode->names.chunks; chunk; chunk = chunk->next) {
+            freed += sizeof(struct nfs_name_chunk) + chunk->size;
+        }
+    } else {
+        nfs_page_truncate(inode, 0);
+    }
+    __atomic_store_n(&inode->dentry->inode, NULL, __ATOMIC_RELEASE);
+    nfs_rcu_retire(inode, nfs_inode_reclaim);
+    return freed;
+}
+
+/**
+ * @brief 文件末尾再增加n个块。少量追加的块推迟到写回时分配，攒下的块一次
+ *        分配得到连续区间；推迟的块超过上限、或页缓存容不下更多没有数据块
+ *        的页时，连同已推迟的块立即分配
+ * 
+ * @param inode 文件inode
+ * @param n 
+ * @return int 
+ */
+static int nfs_file_grow(struct nfs_inode* inode, int n) {
+    if (inode->delay_cnt + n <= NFS_DELALLOC_MAX && n <= nfs_page_delay_room()) {
+        return nfs_extent_delay(inode, n);
+    }
+    return nfs_extent_delalloc(inode, n);
+}
+
+/**
+ * @brief 把内联的数据迁移到新分配的数据块，之后按普通文件或目录处理
+ * 
+ * @param inode 内联的文件或目录，内联数据不超过一块
+ * @return int 
+ */
+int nfs_inline_migrate(struct nfs_inode* inode) {
+    if ((NFS_IS_DIR(inode) ? nfs_extent_grow(inode, 1) : nfs_file_grow(inode, 1))
+        != NFS_ERROR_NONE) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    inode->is_inline = 0;
+    if (NFS_IS_DIR(inode)) {
+        // 内存中的目录项本就记在第0块，原样写入新块即可
+        nfs_dirty_dir_block(inode, 0);
+    } else {
+        if (nfs_page_zero(inode, 0, 1) != NFS_ERROR_NONE
+            || nfs_page_write(inode, inode->inline_data, 0, inode->size) != NFS_ERROR_NONE) {
+            nfs_page_truncate(inode, 0);
+            nfs_extent_truncate(inode, 0);
+            inode->is_inline = 1;
+            return -NFS_ERROR_NOSPACE;
+        }
+        free(inode->inline_data);
+        inode->inline_data = NULL;
+    }
+    nfs_dirty_inode(inode);
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 改变文件大小，按需分配或释放数据块，扩大的部分填0。不超过内联长度
+ *        的内联文件只改内联区；截断为空的文件重新内联。文件末尾之后预分配
+ *        的块扩大时直接使用，截断时一并释放
+ * 
+ * @param inode 文件inode
+ * @param size 新的大小(字节)
+ * @return int 
+ */
+int nfs_inode_resize(struct nfs_inode* inode, int size) {
+    int blk_cnt = (size + NFS_BLK_SZ() - 1) / NFS_BLK_SZ();
+    int tail    = size % NFS_BLK_SZ();
+    int old_cnt, have;
+
+    if (size < 0) {
+        return -NFS_ERROR_INVAL;
+    }
+    if (inode->is_inline) {
+        if (size <= NFS_INODE_INLINE) {
+            // 内联数据的缓冲区与文件一样大，扩大的部分填0
+            if (size != inode->size) {
+                uint8_t* data = size ? (uint8_t*)realloc(inode->inline_data, size) : NULL;
+                if (size && data == NULL) {
+                    return -NFS_ERROR_NOSPACE;
+                }
+                if (size == 0) {
+                    free(inode->inline_data);
+                }
+                if (size > inode->size) {
+                    memset(data + inode->size, 0, size - inode->size);
+                }
+                inode->inline_data = data;
+            }
+            inode->size = size;
+            nfs_dirty_inode(inode);
+            return NFS_ERROR_NONE;
+        }
+        if (nfs_inline_migrate(inode) != NFS_ERROR_NONE) {
+            return -NFS_ERROR_NOSPACE;
+        }
+    }
+    old_cnt = (inode->size + NFS_BLK_SZ() - 1) / NFS_BLK_SZ();
+    have    = inode->blk_cnt + inode->delay_cnt;
+    if (blk_cnt > old_cnt) {
+        if (blk_cnt > have && nfs_file_grow(inode, blk_cnt - have) != NFS_ERROR_NONE) {
+            return -NFS_ERROR_NOSPACE;
+        }
+        // 新块和预分配块的磁盘内容无意义，直接作为全0页
+        if (nfs_page_zero(inode, old_cnt, blk_cnt) != NFS_ERROR_NONE) {
+            nfs_page_truncate(inode, old_cnt);
+            nfs_extent_truncate(inode, have);
+            return -NFS_ERROR_NOSPACE;
+        }
+    } else if (size < inode->size) {
+        nfs_page_truncate(inode, blk_cnt);
+        nfs_extent_truncate(inode, blk_cnt);
+        // 最后一块中超出文件末尾的部分保持为0，之后扩展文件时无需再清零
+        if (tail != 0) {
+            uint8_t* zero = (uint8_t*)calloc(1, NFS_BLK_SZ() - tail);
+            if (zero == NULL
+                || nfs_page_write(inode, zero, size, NFS_BLK_SZ() - tail) != NFS_ERROR_NONE) {
+                free(zero);
+                return -NFS_ERROR_IO;
+            }
+            free(zero);
+        }
+        if (size == 0) {
+            inode->is_inline = 1;
+        }
+    }
+    inode->size = size;
+    nfs_dirty_inode(inode);
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 预先为文件分配到end为止的数据块。推迟分配的块先一起分配，新块紧接
+ *        其后尽量连续，之后的追加写直接使用这些块
+ * 
+ * @param inode 文件inode
+ * @param end 分配到的位置(字节)
+ * @param keep_size 非0时不改变文件大小，末尾之后的块保留到截断或删除
+ * @return int 
+ */
+int nfs_inode_prealloc(struct nfs_inode* inode, int end, int keep_size) {
+    int blk_cnt = (end + NFS_BLK_SZ() - 1) / NFS_BLK_SZ();
+    int have;
+
+    if (inode->is_inline) {
+        // 内联区中的数据不占数据块
+        if (end <= NFS_INODE_INLINE) {
+            return keep_size || end <= inode->size ? NFS_ERROR_NONE
+                                                   : nfs_inode_resize(inode, end);
+        }
+        if (nfs_inline_migrate(inode) != NFS_ERROR_NONE) {
+            return -NFS_ERROR_NOSPACE;
+        }
+    }
+    have = inode->blk_cnt + inode->delay_cnt;
+    if (nfs_extent_delalloc(inode, blk_cnt > have ? blk_cnt - have : 0) != NFS_ERROR_NONE) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    if (!keep_size && end > inode->size) {
+        return nfs_inode_resize(inode, end);
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 保证目录至少有n个目录块的位置
+ * 
+ * @param inode 目录inode
+ * @param n 
+ * @return int 
+ */
+int nfs_dir_blks_reserve(struct nfs_inode* inode, int n) {
+    struct nfs_dentry** dentrys;
+    int*     used;
+    uint8_t* dirty;
+    int cap = inode->dir_blk_cap ? inode->dir_blk_cap : 1;
+    if (n <= inode->dir_blk_cap) {
+        return NFS_ERROR_NONE;
+    }
+    while (cap < n) {
+        cap *= 2;
+    }
+    dentrys = (struct nfs_dentry**)realloc(inode->dir_blk_dentrys,
+                                           cap * sizeof(struct nfs_dentry*));
+    if (dentrys == NULL) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    inode->dir_blk_dentrys = dentrys;
+    used = (int*)realloc(inode->dir_blk_used, cap * sizeof(int));
+    if (used == NULL) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    inode->dir_blk_used = used;
+    dirty = (uint8_t*)realloc(inode->dir_dirty, cap);
+    if (dirty == NULL) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    memset(dentrys + inode->dir_blk_cap, 0,
+           (cap - inode->dir_blk_cap) * sizeof(struct nfs_dentry*));
+    memset(used + inode->dir_blk_cap, 0, (cap - inode->dir_blk_cap) * sizeof(int));
+    memset(dirty + inode->dir_blk_cap, 0, cap - inode->dir_blk_cap);
+    inode->dir_dirty   = dirty;
+    inode->dir_blk_cap = cap;
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 删除文件或目录时调用，在位图中释放它的inode和数据块，再释放内存结构
+ * 
+ * 目录须已为空，调用前应先用nfs_drop_dentry将其从父目录摘除。还有目录句柄
+ * 打开着的目录只释放磁盘上的inode和数据块，内存结构留给句柄读到空目录，
+ * 最后一个句柄关闭时由nfs_dir_handle_put释放。调用者独占命名空间锁
+ * 
+ * @param dentry 
+ * @return int 
+ */
+int nfs_release_dentry(struct nfs_dentry* dentry) {
+    struct nfs_inode* inode = nfs_inode_get(dentry);
+    if (inode == NULL) {
+        NFS_DBG("[%s] io error\n", __func__);
+        return -NFS_ERROR_IO;
+    }
+    nfs_extent_release(inode);
+    nfs_bmap_free(&super.bmap_inode, inode->ino, 1);
+    if (__atomic_load_n(&inode->pin, __ATOMIC_ACQUIRE) > 0) {
+        // inode号可能马上被重用，已删除的inode不能再写回
+        nfs_dirty_clear(inode);
+        inode->removed = 1;
+        return NFS_ERROR_NONE;
+    }
+    nfs_free_dentry(dentry);
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 关闭目录句柄时放开对目录的pin。目录已被删除且这是最后一个句柄时
+ *        释放它的内存结构。调用者共享持有命名空间锁，与删除互斥；
+ *        已删除的目录不在目录树中，只有句柄还引用它
+ * 
+ * @param dentry 句柄打开的目录
+ */
+void nfs_dir_handle_put(struct nfs_dentry* dentry) {
+    struct nfs_inode* inode = dentry->inode;
+    if (__atomic_sub_fetch(&inode->pin, 1, __ATOMIC_ACQ_REL) == 0 && inode->removed) {
+        nfs_free_dentry(dentry);
+    }
+}
+
 /**
  * @brief 获取第dir个目录项
  * 
@@ -280,4 +801,101 @@ struct nfs_dentry* nfs_get_dentry(struct nfs_inode * inode, int dir) {
         dentry_cur = dentry_cur->brother;
     }
     return NULL;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief 将目录项加入目录的哈希索引，目录项数超过桶数时扩容一倍
+ * 
+ * 无锁的查找可能同时在遍历索引：新表先建好再发布，旧表延迟释放；
+ * 链表头用release写入，读者看到目录项时它已初始化完成
+ * 
+ * @param inode 目录inode
+ * @param dentry 
+ * @return int 
+ */
+int nfs_dir_index_insert(struct nfs_inode* inode, struct nfs_dentry* dentry) {
+    struct nfs_dentry** table;
+    struct nfs_dentry** old;
+    struct nfs_dentry*  cur;
+    struct nfs_dentry*  next;
+    int sz, i;
+    if (inode->dir_hash == NULL || inode->dir_cnt + 1 > inode->dir_hash_sz) {
+        sz    = inode->dir_hash_sz ? inode->dir_hash_sz * 2 : NFS_DIR_HASH_MIN;
+        table = (struct nfs_dentry**)calloc(sz, sizeof(struct nfs_dentry*));
+        if (table == NULL) {
+            return -NFS_ERROR_NOSPACE;
+        }
+        // 重新分桶。改写hash_next会让正在旧表上遍历的读者漏掉目录项，
+        // 它们随后退回持锁的查找，不会得到错误的结果
+        for (i = 0; i < inode->dir_hash_sz; i++) {
+            cur = inode->dir_hash[i];
+            while (cur) {
+                next = cur->hash_next;
+                __atomic_store_n(&cur->hash_next, table[cur->hash & (sz - 1)], __ATOMIC_RELEASE);
+                table[cur->hash & (sz - 1)] = cur;
+                cur = next;
+            }
+        }
+        // 先发布新表再发布新桶数，读者先读桶数，下标不会越过它读到的表
+        old = inode->dir_hash;
+        __atomic_store_n(&inode->dir_hash, table, __ATOMIC_RELEASE);
+        __atomic_store_n(&inode->dir_hash_sz, sz, __ATOMIC_RELEASE);
+        if (old) {
+            nfs_rcu_retire(old, free);
+        }
+    }
+    i = dentry->hash & (inode->dir_hash_sz - 1);
+    dentry->hash_next = inode->dir_hash[i];
+    __atomic_store_n(&inode->dir_hash[i], dentry, __ATOMIC_RELEASE);
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 将目录项从目录的哈希索引中摘除，目录项本身由调用者延迟释放
+ * 
+ * @param inode 目录inode
+ * @param dentry 
+ */
+void nfs_dir_index_remove(struct nfs_inode* inode, struct nfs_dentry* dentry) {
+    struct nfs_dentry** cur;
+    if (inode->dir_hash == NULL) {
+        return;
+    }
+    cur = &inode->dir_hash[dentry->hash & (inode->dir_hash_sz - 1)];
+    while (*cur) {
+        if (*cur == dentry) {
+            __atomic_store_n(cur, dentry->hash_next, __ATOMIC_RELEASE);
+            break;
+        }
+        cur = &(*cur)->hash_next;
+    }
+    __atomic_store_n(&dentry->hash_next, NULL, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief 在目录中按名字精确查找目录项。可以不持有目录的锁，在读侧临界区内调用
+ * 
+ * @param inode 目录inode
+ * @param name 
+ * @param len 名字长度
+ * @return struct nfs_dentry* 未找到返回NULL
+ */
+struct nfs_dentry* nfs_dir_lookup(struct nfs_inode* inode, const char* name, int len) {
+    uint32_t            hash = nfs_name_hash(name, len);
+    int                 sz   = __atomic_load_n(&inode->dir_hash_sz, __ATOMIC_ACQUIRE);
+    struct nfs_dentry** table;
+    struct nfs_dentry*  cur;
+    table = __atomic_load_n(&inode->dir_hash, __ATOMIC_ACQUIRE);
+    if (table == NULL || sz == 0 || len >= MAX_NAME_LEN) {
+        return NULL;
+    }
+    cur = __atomic_load_n(&table[hash & (sz - 1)], __ATOMIC_ACQUIRE);
+    while (cur) {
+        if (cur->hash == hash && strncmp(cur->name, name, len) == 0 
+            && cur->name[len] == '\0') {
+            return cur;
+        }
+        cur = __atomic_load_n(&cur->hash_next, __ATOMIC_ACQUIRE);
+    }
+    return NULL;
+}
@@ -0,0 +1,545 @@
+#include "../include/naivefs.h"
+
+/******************************************************************************
+* SECTION: 脏数据跟踪与写回
+*
+* 修改过的inode按变脏的先后挂在super.dirty_head链表上。每个inode分别记录
+* 磁盘inode是否需要写回、哪些目录块需要写回，文件数据的脏页记录在页缓存中；
+* 位图按块记录。写回时只收集这些脏的部分，文件数据合并为一次向量写，元数据
+* 合并为一个日志事务。脏inode链表和脏块计数由nfs_flusher.lock保护；写回
+* 本身在独占的命名空间锁下进行，看到的是一个一致的状态
+*******************************************************************************/
+static struct nfs_flusher nfs_flusher = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * @brief 单调时钟的秒数，不受系统时间调整影响
+ *
+ * @return time_t
+ */
+static time_t nfs_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/**
+ * @brief 将inode挂到脏inode链表尾部，并记录变脏的时间
+ *
+ * @param inode
+ */
+static void nfs_dirty_link(struct nfs_inode* inode) {
+    if (inode->on_dirty) {
+        return;
+    }
+    inode->on_dirty    = 1;
+    inode->dirty_since = nfs_now();
+    inode->dirty_next  = NULL;
+    inode->dirty_prev  = super.dirty_tail;
+    if (super.dirty_tail) {
+        super.dirty_tail->dirty_next = inode;
+    } else {
+        super.dirty_head = inode;
+    }
+    super.dirty_tail = inode;
+}
+
+/**
+ * @brief 将inode从脏inode链表上摘除
+ *
+ * @param inode
+ */
+static void nfs_dirty_unlink(struct nfs_inode* inode) {
+    if (!inode->on_dirty) {
+        return;
+    }
+    if (inode->dirty_prev) {
+        inode->dirty_prev->dirty_next = inode->dirty_next;
+    } else {
+        super.dirty_head = inode->dirty_next;
+    }
+    if (inode->dirty_next) {
+        inode->dirty_next->dirty_prev = inode->dirty_prev;
+    } else {
+        super.dirty_tail = inode->dirty_prev;
+    }
+    inode->on_dirty   = 0;
+    inode->dirty_prev = inode->dirty_next = NULL;
+}
+
+/**
+ * @brief 记录inode待写回块数的变化，脏块超过上限时唤醒写回线程
+ *
+ * @param inode
+ * @param n
+ */
+static void nfs_dirty_account(struct nfs_inode* inode, int n) {
+    inode->dirty_blks += n;
+    super.dirty_blks  += n;
+    if (n > 0 && nfs_flusher.running && nfs_flusher.dirty_limit > 0
+        && super.dirty_blks >= nfs_flusher.dirty_limit) {
+        pthread_cond_signal(&nfs_flusher.wake);
+    }
+}
+
+/**
+ * @brief 标记磁盘inode(大小、区间、目录项数等)需要写回
+ *
+ * @param inode
+ */
+void nfs_dirty_inode(struct nfs_inode* inode) {
+    pthread_mutex_lock(&nfs_flusher.lock);
+    if (!inode->dirty) {
+        inode->dirty = 1;
+        nfs_dirty_account(inode, 1);
+        __atomic_add_fetch(&super.dirty_meta, 1, __ATOMIC_RELAXED);
+    }
+    nfs_dirty_link(inode);
+    pthread_mutex_unlock(&nfs_flusher.lock);
+}
+
+/**
+ * @brief 标记目录的第blk个数据块需要写回
+ *
+ * @param inode
+ * @param blk
+ */
+void nfs_dirty_dir_block(struct nfs_inode* inode, int blk) {
+    pthread_mutex_lock(&nfs_flusher.lock);
+    if (!inode->dir_dirty[blk]) {
+        inode->dir_dirty[blk] = 1;
+        nfs_dirty_account(inode, 1);
+        __atomic_add_fetch(&super.dirty_meta, 1, __ATOMIC_RELAXED);
+    }
+    nfs_dirty_link(inode);
+    pthread_mutex_unlock(&nfs_flusher.lock);
+}
+
+/**
+ * @brief 文件的脏页数变化，具体哪些页由页缓存记录
+ *
+ * @param inode
+ * @param n 新变脏的页数，页被单独写回或丢弃时为负数
+ */
+void nfs_dirty_data(struct nfs_inode* inode, int n) {
+    pthread_mutex_lock(&nfs_flusher.lock);
+    nfs_dirty_account(inode, n);
+    if (n > 0) {
+        nfs_dirty_link(inode);
+    }
+    pthread_mutex_unlock(&nfs_flusher.lock);
+}
+
+/**
+ * @brief 丢弃inode的元数据脏标记，用于刚从磁盘读出的inode和被删除的inode
+ *
+ * @param inode
+ */
+void nfs_dirty_clear(struct nfs_inode* inode) {
+    int meta, blk;
+    pthread_mutex_lock(&nfs_flusher.lock);
+    meta         = inode->dirty;
+    inode->dirty = 0;
+    if (inode->dir_dirty) {
+        for (blk = 0; blk < inode->dir_blk_cap; blk++) {
+            meta += inode->dir_dirty[blk];
+        }
+        memset(inode->dir_dirty, 0, inode->dir_blk_cap);
+    }
+    __atomic_sub_fetch(&super.dirty_meta, meta, __ATOMIC_RELAXED);
+    nfs_dirty_account(inode, -inode->dirty_blks);
+    nfs_dirty_unlink(inode);
+    pthread_mutex_unlock(&nfs_flusher.lock);
+}
+
+/**
+ * @brief 把目录第blk块中的目录项紧密排列到buf，其后的内容保持为0
+ *
+ * @param inode
+ * @param blk
+ * @param buf 目录块或inode记录的内联区，已清零
+ */
+static void nfs_dir_pack(struct nfs_inode* inode, int blk, uint8_t* buf) {
+    struct nfs_dentry_d* dentry_d;
+    struct nfs_dentry*   dentry;
+    int pos = 0, len;
+    for (dentry = inode->dir_blk_dentrys[blk]; dentry; dentry = dentry->blk_next) {
+        len      = strlen(dentry->name);
+        dentry_d = (struct nfs_dentry_d*)(buf + pos);
+        dentry_d->ino      = dentry->ino;
+        dentry_d->hash     = dentry->hash;
+        dentry_d->ftype    = dentry->ftype;
+        dentry_d->name_len = len;
+        memcpy(dentry_d->name, dentry->name, len);
+        pos += NFS_DENTRY_LEN(len);
+    }
+}
+
+/**
+ * @brief 收集一个inode需要写回的段。元数据按整块收集，经由日志提交；文件数据
+ *        直接写回；inode记录先单独收集，提交前再拼入所在的inode表块。收集不清除
+ *        脏标记，事务提交后才由nfs_sync_clean清除，写回失败时改动留待下次写回。
+ *        调用者持有独占的命名空间锁，收集到清除之间inode不会再被修改
+ *
+ * @param inode
+ * @param meta 元数据段
+ * @param data 文件数据段
+ * @param inodes inode记录
+ * @return int
+ */
+static int nfs_sync_collect(struct nfs_inode* inode, struct nfs_iolist* meta,
+                            struct nfs_iolist* data, struct nfs_iolist* inodes) {
+    struct nfs_inode_d*  inode_d;
+    uint8_t* buf;
+    int blk;
+
+    // 推迟分配的块此时分配，写回的区间和文件页才有确定的位置
+    if (inode->delay_cnt > 0 && nfs_extent_delalloc(inode, 0) != NFS_ERROR_NONE) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    if (inode->dirty) {
+        inode_d = (struct nfs_inode_d*)nfs_iolist_alloc(inodes, NFS_INO_OFS(inode->ino),
+                                                        sizeof(struct nfs_inode_d));
+        if (inode_d == NULL) {
+            return -NFS_ERROR_NOSPACE;
+        }
+        inode_d->ino     = inode->ino;
+        inode_d->size    = inode->size;
+        inode_d->ftype   = inode->dentry->ftype;
+        inode_d->dir_cnt = inode->dir_cnt;
+        if (nfs_extent_store(inode, inode_d, meta) != NFS_ERROR_NONE) {
+            return -NFS_ERROR_NOSPACE;
+        }
+        // 内联区与区间数组共用空间
+        if (inode->is_inline) {
+            inode_d->flags = NFS_INODE_F_INLINE;
+            memset(inode_d->data, 0, NFS_INODE_INLINE);
+            if (NFS_IS_DIR(inode) && inode->dir_blk_cap > 0) {
+                nfs_dir_pack(inode, 0, inode_d->data);
+            } else if (inode->size > 0) {
+                memcpy(inode_d->data, inode->inline_data, inode->size);
+            }
+        }
+    }
+    if (NFS_IS_DIR(inode)) {
+        // 只写回有改动的目录块，块中的记录紧密排列，其后保持为0
+        for (blk = 0; blk < inode->blk_cnt; blk++) {
+            if (!inode->dir_dirty[blk]) {
+                continue;
+            }
+            buf = nfs_iolist_alloc(meta, NFS_DATA_OFS(nfs_extent_map(inode, blk)), NFS_BLK_SZ());
+            if (buf == NULL) {
+                return -NFS_ERROR_NOSPACE;
+            }
+            nfs_dir_pack(inode, blk, buf);
+        }
+    } else if (nfs_page_collect(inode, data) != NFS_ERROR_NONE) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief nfs_sync_collect收集的段已提交，清除inode的脏标记并摘出脏inode链表
+ *
+ * @param inode
+ */
+static void nfs_sync_clean(struct nfs_inode* inode) {
+    if (!NFS_IS_DIR(inode)) {
+        nfs_page_clean(inode);
+    }
+    nfs_dirty_clear(inode);
+}
+
+/**
+ * @brief 把inode记录拼入所在的inode表块。一块存放多个inode，整块提交前先
+ *        读出块中其余inode的当前内容，同一块的记录只读写一次
+ *
+ * @param inodes inode记录
+ * @param meta 元数据段
+ * @return int
+ */
+static int nfs_sync_itable(struct nfs_iolist* inodes, struct nfs_iolist* meta) {
+    struct nfs_iovec* blks;
+    uint8_t* buf;
+    int first = meta->cnt, blk_ofs = -1, i, k;
+
+    if (inodes->cnt == 0) {
+        return NFS_ERROR_NONE;
+    }
+    qsort(inodes->iov, inodes->cnt, sizeof(struct nfs_iovec), nfs_iovec_cmp);
+    // 经由块缓存逐块读出，反复写回的inode表块之后在缓存中命中
+    for (i = 0; i < inodes->cnt; i++) {
+        if (NFS_ROUND_DOWN(inodes->iov[i].offset, NFS_BLK_SZ()) == blk_ofs) {
+            continue;
+        }
+        blk_ofs = NFS_ROUND_DOWN(inodes->iov[i].offset, NFS_BLK_SZ());
+        buf     = nfs_iolist_alloc(meta, blk_ofs, NFS_BLK_SZ());
+        if (buf == NULL) {
+            return -NFS_ERROR_NOSPACE;
+        }
+        if (nfs_driver_read(blk_ofs, buf, NFS_BLK_SZ()) != NFS_ERROR_NONE) {
+            NFS_DBG("[%s] io error\n", __func__);
+            return -NFS_ERROR_IO;
+        }
+    }
+    blks = meta->iov + first;
+    // 记录与块都按偏移递增排列
+    for (i = 0, k = 0; i < inodes->cnt; i++) {
+        while (blks[k].offset + NFS_BLK_SZ() <= inodes->iov[i].offset) {
+            k++;
+        }
+        memcpy(blks[k].buf + inodes->iov[i].offset - blks[k].offset,
+               inodes->iov[i].buf, inodes->iov[i].size);
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 先写出文件数据，再收集inode表块、位图的脏块和空闲计数摘要，与其余元数据作为一个
+ *        事务提交。位图的脏标记在提交成功后才清除
+ *
+ * @param meta
+ * @param data
+ * @param inodes
+ * @return int
+ */
+static int nfs_sync_submit(struct nfs_iolist* meta, struct nfs_iolist* data,
+                           struct nfs_iolist* inodes) {
+    int ret = NFS_ERROR_NONE;
+    if (data->cnt > 0 && (nfs_journal_revoke(data->iov, data->cnt) != NFS_ERROR_NONE
+                          || nfs_driver_writev(data->iov, data->cnt) != NFS_ERROR_NONE)) {
+        NFS_DBG("[%s] io error\n", __func__);
+        return -NFS_ERROR_IO;
+    }
+    if (nfs_sync_itable(inodes, meta) != NFS_ERROR_NONE) {
+        return -NFS_ERROR_IO;
+    }
+    if (nfs_bmap_collect(&super.bmap_inode, meta) != NFS_ERROR_NONE
+        || nfs_bmap_collect(&super.bmap_data, meta) != NFS_ERROR_NONE) {
+        ret = -NFS_ERROR_NOSPACE;
+    } else if (nfs_journal_commit(meta->iov, meta->cnt) != NFS_ERROR_NONE) {
+        NFS_DBG("[%s] io error\n", __func__);
+        ret = -NFS_ERROR_IO;
+    }
+    nfs_bmap_settle(&super.bmap_inode, ret == NFS_ERROR_NONE);
+    nfs_bmap_settle(&super.bmap_data, ret == NFS_ERROR_NONE);
+    return ret;
+}
+
+/**
+ * @brief 写回一个inode的改动以及位图的改动。使用日志时写回全部脏inode：
+ *        inode、目录项和位图互相引用，只提交其中一部分的事务在重放后不一致
+ *
+ * @param inode
+ * @return int
+ */
+int nfs_sync_inode(struct nfs_inode* inode) {
+    struct nfs_iolist meta, data, inodes;
+    int ret;
+    if (super.journal_blks > 0) {
+        return nfs_sync_all();
+    }
+    memset(&meta, 0, sizeof(struct nfs_iolist));
+    memset(&data, 0, sizeof(struct nfs_iolist));
+    memset(&inodes, 0, sizeof(struct nfs_iolist));
+    ret = nfs_sync_collect(inode, &meta, &data, &inodes);
+    if (ret == NFS_ERROR_NONE) {
+        ret = nfs_sync_submit(&meta, &data, &inodes);
+    }
+    if (ret == NFS_ERROR_NONE) {
+        nfs_sync_clean(inode);
+    }
+    nfs_iolist_free(&meta);
+    nfs_iolist_free(&data);
+    nfs_iolist_free(&inodes);
+    return ret;
+}
+
+/**
+ * @brief 取脏inode链表中inode的下一个，inode为NULL时取链表头。
+ *        它在before之后才变脏时返回NULL
+ *
+ * @param inode
+ * @param before
+ * @return struct nfs_inode*
+ */
+static struct nfs_inode* nfs_dirty_next(struct nfs_inode* inode, time_t before) {
+    pthread_mutex_lock(&nfs_flusher.lock);
+    inode = inode ? inode->dirty_next : super.dirty_head;
+    if (inode && inode->dirty_since > before) {
+        inode = NULL;
+    }
+    pthread_mutex_unlock(&nfs_flusher.lock);
+    return inode;
+}
+
+/**
+ * @brief 写回在before之前(含)变脏的inode以及位图的改动
+ *
+ * @param before
+ * @return int
+ */
+int nfs_sync_expired(time_t before) {
+    struct nfs_iolist meta, data, inodes;
+    struct nfs_inode* inode = NULL;
+    int ret = NFS_ERROR_NONE, cnt = 0;
+    memset(&meta, 0, sizeof(struct nfs_iolist));
+    memset(&data, 0, sizeof(struct nfs_iolist));
+    memset(&inodes, 0, sizeof(struct nfs_iolist));
+    // 一批inode的元数据合并为一个事务(组提交)，任一inode收集失败则整批都不写回
+    while ((inode = nfs_dirty_next(inode, before)) != NULL) {
+        ret = nfs_sync_collect(inode, &meta, &data, &inodes);
+        if (ret != NFS_ERROR_NONE) {
+            break;
+        }
+        cnt++;
+    }
+    if (ret == NFS_ERROR_NONE) {
+        ret = nfs_sync_submit(&meta, &data, &inodes);
+    }
+    // 收集的inode按顺序位于链表头部，提交成功后逐个清除
+    while (ret == NFS_ERROR_NONE && cnt-- > 0) {
+        nfs_sync_clean(nfs_dirty_next(NULL, before));
+    }
+    nfs_iolist_free(&meta);
+    nfs_iolist_free(&data);
+    nfs_iolist_free(&inodes);
+    return ret;
+}
+
+/**
+ * @brief 写回所有脏inode以及位图的改动
+ *
+ * @return int
+ */
+int nfs_sync_all() {
+    time_t before;
+    // 链表按变脏时间排列，最后一个inode的时间覆盖整个链表
+    pthread_mutex_lock(&nfs_flusher.lock);
+    before = super.dirty_tail ? super.dirty_tail->dirty_since : 0;
+    pthread_mutex_unlock(&nfs_flusher.lock);
+    return nfs_sync_expired(before);
+}
+
+/**
+ * @brief 加锁的请求结束后调用。使用日志时，待提交的inode和目录块达到日志区的
+ *        四分之一就独占命名空间锁全部写回。每个inode按占一个inode表块估计，其余
+ *        空间留给区间树块、位图和摘要，使每个事务只包含完整的请求且放得进日志区。
+ *        调用者不能持有命名空间锁
+ */
+void nfs_sync_balance() {
+    if (super.journal_blks <= 0
+        || __atomic_load_n(&super.dirty_meta, __ATOMIC_RELAXED) < NFS_JNL_BATCH()) {
+        return;
+    }
+    nfs_ns_lock(NFS_LOCK_EXCL);
+    // 等锁期间写回线程可能已经写回
+    if (__atomic_load_n(&super.dirty_meta, __ATOMIC_RELAXED) >= NFS_JNL_BATCH()
+        && nfs_sync_all() != NFS_ERROR_NONE) {
+        NFS_DBG("[%s] io error\n", __func__);
+    }
+    nfs_ns_unlock();
+}
+
+/******************************************************************************
+* SECTION: 后台写回线程
+*
+* 写回线程每NFS_FLUSH_TICK秒醒来一次，写回停留超过age秒的脏inode；脏块数
+* 超过上限时由修改者提前唤醒，写回全部脏数据。使用日志时一旦有inode到期
+* 就写回全部脏inode，每个事务都是一致的快照。写回线程在nfs_flusher.lock
+* 上等待，决定写回后放开它，再像删除请求一样独占命名空间锁
+*******************************************************************************/
+
+/**
+ * @brief 写回线程主循环
+ *
+ * @param arg 未使用
+ * @return void*
+ */
+static void* nfs_flush_main(void* arg) {
+    struct timespec deadline;
+    time_t now, before;
+    int ret, all;
+    (void)arg;
+
+    pthread_mutex_lock(&nfs_flusher.lock);
+    while (!nfs_flusher.stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += NFS_FLUSH_TICK;
+        pthread_cond_timedwait(&nfs_flusher.wake, &nfs_flusher.lock, &deadline);
+        if (nfs_flusher.stop) {
+            break;
+        }
+        // 顺带释放无锁查找已不再访问的目录项
+        pthread_mutex_unlock(&nfs_flusher.lock);
+        nfs_rcu_reclaim();
+        pthread_mutex_lock(&nfs_flusher.lock);
+        now    = nfs_now();
+        before = now - nfs_flusher.age;
+        all    = nfs_flusher.dirty_limit > 0 && super.dirty_blks >= nfs_flusher.dirty_limit;
+        if (!all && !(nfs_flusher.age > 0 && super.dirty_head
+                      && super.dirty_head->dirty_since <= before)) {
+            continue;
+        }
+        pthread_mutex_unlock(&nfs_flusher.lock);
+        nfs_ns_lock(NFS_LOCK_EXCL);
+        // 位图的改动不区分属于哪个inode，使用日志时只提交到期的inode会让事务
+        // 包含新建文件的位图却缺少它的inode记录，重放后不一致，同fsync一样全部写回
+        all = all || super.journal_blks > 0;
+        ret = all ? nfs_sync_all() : nfs_sync_expired(before);
+        nfs_ns_unlock();
+        pthread_mutex_lock(&nfs_flusher.lock);
+        // 写回失败的改动仍留在脏inode链表上，下一轮重试
+        if (ret != NFS_ERROR_NONE) {
+            NFS_DBG("[%s] io error, retry next round\n", __func__);
+        }
+        nfs_flusher.rounds++;
+    }
+    pthread_mutex_unlock(&nfs_flusher.lock);
+    return NULL;
+}
+
+/**
+ * @brief 启动后台写回线程，dirty_kb和age都为0时不启动
+ *
+ * @param dirty_kb 脏数据上限(KB)
+ * @param age 脏数据最长停留时间(秒)
+ * @return int
+ */
+int nfs_flush_start(int dirty_kb, int age) {
+    nfs_flusher.dirty_limit = 0;
+    nfs_flusher.age         = age > 0 ? age : 0;
+    nfs_flusher.stop        = 0;
+    nfs_flusher.rounds      = 0;
+    if (dirty_kb > 0) {
+        nfs_flusher.dirty_limit = dirty_kb * 1024 / NFS_BLK_SZ();
+        nfs_flusher.dirty_limit = nfs_flusher.dirty_limit > 0 ? nfs_flusher.dirty_limit : 1;
+    }
+    if (nfs_flusher.dirty_limit == 0 && nfs_flusher.age == 0) {
+        return NFS_ERROR_NONE;
+    }
+    if (pthread_create(&nfs_flusher.thread, NULL, nfs_flush_main, NULL) != 0) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    nfs_flusher.running = 1;
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 停止后台写回线程，剩余的脏数据由调用者写回
+ */
+void nfs_flush_stop() {
+    if (!nfs_flusher.running) {
+        return;
+    }
+    pthread_mutex_lock(&nfs_flusher.lock);
+    nfs_flusher.stop = 1;
+    pthread_cond_signal(&nfs_flusher.wake);
+    pthread_mutex_unlock(&nfs_flusher.lock);
+    pthread_join(nfs_flusher.thread, NULL);
+    nfs_flusher.running = 0;
+    NFS_DBG("[%s] %d rounds\n", __func__, nfs_flusher.rounds);
+}
@@ -0,0 +1,305 @@
+#include "../include/naivefs.h"
+
+/******************************************************************************
+* SECTION: io_uring后端
+*
+* 磁盘镜像文件经由io_uring访问，一批段拆成不超过NFS_URING_CHUNK的请求，
+* 最多NFS_URING_QD个请求同时在途，一次io_uring_enter批量提交并收割
+*******************************************************************************/
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define NFS_HAVE_URING
+#endif
+#endif
+
+#ifdef NFS_HAVE_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+struct nfs_uring {
+    int                   ring_fd;
+    unsigned              entries;
+    unsigned*             sq_head;
+    unsigned*             sq_tail;
+    unsigned*             sq_mask;
+    unsigned*             sq_array;
+    unsigned*             cq_head;
+    unsigned*             cq_tail;
+    unsigned*             cq_mask;
+    struct io_uring_sqe*  sqes;
+    struct io_uring_cqe*  cqes;
+    void*                 sq_ptr;
+    size_t                sq_sz;
+    void*                 cq_ptr;
+    size_t                cq_sz;
+    size_t                sqes_sz;
+    int                   broken;            // 在途的请求无法收割，之后改为同步读写
+};
+
+struct nfs_uring_req {
+    struct iovec          vec;               // 本次请求的缓冲区
+    int                   offset;            // 磁盘偏移
+};
+
+static struct nfs_uring nfs_uring;
+
+/**
+ * @brief 建立io_uring并映射SQ/CQ
+ *
+ * @param entries 队列深度
+ * @return int
+ */
+static int nfs_uring_setup(unsigned entries) {
+    struct io_uring_params p;
+    memset(&nfs_uring, 0, sizeof(struct nfs_uring));
+    memset(&p, 0, sizeof(struct io_uring_params));
+    nfs_uring.ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (nfs_uring.ring_fd < 0) {
+        return -NFS_ERROR_UNSUPPORTED;
+    }
+    nfs_uring.entries = p.sq_entries;
+    nfs_uring.sq_sz   = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    nfs_uring.cq_sz   = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    nfs_uring.sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (nfs_uring.cq_sz > nfs_uring.sq_sz) {
+            nfs_uring.sq_sz = nfs_uring.cq_sz;
+        }
+        nfs_uring.cq_sz = nfs_uring.sq_sz;
+    }
+    nfs_uring.sq_ptr = mmap(NULL, nfs_uring.sq_sz, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, nfs_uring.ring_fd, IORING_OFF_SQ_RING);
+    if (nfs_uring.sq_ptr == MAP_FAILED) {
+        close(nfs_uring.ring_fd);
+        return -NFS_ERROR_UNSUPPORTED;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        nfs_uring.cq_ptr = nfs_uring.sq_ptr;
+    } else {
+        nfs_uring.cq_ptr = mmap(NULL, nfs_uring.cq_sz, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, nfs_uring.ring_fd, IORING_OFF_CQ_RING);
+        if (nfs_uring.cq_ptr == MAP_FAILED) {
+            munmap(nfs_uring.sq_ptr, nfs_uring.sq_sz);
+            close(nfs_uring.ring_fd);
+            return -NFS_ERROR_UNSUPPORTED;
+        }
+    }
+    nfs_uring.sqes = mmap(NULL, nfs_uring.sqes_sz, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, nfs_uring.ring_fd, IORING_OFF_SQES);
+    if (nfs_uring.sqes == MAP_FAILED) {
+        if (nfs_uring.cq_ptr != nfs_uring.sq_ptr) {
+            munmap(nfs_uring.cq_ptr, nfs_uring.cq_sz);
+        }
+        munmap(nfs_uring.sq_ptr, nfs_uring.sq_sz);
+        close(nfs_uring.ring_fd);
+        return -NFS_ERROR_UNSUPPORTED;
+    }
+    nfs_uring.sq_head  = (unsigned*)((char*)nfs_uring.sq_ptr + p.sq_off.head);
+    nfs_uring.sq_tail  = (unsigned*)((char*)nfs_uring.sq_ptr + p.sq_off.tail);
+    nfs_uring.sq_mask  = (unsigned*)((char*)nfs_uring.sq_ptr + p.sq_off.ring_mask);
+    nfs_uring.sq_array = (unsigned*)((char*)nfs_uring.sq_ptr + p.sq_off.array);
+    nfs_uring.cq_head  = (unsigned*)((char*)nfs_uring.cq_ptr + p.cq_off.head);
+    nfs_uring.cq_tail  = (unsigned*)((char*)nfs_uring.cq_ptr + p.cq_off.tail);
+    nfs_uring.cq_mask  = (unsigned*)((char*)nfs_uring.cq_ptr + p.cq_off.ring_mask);
+    nfs_uring.cqes     = (struct io_uring_cqe*)((char*)nfs_uring.cq_ptr + p.cq_off.cqes);
+    return NFS_ERROR_NONE;
+}
+
+static void nfs_uring_teardown() {
+    munmap(nfs_uring.sqes, nfs_uring.sqes_sz);
+    if (nfs_uring.cq_ptr != nfs_uring.sq_ptr) {
+        munmap(nfs_uring.cq_ptr, nfs_uring.cq_sz);
+    }
+    munmap(nfs_uring.sq_ptr, nfs_uring.sq_sz);
+    close(nfs_uring.ring_fd);
+}
+
+static int nfs_uring_open(const char* path) {
+    int fd = nfs_img_open(path);
+    if (fd < 0) {
+        return fd;
+    }
+    if (nfs_uring_setup(NFS_URING_QD) != NFS_ERROR_NONE) {
+        close(fd);
+        return -NFS_ERROR_UNSUPPORTED;
+    }
+    return fd;
+}
+
+static int nfs_uring_close(int fd) {
+    nfs_uring_teardown();
+    fsync(fd);
+    return close(fd);
+}
+
+/**
+ * @brief 把一个请求放入SQ
+ *
+ * @param fd
+ * @param req
+ * @param idx 请求下标，作为user_data带回
+ * @param is_write
+ */
+static void nfs_uring_prep(int fd, struct nfs_uring_req* req, int idx, int is_write) {
+    unsigned             tail = *nfs_uring.sq_tail;
+    unsigned             slot = tail & *nfs_uring.sq_mask;
+    struct io_uring_sqe* sqe  = &nfs_uring.sqes[slot];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode    = is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd        = fd;
+    sqe->addr      = (unsigned long)&req->vec;
+    sqe->len       = 1;
+    sqe->off       = req->offset;
+    sqe->user_data = idx;
+    nfs_uring.sq_array[slot] = slot;
+    __atomic_store_n(nfs_uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief 批量提交各段并等待全部完成。出错后不再提交新请求，已放入SQ但未提交
+ *        的请求撤回，已提交的请求全部完成后才返回，内核不会再访问请求数组
+ *
+ * @param fd
+ * @param iov
+ * @param cnt
+ * @param is_write
+ * @return int
+ */
+static int nfs_uring_rw(int fd, struct nfs_iovec* iov, int cnt, int is_write) {
+    struct nfs_uring_req* reqs;
+    int      req_cnt = 0, next = 0, inflight = 0, to_submit = 0;
+    int      i, len, n, ret = NFS_ERROR_NONE;
+    unsigned head;
+
+    if (nfs_uring.broken) {
+        for (i = 0; i < cnt; i++) {
+            nfs_img_account(iov[i].offset, iov[i].size, is_write);
+            if (nfs_img_pio(fd, iov[i].offset, iov[i].buf, iov[i].size,
+                            is_write) != NFS_ERROR_NONE) {
+                return -NFS_ERROR_IO;
+            }
+        }
+        return NFS_ERROR_NONE;
+    }
+    for (i = 0; i < cnt; i++) {
+        req_cnt += NFS_ROUND_UP(iov[i].size, NFS_URING_CHUNK) / NFS_URING_CHUNK;
+    }
+    if (req_cnt == 0) {
+        return NFS_ERROR_NONE;
+    }
+    reqs = (struct nfs_uring_req*)malloc(req_cnt * sizeof(struct nfs_uring_req));
+    if (reqs == NULL) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    // 拆分成请求
+    req_cnt = 0;
+    for (i = 0; i < cnt; i++) {
+        nfs_img_account(iov[i].offset, iov[i].size, is_write);
+        for (len = 0; len < iov[i].size; len += NFS_URING_CHUNK) {
+            reqs[req_cnt].offset       = iov[i].offset + len;
+            reqs[req_cnt].vec.iov_base = iov[i].buf + len;
+            reqs[req_cnt].vec.iov_len  = iov[i].size - len < NFS_URING_CHUNK ?
+                                         iov[i].size - len : NFS_URING_CHUNK;
+            req_cnt++;
+        }
+    }
+
+    while (inflight > 0 || to_submit > 0 || (ret == NFS_ERROR_NONE && next < req_cnt)) {
+        // 填满队列
+        while (ret == NFS_ERROR_NONE && next < req_cnt
+               && inflight + to_submit < (int)nfs_uring.entries) {
+            nfs_uring_prep(fd, &reqs[next], next, is_write);
+            next++;
+            to_submit++;
+        }
+        n = syscall(__NR_io_uring_enter, nfs_uring.ring_fd, to_submit, 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            NFS_DBG("[%s] io_uring_enter failed\n", __func__);
+            ret = -NFS_ERROR_IO;
+            if (to_submit > 0) {
+                // 没有SQ轮询线程，未提交的请求只在这里被消费，可以安全撤回
+                __atomic_store_n(nfs_uring.sq_tail,
+                                 __atomic_load_n(nfs_uring.sq_head, __ATOMIC_ACQUIRE),
+                                 __ATOMIC_RELEASE);
+                to_submit = 0;
+                continue;
+            }
+            // 无法等待在途的请求完成：请求数组留给内核，不再使用这个io_uring
+            nfs_uring.broken = 1;
+            return ret;
+        }
+        // 可能只提交了一部分，剩下的留在SQ中下一轮再提交
+        to_submit -= n;
+        inflight  += n;
+        // 收割完成的请求
+        head = *nfs_uring.cq_head;
+        while (head != __atomic_load_n(nfs_uring.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe*  cqe = &nfs_uring.cqes[head & *nfs_uring.cq_mask];
+            struct nfs_uring_req* req = &reqs[cqe->user_data];
+            int                   res = cqe->res;
+            head++;
+            inflight--;
+            if (res == (int)req->vec.iov_len) {
+                continue;
+            }
+            // 出错或短读写，剩余部分同步完成
+            if (res < 0 && res != -EINTR && res != -EAGAIN) {
+                NFS_DBG("[%s] io error at %d\n", __func__, req->offset);
+                ret = -NFS_ERROR_IO;
+                continue;
+            }
+            if (res < 0) {
+                res = 0;
+            }
+            if (nfs_img_pio(fd, req->offset + res, (uint8_t*)req->vec.iov_base + res,
+                            req->vec.iov_len - res, is_write) != NFS_ERROR_NONE) {
+                ret = -NFS_ERROR_IO;
+            }
+        }
+        __atomic_store_n(nfs_uring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    free(reqs);
+    return ret;
+}
+
+static int nfs_uring_readv(int fd, struct nfs_iovec* iov, int cnt) {
+    return nfs_uring_rw(fd, iov, cnt, 0);
+}
+
+static int nfs_uring_writev(int fd, struct nfs_iovec* iov, int cnt) {
+    return nfs_uring_rw(fd, iov, cnt, 1);
+}
+
+static struct nfs_backend nfs_uring_ops = {
+    .name   = "uring",
+    .open   = nfs_uring_open,
+    .close  = nfs_uring_close,
+    .ioctl  = nfs_img_ioctl,
+    .readv  = nfs_uring_readv,
+    .writev = nfs_uring_writev,
+    .sync   = nfs_img_sync,
+    .is_file = 1,
+};
+
+/**
+ * @brief 获取io_uring后端
+ *
+ * @return struct nfs_backend* 编译环境不支持时返回NULL
+ */
+struct nfs_backend* nfs_uring_backend() {
+    return &nfs_uring_ops;
+}
+
+#else
+
+struct nfs_backend* nfs_uring_backend() {
+    return NULL;
+}
+
+#endif /* NFS_HAVE_URING */